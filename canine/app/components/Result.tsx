@@ -103,7 +103,8 @@ const Result: React.FC<ResultProps> = (props): React.ReactElement | null => {
           if (
             r.type === "Control" ||
             r.type === "Signal" ||
-            r.type === "ExitCode"
+            r.type === "ExitCode" ||
+            r.type === "Usage"
           ) {
             return null;
           }
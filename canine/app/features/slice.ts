@@ -34,7 +34,8 @@ type ResultType =
   | "StdOut"
   | "StdErr"
   | "ExitCode"
-  | "Signal";
+  | "Signal"
+  | "Usage";
 
 export interface ResultData {
   type: ResultType;
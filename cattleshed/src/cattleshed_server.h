@@ -1,16 +1,19 @@
 #ifndef CATTLESHED_SERVER_H_INCLUDED
 #define CATTLESHED_SERVER_H_INCLUDED
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <set>
 #include <sstream>
 #include <thread>
 #include <tuple>
 
 // Linux
-#include <aio.h>
 #include <locale.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
@@ -23,146 +26,338 @@
 // spdlog
 #include <spdlog/spdlog.h>
 
-// protobuf
-#include <google/protobuf/json/json.h>
-
 #include "cattleshed.grpc.pb.h"
 #include "cattleshed.pb.h"
+#include "compile_cache.h"
+#include "config_watcher.h"
+#include "jail_timing.h"
+#include "job_cgroup.h"
+#include "job_scheduler.h"
+#include "run_log.h"
 #include "load_config.hpp"
 #include "posixapi.hpp"
+#include "version_cache.h"
+#include "workdir_pool.h"
+#include "zygote_supervisor.h"
+
+// ジョブを動かす io_context と、その io_context で子プロセスを待つための signal_set の組
+//
+// １つのジョブ（ProgramWriter/ProgramRunner）は必ず１つのシャード上だけで動かすので、
+// ジョブ内の状態にはロックが要らない。
+// file_pool はブロッキングするファイル書き込み用で、全シャードで共有する。
+struct CattleshedShard {
+  std::shared_ptr<boost::asio::io_context> ioc;
+  std::shared_ptr<boost::asio::signal_set> sigs;
+  std::shared_ptr<boost::asio::thread_pool> file_pool;
+};
+
+class CattleshedShards {
+ public:
+  explicit CattleshedShards(int n) {
+    auto file_pool = std::make_shared<boost::asio::thread_pool>(n);
+    for (int i = 0; i < n; i++) {
+      CattleshedShard shard;
+      shard.ioc = std::make_shared<boost::asio::io_context>(1);
+      // シグナルは全ての signal_set に配送されるので、シャードごとに持っておく
+      shard.sigs = std::make_shared<boost::asio::signal_set>(*shard.ioc, SIGCHLD);
+      shard.file_pool = file_pool;
+      shards_.push_back(std::move(shard));
+    }
+  }
+
+  // ラウンドロビンで次のシャードを選ぶ
+  const CattleshedShard& Next() {
+    return shards_[next_.fetch_add(1) % shards_.size()];
+  }
+
+  const std::vector<CattleshedShard>& All() const { return shards_; }
+
+ private:
+  std::vector<CattleshedShard> shards_;
+  std::atomic<std::size_t> next_{0};
+};
 
 class GetVersionHandler
     : public ggrpc::ServerResponseWriterHandler<wandbox::cattleshed::GetVersionResponse,
                                                 wandbox::cattleshed::GetVersionRequest> {
  public:
   GetVersionHandler(wandbox::cattleshed::Cattleshed::AsyncService* service,
-                    std::shared_ptr<boost::asio::io_context> ioc,
-                    std::shared_ptr<boost::asio::signal_set> sigs,
-                    const wandbox::server_config* config)
-      : service_(service), ioc_(ioc), sigs_(sigs), config_(config) {}
+                    std::shared_ptr<CattleshedShards> shards,
+                    std::shared_ptr<CompileCache> cache,
+                    std::shared_ptr<VersionCache> version_cache,
+                    std::shared_ptr<ConfigStore> config_store)
+      : service_(service),
+        shards_(shards),
+        cache_(cache),
+        version_cache_(version_cache),
+        config_store_(config_store) {}
 
  private:
+  // 各コンパイラの version_command を、同時に実行する数を制限しながら並列に実行する
   struct VersionRunner {
     VersionRunner(std::shared_ptr<boost::asio::io_context> ioc,
                   std::shared_ptr<boost::asio::signal_set> sigs,
-                  const wandbox::server_config& config)
-        : ioc_(ioc), sigs_(sigs), config_(&config) {
-      for (const wandbox::compiler_trait& c : config_->compilers) {
-        commands_.push_back(c);
+                  std::shared_ptr<const wandbox::server_config> config,
+                  std::vector<const wandbox::compiler_trait*> commands)
+        : ioc_(ioc),
+          sigs_(sigs),
+          config_(std::move(config)),
+          commands_(std::move(commands)) {
+      results_.resize(commands_.size());
+      concurrency_ = config_->system.version_probe_concurrency;
+      if (concurrency_ <= 0) {
+        concurrency_ = std::max(1u, std::thread::hardware_concurrency());
+      }
+      timeout_ = config_->system.version_probe_timeout;
+      if (timeout_ <= 0) {
+        timeout_ = 10;
       }
     }
     void AsyncRun(std::function<
                   void(boost::system::error_code ec,
                        const std::vector<std::pair<std::string, std::string>>&)>
                       handler) {
-      // 全部のバージョン取得処理が終わったので結果を返す
-      if (commands_.empty()) {
-        handler(boost::system::error_code(), versions_);
-        handler = nullptr;
+      handler_ = std::move(handler);
+      start_ = std::chrono::steady_clock::now();
+      SPDLOG_INFO("[0x{}] probe {} versions, concurrency={} timeout={}s",
+                  (void*)this, commands_.size(), concurrency_, timeout_);
+      for (int i = 0; i < concurrency_; i++) {
+        StartNext();
+      }
+      MaybeComplete();
+    }
+
+   private:
+    // １つの version_command の実行
+    struct Probe {
+      std::size_t index;
+      std::shared_ptr<wandbox::unique_child_pid> child;
+      std::shared_ptr<boost::asio::posix::stream_descriptor> pipe_stdout;
+      std::shared_ptr<boost::asio::posix::stream_descriptor> pidfd;
+      std::shared_ptr<boost::asio::streambuf> buf;
+      std::shared_ptr<boost::asio::steady_timer> timer;
+    };
+
+    void StartNext() {
+      while (next_ < commands_.size()) {
+        const std::size_t index = next_++;
+        const wandbox::compiler_trait& current = *commands_[index];
+
+        auto probe = std::make_shared<Probe>();
+        probe->index = index;
+        try {
+          auto c = wandbox::piped_spawn(wandbox::opendir("/"),
+                                        current.version_command);
+          SPDLOG_INFO("[0x{}] run [{}]", (void*)this,
+                      boost::algorithm::join(current.version_command, " "));
+          probe->child =
+              std::make_shared<wandbox::unique_child_pid>(std::move(c.pid));
+          probe->pipe_stdout =
+              std::make_shared<boost::asio::posix::stream_descriptor>(
+                  *ioc_, c.fd_stdout.get());
+          c.fd_stdout.release();
+          if (c.pidfd) {
+            probe->pidfd =
+                std::make_shared<boost::asio::posix::stream_descriptor>(
+                    *ioc_, c.pidfd.release());
+          }
+        } catch (std::exception& e) {
+          // 起動に失敗したので次へ
+          SPDLOG_WARN("[0x{}] failed to run version command of {}: {}",
+                      (void*)this, current.name, e.what());
+          continue;
+        }
+
+        running_ += 1;
+
+        // 一定時間経っても終わらなければ殺す
+        probe->timer = std::make_shared<boost::asio::steady_timer>(*ioc_);
+        probe->timer->expires_after(std::chrono::seconds(timeout_));
+        probe->timer->async_wait(std::bind(&VersionRunner::OnTimeout, this,
+                                           probe, std::placeholders::_1));
+
+        // 実行完了を待つ
+        DoWait(probe);
         return;
       }
+    }
 
-      current_ = commands_.front();
-      commands_.pop_front();
-      if (current_.version_command.empty() || not current_.displayable) {
-        // 次へ
-        AsyncRun(std::move(handler));
+    void MaybeComplete() {
+      if (running_ != 0 || next_ < commands_.size() || !handler_) {
         return;
       }
 
-      // 実行開始
-      {
-        auto c = wandbox::piped_spawn(wandbox::opendir("/"),
-                                      current_.version_command);
-        SPDLOG_INFO("[0x{}] run [{}]", (void*)this,
-                    boost::algorithm::join(current_.version_command, " "));
-        child_ = std::make_shared<wandbox::unique_child_pid>(std::move(c.pid));
-        pipe_stdout_ = std::make_shared<boost::asio::posix::stream_descriptor>(
-            *ioc_, c.fd_stdout.get());
-        c.fd_stdout.release();
+      // 全部のバージョン取得処理が終わったので、設定ファイルの順番で結果を返す
+      std::vector<std::pair<std::string, std::string>> versions;
+      for (std::size_t i = 0; i < commands_.size(); i++) {
+        if (results_[i]) {
+          versions.push_back(std::make_pair(commands_[i]->name, *results_[i]));
+        }
       }
+      SPDLOG_INFO(
+          "[0x{}] probed {} versions in {} ms", (void*)this, versions.size(),
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - start_)
+              .count());
+
+      auto handler = std::move(handler_);
+      handler_ = nullptr;
+      handler(boost::system::error_code(), versions);
+    }
 
-      // 実行完了を待つ
-      sigs_->async_wait(std::bind(&VersionRunner::OnWait, this,
-                                  std::placeholders::_1,
-                                  std::placeholders::_2));
+    // このプローブが終わったので次を開始する
+    void Finish(std::shared_ptr<Probe> probe) {
+      probe->timer->cancel();
+      running_ -= 1;
+      StartNext();
+      MaybeComplete();
+    }
 
-      handler_ = std::move(handler);
+    void DoWait(std::shared_ptr<Probe> probe) {
+      // pidfd が使える場合は、このプロセスの終了時にだけ起こされる
+      if (probe->pidfd) {
+        probe->pidfd->async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            std::bind(&VersionRunner::OnWait, this, probe,
+                      std::placeholders::_1));
+      } else {
+        WaitSigchld(std::move(probe));
+      }
     }
 
-   private:
-    void OnWait(const boost::system::error_code& ec, int signum) {
-      child_->wait_nonblock();
-      if (not child_->finished()) {
+    // pidfd が使えない場合は SIGCHLD で起こされる。
+    // SIGCHLD はまとめて１回しか届かないことがあるので、プローブごとには待たずに、
+    // 起こされるたびに待っている全部のプローブの終了を確認する
+    void WaitSigchld(std::shared_ptr<Probe> probe) {
+      sigchld_probes_.push_back(std::move(probe));
+      if (sigchld_waiting_) {
+        return;
+      }
+      sigchld_waiting_ = true;
+      sigs_->async_wait(std::bind(&VersionRunner::OnSigchld, this,
+                                  std::placeholders::_1));
+    }
+
+    void OnSigchld(const boost::system::error_code& ec) {
+      sigchld_waiting_ = false;
+      if (ec == boost::asio::error::operation_aborted) {
+        return;
+      }
+      // 終わっていないプローブは OnWait から WaitSigchld で戻ってくる
+      auto probes = std::move(sigchld_probes_);
+      sigchld_probes_.clear();
+      for (auto& probe : probes) {
+        OnWait(std::move(probe), ec);
+      }
+    }
+
+    void OnWait(std::shared_ptr<Probe> probe,
+                const boost::system::error_code& ec) {
+      if (ec == boost::asio::error::operation_aborted) {
+        return;
+      }
+      probe->child->wait_nonblock();
+      if (not probe->child->finished()) {
         // まだ終わってないので再度待つ
-        sigs_->async_wait(std::bind(&VersionRunner::OnWait, this,
-                                    std::placeholders::_1,
-                                    std::placeholders::_2));
+        DoWait(probe);
         return;
       }
 
       {
-        int st = child_->wait_nonblock();
+        int st = probe->child->wait_nonblock();
         SPDLOG_DEBUG("[0x{}] WIFEXITED(st): {}, WEXITSTATUS(st): {}",
                      (void*)this, WIFEXITED(st), WEXITSTATUS(st));
         // バージョン取得に失敗したので次へ
         if (!WIFEXITED(st) || (WEXITSTATUS(st) != 0)) {
-          AsyncRun(std::move(handler_));
+          Finish(probe);
           return;
         }
       }
 
       // 出力の読み込み
-      DoRead();
+      DoRead(probe);
     }
 
-    void DoRead() {
-      buf_ = std::make_shared<boost::asio::streambuf>();
+    // タイマーは Finish まで止めないので、出力の読み込み中にも呼ばれる
+    void OnTimeout(std::shared_ptr<Probe> probe,
+                   const boost::system::error_code& ec) {
+      if (ec) {
+        // タイマーがキャンセルされた（＝時間内に終わった）
+        return;
+      }
+      if (probe->child->finished()) {
+        // 終了した後も、孫プロセスが標準出力を開いたままだと読み込みが終わらないので、
+        // パイプを閉じて OnRead を失敗させる
+        SPDLOG_WARN("[0x{}] reading version of {} timed out, close stdout",
+                    (void*)this, commands_[probe->index]->name);
+        boost::system::error_code close_ec;
+        probe->pipe_stdout->close(close_ec);
+        return;
+      }
+      SPDLOG_WARN("[0x{}] version command of {} timed out, send SIGKILL",
+                  (void*)this, commands_[probe->index]->name);
+      if (probe->pidfd) {
+        wandbox::pidfd_send_signal(probe->pidfd->native_handle(), SIGKILL);
+      } else {
+        ::kill(probe->child->get(), SIGKILL);
+      }
+    }
+
+    void DoRead(std::shared_ptr<Probe> probe) {
+      probe->buf = std::make_shared<boost::asio::streambuf>();
       boost::asio::async_read_until(
-          *pipe_stdout_, *buf_, '\n',
-          std::bind(&VersionRunner::OnRead, this, std::placeholders::_1,
+          *probe->pipe_stdout, *probe->buf, '\n',
+          std::bind(&VersionRunner::OnRead, this, probe, std::placeholders::_1,
                     std::placeholders::_2));
     }
 
-    void OnRead(boost::system::error_code ec, std::size_t bytes_transferred) {
+    void OnRead(std::shared_ptr<Probe> probe, boost::system::error_code ec,
+                std::size_t bytes_transferred) {
+      const wandbox::compiler_trait& current = *commands_[probe->index];
+
       // なぜか失敗したので次へ
       if (ec) {
         SPDLOG_WARN("[0x{}] failed to async_read_until: {}", (void*)this,
                     ec.message());
-        AsyncRun(std::move(handler_));
+        Finish(probe);
         return;
       }
 
-      std::istream is(buf_.get());
+      std::istream is(probe->buf.get());
       std::string ver;
       if (!std::getline(is, ver)) {
         SPDLOG_WARN("[0x{}] failed to getline", (void*)this);
-        AsyncRun(std::move(handler_));
+        Finish(probe);
         return;
       }
 
-      SPDLOG_INFO("[0x{}] add version: {} {}", (void*)this, current_.name,
+      SPDLOG_INFO("[0x{}] add version: {} {}", (void*)this, current.name,
                    ver);
-      versions_.push_back(std::make_pair(current_.name, ver));
+      results_[probe->index] = ver;
 
       // 無事バージョンの取得に成功したので次へ
-      AsyncRun(std::move(handler_));
+      Finish(probe);
     }
 
    private:
     std::shared_ptr<boost::asio::io_context> ioc_;
     std::shared_ptr<boost::asio::signal_set> sigs_;
-    const wandbox::server_config* config_;
-
-    wandbox::compiler_trait current_;
-    std::deque<wandbox::compiler_trait> commands_;
+    std::shared_ptr<const wandbox::server_config> config_;
+
+    // config_ の中を指している
+    std::vector<const wandbox::compiler_trait*> commands_;
+    std::vector<boost::optional<std::string>> results_;
+    std::size_t next_ = 0;
+    int running_ = 0;
+    int concurrency_;
+    int timeout_;
+    std::chrono::steady_clock::time_point start_;
+    // SIGCHLD で終了を待っているプローブ
+    std::vector<std::shared_ptr<Probe>> sigchld_probes_;
+    bool sigchld_waiting_ = false;
     std::function<void(boost::system::error_code ec,
                        const std::vector<std::pair<std::string, std::string>>&)>
         handler_;
-    std::vector<std::pair<std::string, std::string>> versions_;
-    std::shared_ptr<boost::asio::posix::stream_descriptor> pipe_stdout_;
-    std::shared_ptr<wandbox::unique_child_pid> child_;
-    std::shared_ptr<boost::asio::streambuf> buf_;
   };
 
   void Request(grpc::ServerContext* context,
@@ -173,16 +368,61 @@ class GetVersionHandler
     service_->RequestGetVersion(context, request, response_writer, cq, cq, tag);
   }
   void OnAccept(wandbox::cattleshed::GetVersionRequest request) override {
-    version_runner_.reset(new VersionRunner(ioc_, sigs_, *config_));
-    version_runner_->AsyncRun(
-        [this, context = Context()](
-            boost::system::error_code ec,
-            const std::vector<std::pair<std::string, std::string>>& versions) {
-          // バージョンが取得できたので、レスポンス用データを作る
-          auto resp = GenResponse(*config_, versions);
-
-          context->Finish(std::move(resp), grpc::Status::OK);
-        });
+    auto context = Context();
+    // 途中で設定が読み直されても、このリクエストでは同じ設定を使う
+    auto config = config_store_->Get();
+
+    // 最近作ったレスポンスがあればそのまま返す
+    if (auto resp = version_cache_->GetFresh(config)) {
+      context->Finish(*resp, grpc::Status::OK);
+      return;
+    }
+
+    const CattleshedShard& shard = shards_->Next();
+    // 既に他のリクエストが更新中なら、その結果を待つ
+    if (!version_cache_->BeginUpdate(
+            shard.ioc,
+            [context](std::shared_ptr<
+                      const wandbox::cattleshed::GetVersionResponse>
+                          resp) { context->Finish(*resp, grpc::Status::OK); })) {
+      return;
+    }
+
+    // ツールチェインが変わったコンパイラだけバージョンを取り直す
+    auto identities =
+        std::make_shared<std::unordered_map<std::string, std::string>>();
+    auto changed = std::make_shared<std::vector<const wandbox::compiler_trait*>>(
+        version_cache_->Changed(*config, identities.get()));
+    SPDLOG_INFO("[0x{}] {} compilers changed", (void*)this, changed->size());
+
+    version_runner_.reset(
+        new VersionRunner(shard.ioc, shard.sigs, config, *changed));
+    // バージョン取得処理は全部シャードのスレッド上で動かす
+    boost::asio::post(*shard.ioc, [this, runner = version_runner_, config,
+                                   identities, changed]() {
+      runner->AsyncRun(
+          [this, config, identities, changed](
+              boost::system::error_code ec,
+              const std::vector<std::pair<std::string, std::string>>&
+                  probed) {
+            bool modified;
+            const auto versions = version_cache_->Update(
+                *config, *identities, *changed, probed, &modified);
+            auto resp = version_cache_->Current(config);
+            if (modified || !resp) {
+              // コンパイルキャッシュのキーに使うので覚えておく
+              if (cache_) {
+                cache_->SetVersions(versions);
+              }
+
+              // バージョンが取得できたので、レスポンス用データを作る
+              resp = std::make_shared<wandbox::cattleshed::GetVersionResponse>(
+                  GenResponse(*config, versions));
+            }
+
+            version_cache_->EndUpdate(config, resp);
+          });
+    });
   }
 
   static wandbox::cattleshed::GetVersionResponse GenResponse(
@@ -334,10 +574,11 @@ class GetVersionHandler
   }
 
  private:
-  std::shared_ptr<boost::asio::io_context> ioc_;
-  std::shared_ptr<boost::asio::signal_set> sigs_;
-  const wandbox::server_config* config_;
   wandbox::cattleshed::Cattleshed::AsyncService* service_;
+  std::shared_ptr<CattleshedShards> shards_;
+  std::shared_ptr<CompileCache> cache_;
+  std::shared_ptr<VersionCache> version_cache_;
+  std::shared_ptr<ConfigStore> config_store_;
   std::shared_ptr<VersionRunner> version_runner_;
 };
 
@@ -346,11 +587,32 @@ class RunJobHandler
                                               wandbox::cattleshed::RunJobRequest> {
  public:
   RunJobHandler(wandbox::cattleshed::Cattleshed::AsyncService* service,
-                std::shared_ptr<boost::asio::io_context> ioc,
-                std::shared_ptr<boost::asio::signal_set> sigs,
-                const wandbox::server_config* config)
-      : ioc_(ioc), sigs_(sigs), service_(service), config_(config) {}
-  ~RunJobHandler() { SPDLOG_TRACE("[0x{}] deleted", (void*)this); }
+                std::shared_ptr<CattleshedShards> shards,
+                std::shared_ptr<CompileCache> cache,
+                std::shared_ptr<JobScheduler> scheduler,
+                std::shared_ptr<WorkdirPool> workdirs,
+                std::shared_ptr<RunLog> run_log,
+                std::shared_ptr<JailTiming> jail_timing,
+                std::shared_ptr<ConfigStore> config_store)
+      : service_(service),
+        cache_(cache),
+        scheduler_(scheduler),
+        workdirs_(workdirs),
+        run_log_(run_log),
+        jail_timing_(jail_timing),
+        config_store_(config_store) {
+    // このジョブはずっと同じシャード上で動かす
+    const CattleshedShard& shard = shards->Next();
+    ioc_ = shard.ioc;
+    sigs_ = shard.sigs;
+    file_pool_ = shard.file_pool;
+    write_window_ = std::make_shared<ProgramRunner::WriteWindow>();
+  }
+  ~RunJobHandler() {
+    // 作業ディレクトリはバックグラウンドで削除する
+    workdirs_->Release(workdirpath_);
+    SPDLOG_TRACE("[0x{}] deleted", (void*)this);
+  }
 
  public:
   // Success を呼ばずに return した場合、必ず Finish を呼ぶガード
@@ -393,6 +655,8 @@ class RunJobHandler
 
     req_start_ = req.start();
 
+    // このジョブが終わるまで、この設定を使い続ける
+    config_ = config_store_->Get();
     const auto it = config_->compilers.get<1>().find(req_start_.compiler());
     // 設定が見つからない
     if (it == config_->compilers.get<1>().end()) {
@@ -403,21 +667,55 @@ class RunJobHandler
 
     // 実行開始
     started_ = true;
+    target_compiler_ = &*it;
+
+    // 同時に実行するジョブの数が制限を超えないように、実行できるようになるまで待つ
+    // ここから先の処理は全てシャードのスレッド上で行う
+    const auto jail = config_->jails.find(target_compiler_->jail_name);
+    job_ticket_ = scheduler_->Enqueue(
+        IssuerKey(req_start_.issuer()), target_compiler_->jail_name,
+        jail == config_->jails.end() ? 0 : jail->second.max_running_jobs, ioc_,
+        [context = Context(), window = write_window_](int position) {
+          // 何番目に実行されるかを通知する
+          wandbox::cattleshed::RunJobResponse resp;
+          resp.set_type(wandbox::cattleshed::RunJobResponse::CONTROL);
+          resp.set_data("Queued:" + std::to_string(position));
+          window->Acquire();
+          context->Write(resp);
+        },
+        std::bind(&RunJobHandler::OnScheduled, this));
+    guard.Success();
+  }
 
+  void OnScheduled() {
     // まずソースをファイルに書き込む
     // ここは sandbox の外なのですごく気をつける必要がある
     program_writer_.reset(
-        new ProgramWriter(ioc_, *config_, *it, req_start_, sigs_));
+        new ProgramWriter(ioc_, file_pool_, workdirs_, run_log_, config_,
+                          *target_compiler_, req_start_));
     program_writer_->AsyncWriteProgram(
         std::bind(&RunJobHandler::OnWriteProgram, this, std::placeholders::_1,
                   std::placeholders::_2, std::placeholders::_3));
-    guard.Success();
+  }
+
+  // 同じ発行者のジョブは同じキューに積む
+  static std::string IssuerKey(const wandbox::cattleshed::Issuer& issuer) {
+    if (!issuer.real_ip().empty()) {
+      return issuer.real_ip();
+    }
+    if (!issuer.forwarded_for().empty()) {
+      return issuer.forwarded_for();
+    }
+    return issuer.remote_addr();
   }
 
   void OnWriteProgram(const boost::system::error_code& ec,
                       std::shared_ptr<DIR> workdir, std::string workdirpath) {
     FinishGuard guard(this);
 
+    // 失敗していても作業ディレクトリは取得済みの場合があるので覚えておく
+    workdirpath_ = workdirpath;
+
     if (ec) {
       SPDLOG_ERROR("[0x{}] failed to write program: {}", (void*)this,
                    ec.message());
@@ -427,19 +725,21 @@ class RunJobHandler
     // ソースの書き込みが終わったらサンドボックス上でコンパイラとかを実行する
     program_writer_.reset();
 
-    const wandbox::compiler_trait& target_compiler =
-        *config_->compilers.get<1>().find(req_start_.compiler());
-    auto send = [context = Context()](const wandbox::cattleshed::RunJobResponse& resp) {
+    auto send = [context = Context(), window = write_window_](
+                    const wandbox::cattleshed::RunJobResponse& resp) {
+      window->Acquire();
       context->Write(resp);
     };
-    program_runner_.reset(new ProgramRunner(ioc_, *config_, req_start_, sigs_,
-                                            workdir, workdirpath,
-                                            target_compiler, send));
+    program_runner_.reset(new ProgramRunner(
+        ioc_, config_, req_start_, sigs_, workdir, workdirpath,
+        *target_compiler_, cache_, jail_timing_, send, write_window_));
     program_runner_->AsyncRun(std::bind(&RunJobHandler::OnRun, this));
     guard.Success();
   }
   void OnRun() {
     program_runner_.reset();
+    // 次のジョブが実行できるように枠を空ける
+    job_ticket_.reset();
     auto context = Context();
     if (context) {
       context->Finish(grpc::Status::OK);
@@ -448,6 +748,12 @@ class RunJobHandler
 
   void OnReadDoneOrError() {}
 
+  // gRPC のスレッドから呼ばれるので、シャードのスレッドに戻してから枠を空ける
+  void OnWrite(wandbox::cattleshed::RunJobResponse resp, int64_t id) override {
+    boost::asio::post(*ioc_,
+                      [window = write_window_]() { window->Release(); });
+  }
+
  private:
   class ProgramWriter {
    public:
@@ -471,57 +777,42 @@ class RunJobHandler
         time = s;
       }
 
-      std::string unique_name;
-      std::shared_ptr<DIR> workdir;
-      while (unique_name.empty() || !workdir) {
-        try {
-          unique_name = wandbox::mkdtemp("wandbox_" + time + "_XXXXXX");
-          workdir = wandbox::opendir(unique_name);
-        } catch (std::system_error& e) {
-          if (e.code().value() != ENOTDIR) {
-            cb_(boost::system::error_code(e.code().value(),
-                                          boost::system::generic_category()),
-                nullptr, "");
-            return;
-          }
-        }
-      }
-
-      std::string logdirnamebase = config_->system.storedir + "/" + date;
-      std::string logdirname = logdirnamebase + "/" + unique_name;
-      SPDLOG_INFO("[0x{}] create log directory '{}'", (void*)this, logdirname);
-      const auto logdirbase =
-          wandbox::mkdir_p_open_at(nullptr, logdirnamebase, 0700);
-      const auto logdir =
-          wandbox::mkdir_p_open_at(logdirbase, unique_name, 0700);
-      if (!logdir) {
-        SPDLOG_ERROR("[0x{}] failed to create log directory '{}'", (void*)this,
-                     logdirname);
-        cb_(boost::system::error_code(errno, boost::system::generic_category()),
+      // 作業ディレクトリは事前に作られているものを使う
+      WorkdirPool::Workdir w;
+      try {
+        const wandbox::jail_config& jail =
+            config_->jails.at(target_compiler_->jail_name);
+        w = workdirs_->Acquire({jail.tmpfs_size, jail.tmpfs_inodes});
+      } catch (std::system_error& e) {
+        cb_(boost::system::error_code(e.code().value(),
+                                      boost::system::generic_category()),
             nullptr, "");
         return;
       }
-
-      SPDLOG_INFO("[0x{}] using temporary name '{}'", (void*)this, unique_name);
+      const std::shared_ptr<DIR> workdir = w.dir;
+      // 作業ディレクトリの名前は wandbox_XXXXXX なので、ログの名前には時刻も入れておく
+      const std::string unique_name =
+          "wandbox_" + time + "_" +
+          w.path.substr(w.path.find_last_of('/') + 1 + 8);
+      // ここから先で失敗した場合も、作業ディレクトリは呼び出し側で返してもらう
+      workdirpath_ = w.path;
+
+      SPDLOG_INFO("[0x{}] using working directory '{}'", (void*)this,
+                  workdirpath_);
       const auto savedir = wandbox::mkdir_p_open_at(workdir, "store", 0700);
       if (!savedir) {
         SPDLOG_ERROR("[0x{}] failed to create working directory '{}'",
-                     (void*)this, unique_name);
+                     (void*)this, workdirpath_);
         cb_(boost::system::error_code(errno, boost::system::generic_category()),
-            nullptr, "");
+            nullptr, workdirpath_);
         return;
       }
 
       std::unordered_multimap<std::string, std::shared_ptr<DIR>> dirs;
       dirs.emplace(std::string(), savedir);
-      dirs.emplace(std::string(), logdir);
 
-      {
-        const SourceFile filebase(target_compiler_.output_file,
-                                  req_->default_source(), nullptr);
-        sources_.emplace_back(filebase, savedir);
-        sources_.emplace_back(filebase, logdir);
-      }
+      sources_.emplace_back(target_compiler_->output_file,
+                            req_->default_source(), savedir);
       for (int i = 0; i < req_->sources_size(); i++) {
         const wandbox::cattleshed::Source& x = req_->sources(i);
         SPDLOG_INFO("[0x{}] registering file '{}'", (void*)this, x.file_name());
@@ -563,183 +854,40 @@ class RunJobHandler
       }
 
       workdir_ = workdir;
-      workdirpath_ = unique_name;
-      logdir_ = logdirbase;
-      loginfoname_ = unique_name + ".json";
-      {
-        google::protobuf::json::PrintOptions opt;
-        opt.add_whitespace = true;
-        opt.always_print_fields_with_no_presence = true;
-        // ソースの情報を以外を JSON 化する
-        auto req = *req_;
-        req.clear_default_source();
-        req.clear_sources();
-        google::protobuf::json::MessageToJsonString(req, &loginfocontent_, opt);
-      }
-
-      // まずソース以外の情報を書き込む
-      DoWriteInfo();
-    }
 
-    void DoWriteInfo() {
-      ::memset(&aiocb_, 0, sizeof(aiocb_));
-      aiocb_.aio_fildes = ::openat(
-          ::dirfd(logdir_.get()), ("./" + loginfoname_).c_str(),
-          O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_EXCL | O_NOATIME, 0600);
-      if (aiocb_.aio_fildes < 0) {
-        if (errno == EAGAIN || errno == EMFILE || errno == EWOULDBLOCK) {
-          SPDLOG_ERROR("[0x{}] open failed '{}'", (void*)this, loginfoname_);
-          Complete(boost::system::error_code(
-              errno, boost::system::generic_category()));
-          return;
-        } else {
-          SPDLOG_ERROR("[0x{}] open failed '{}'", (void*)this, loginfoname_);
-          Complete(boost::system::error_code(
-              errno, boost::system::generic_category()));
-          return;
-        }
-      }
+      // ジョブの情報とソースは実行ログに書いておく
+      run_log_->AsyncAppend(date + "/" + unique_name, *req_,
+                            target_compiler_->output_file);
 
-      SPDLOG_DEBUG("[0x{}] write program '{}'", (void*)this, loginfoname_);
-      SPDLOG_DEBUG("[0x{}] write program contents: {}", (void*)this,
-                   loginfocontent_);
-      aiocb_.aio_buf = &loginfocontent_[0];
-      aiocb_.aio_nbytes = loginfocontent_.size();
-      aiocb_.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-      aiocb_.aio_sigevent.sigev_signo = SIGHUP;
-      ::aio_write(&aiocb_);
-      // 書き込みを待つ
-      sigs_->async_wait(std::bind(&ProgramWriter::OnWriteInfo, this,
-                                  std::placeholders::_1,
-                                  std::placeholders::_2));
+      DoWriteFiles();
     }
 
-    void OnWriteInfo(const boost::system::error_code& ec, int signum) {
-      if (ec) {
-        Complete(ec);
-        return;
-      }
-      int error = ::aio_error(&aiocb_);
-      // まだ終わってなかったので再度待ち状態へ
-      if (error == EINPROGRESS) {
-        sigs_->async_wait(std::bind(&ProgramWriter::OnWriteInfo, this,
-                                    std::placeholders::_1,
-                                    std::placeholders::_2));
-        return;
-      }
-
-      ::close(aiocb_.aio_fildes);
-      aiocb_.aio_fildes = -1;
-
-      if (error != 0) {
-        SPDLOG_ERROR("[0x{}] write failed '{}' error={}", (void*)this,
-                     loginfoname_, error);
-        Complete(boost::system::error_code(error,
-                                           boost::system::generic_category()));
-        return;
-      }
-
-      SPDLOG_INFO("[0x{}] write success '{}'", (void*)this, loginfoname_);
-
-      // プログラムのソース情報を書き込む
-      DoWriteProgram();
-    }
-
-    void DoWriteProgram() {
-      SPDLOG_DEBUG("[0x{}] remain source: {}", (void*)this, sources_.size());
-
-      // 全部のファイルを書き込み終わったら終了
-      if (sources_.empty()) {
-        Complete(boost::system::error_code());
-        return;
-      }
-
-      const auto& source = sources_.front();
-
-      ::memset(&aiocb_, 0, sizeof(aiocb_));
-      aiocb_.aio_fildes = ::openat(
-          ::dirfd(source.dir.get()), ("./" + source.name).c_str(),
-          O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_EXCL | O_NOATIME, 0600);
-      if (aiocb_.aio_fildes < 0) {
-        if (errno == EAGAIN || errno == EMFILE || errno == EWOULDBLOCK) {
-          // TODO(melpon): 一定時間後にリトライする
-          // 今はエラーにしておく
-          SPDLOG_ERROR("[0x{}] open failed '{}'", (void*)this, source.name);
-          Complete(boost::system::error_code(
-              errno, boost::system::generic_category()));
-          return;
-        } else {
-          SPDLOG_ERROR("[0x{}] open failed '{}'", (void*)this, source.name);
-          Complete(boost::system::error_code(
-              errno, boost::system::generic_category()));
-          return;
-        }
-      }
-      SPDLOG_DEBUG("[0x{}] write program '{}'", (void*)this, source.name);
-      SPDLOG_DEBUG("[0x{}] write program contents: {}", (void*)this,
-                   std::string(source.buf(), source.buf() + source.len));
-      aiocb_.aio_buf = source.buf();
-      aiocb_.aio_nbytes = source.len;
-      aiocb_.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-      aiocb_.aio_sigevent.sigev_signo = SIGHUP;
-      ::aio_write(&aiocb_);
-      // 書き込みを待つ
-      sigs_->async_wait(std::bind(&ProgramWriter::OnWriteProgram, this,
-                                  std::placeholders::_1,
-                                  std::placeholders::_2));
-    }
-
-    void OnWriteProgram(const boost::system::error_code& ec, int signum) {
-      if (ec) {
-        Complete(ec);
-        return;
-      }
-      int error = ::aio_error(&aiocb_);
-      // まだ終わってなかったので再度待ち状態へ
-      if (error == EINPROGRESS) {
-        sigs_->async_wait(std::bind(&ProgramWriter::OnWriteProgram, this,
-                                    std::placeholders::_1,
-                                    std::placeholders::_2));
-        return;
-      }
-
-      const auto& source = sources_.front();
-
-      ::close(aiocb_.aio_fildes);
-      aiocb_.aio_fildes = -1;
-
-      if (error != 0) {
-        SPDLOG_ERROR("[0x{}] write failed '{}' error={}", (void*)this,
-                     source.name, error);
-        Complete(boost::system::error_code(error,
-                                           boost::system::generic_category()));
-        return;
-      }
+    void DoWriteFiles() {
+      SPDLOG_DEBUG("[0x{}] write {} files", (void*)this, sources_.size());
 
-      SPDLOG_INFO("[0x{}] write success '{}'", (void*)this, source.name);
-      sources_.pop_front();
-      // 次のファイルを書き込む
-      DoWriteProgram();
+      // 全部のファイルをまとめてスレッドプール上で書き込んで、
+      // 完了したらこのジョブの io_context に戻ってくる
+      boost::asio::post(*file_pool_, [this, files = std::move(sources_)]() {
+        // Complete は io_context に post するだけなのでここから呼んで良い
+        Complete(WriteFiles(files));
+      });
+      sources_.clear();
     }
 
     ProgramWriter(std::shared_ptr<boost::asio::io_context> ioc,
-                  const wandbox::server_config& config,
+                  std::shared_ptr<boost::asio::thread_pool> file_pool,
+                  std::shared_ptr<WorkdirPool> workdirs,
+                  std::shared_ptr<RunLog> run_log,
+                  std::shared_ptr<const wandbox::server_config> config,
                   const wandbox::compiler_trait& target_compiler,
-                  const wandbox::cattleshed::RunJobRequest::Start& req,
-                  std::shared_ptr<boost::asio::signal_set> sigs)
+                  const wandbox::cattleshed::RunJobRequest::Start& req)
         : ioc_(ioc),
-          config_(&config),
-          target_compiler_(target_compiler),
+          file_pool_(file_pool),
+          workdirs_(std::move(workdirs)),
+          run_log_(std::move(run_log)),
+          target_compiler_(&target_compiler),
           req_(&req),
-          sigs_(sigs) {
-      ::memset(&aiocb_, 0, sizeof(aiocb_));
-      aiocb_.aio_fildes = -1;
-    }
-    ~ProgramWriter() noexcept {
-      if (aiocb_.aio_fildes != -1) {
-        ::close(aiocb_.aio_fildes);
-      }
-    }
+          config_(std::move(config)) {}
 
    private:
     void Complete(boost::system::error_code ec) {
@@ -749,19 +897,17 @@ class RunJobHandler
            workdirpath = workdirpath_]() { cb(ec, workdir, workdirpath); });
     }
 
-    std::shared_ptr<DIR> logdir_;
-    std::string loginfoname_;
-    std::string loginfocontent_;
-
     std::shared_ptr<boost::asio::io_context> ioc_;
-    std::shared_ptr<boost::asio::signal_set> sigs_;
-    struct aiocb aiocb_;
-    wandbox::compiler_trait target_compiler_;
+    std::shared_ptr<boost::asio::thread_pool> file_pool_;
+    std::shared_ptr<WorkdirPool> workdirs_;
+    std::shared_ptr<RunLog> run_log_;
+    // config_ の中を指している
+    const wandbox::compiler_trait* target_compiler_;
     const wandbox::cattleshed::RunJobRequest::Start* req_;
     std::function<void(const boost::system::error_code& error,
                        std::shared_ptr<DIR>, std::string)>
         cb_;
-    const wandbox::server_config* config_;
+    std::shared_ptr<const wandbox::server_config> config_;
     std::shared_ptr<DIR> workdir_;
     std::string workdirpath_;
 
@@ -791,6 +937,47 @@ class RunJobHandler
       char* buf() const { return source_shared.get(); }
     };
     std::deque<SourceFile> sources_;
+
+    // スレッドプール上で呼ばれるので、メンバには触らないこと
+    static boost::system::error_code WriteFiles(
+        const std::deque<SourceFile>& files) {
+      for (const auto& source : files) {
+        wandbox::unique_fd fd(::openat(
+            ::dirfd(source.dir.get()), ("./" + source.name).c_str(),
+            O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_EXCL | O_NOATIME,
+            0600));
+        if (!fd) {
+          SPDLOG_ERROR("open failed '{}'", source.name);
+          return boost::system::error_code(errno,
+                                           boost::system::generic_category());
+        }
+        SPDLOG_DEBUG("write program '{}'", source.name);
+        SPDLOG_DEBUG("write program contents: {}",
+                     std::string(source.buf(), source.buf() + source.len));
+        const char* p = source.buf();
+        std::size_t remain = source.len;
+        while (remain != 0) {
+          ssize_t n = ::write(fd.get(), p, remain);
+          if (n < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            SPDLOG_ERROR("write failed '{}' error={}", source.name, errno);
+            return boost::system::error_code(
+                errno, boost::system::generic_category());
+          }
+          p += n;
+          remain -= n;
+        }
+        if (::close(fd.release()) < 0) {
+          SPDLOG_ERROR("close failed '{}' error={}", source.name, errno);
+          return boost::system::error_code(errno,
+                                           boost::system::generic_category());
+        }
+        SPDLOG_INFO("write success '{}'", source.name);
+      }
+      return boost::system::error_code();
+    }
   };
 
   struct ProgramRunner {
@@ -808,20 +995,119 @@ class RunJobHandler
       virtual void AsyncForward(std::function<void()>) noexcept = 0;
     };
 
+    // single-sandbox の場合に、コンパイルと実行で共有するサンドボックス（cattlegrid --session）。
+    // 制御用のソケットにフェーズごとのコマンドを送ると、同じサンドボックスの中で実行して結果を返してくる。
+    struct Session {
+      Session(std::shared_ptr<boost::asio::io_context> ioc,
+              wandbox::unique_child_pid pid, wandbox::unique_fd pidfd,
+              wandbox::unique_fd ctl)
+          : pid_(std::move(pid)), pidfd_(*ioc), ctl_(*ioc, ctl.release()) {
+        if (pidfd) {
+          pidfd_.assign(pidfd.release());
+        }
+      }
+      void Kill(int signo) noexcept {
+        if (pid_.finished()) {
+          return;
+        }
+        const int n =
+            pidfd_.is_open()
+                ? wandbox::pidfd_send_signal(pidfd_.native_handle(), signo)
+                : ::kill(pid_.get(), signo);
+        if (n == 0) {
+          SPDLOG_INFO("kill sent to session: signo={}", signo);
+        } else {
+          SPDLOG_ERROR("kill failed: signo={}, errno={}", signo, errno);
+        }
+      }
+      // セッションが死んだ時の終了ステータス
+      int Wait() noexcept { return pid_.wait(); }
+      const struct rusage& GetUsage() const noexcept { return pid_.usage(); }
+      boost::asio::posix::stream_descriptor& Control() { return ctl_; }
+
+      // 制御用のソケットを閉じるとセッションが終了するので、終わるのを待ってから破棄する
+      static void AsyncClose(std::shared_ptr<Session> self) {
+        boost::system::error_code ec;
+        self->ctl_.close(ec);
+        if (!self->pidfd_.is_open()) {
+          return;
+        }
+        auto& pidfd = self->pidfd_;
+        pidfd.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                         [self = std::move(self)](
+                             const boost::system::error_code&) {
+                           self->pid_.wait_nonblock();
+                         });
+      }
+
+     private:
+      wandbox::unique_child_pid pid_;
+      boost::asio::posix::stream_descriptor pidfd_;
+      boost::asio::posix::stream_descriptor ctl_;
+    };
+
     struct StatusForwarder : PipeForwarderBase {
       StatusForwarder(std::shared_ptr<boost::asio::io_context> ioc,
                       std::shared_ptr<boost::asio::signal_set> sigs,
-                      wandbox::unique_child_pid pid)
-          : ioc_(ioc), sigs_(std::move(sigs)), pid_(std::move(pid)) {}
+                      wandbox::unique_child_pid pid, wandbox::unique_fd pidfd)
+          : ioc_(ioc),
+            sigs_(std::move(sigs)),
+            pid_(std::move(pid)),
+            pidfd_(*ioc) {
+        if (pidfd) {
+          pidfd_.assign(pidfd.release());
+        }
+      }
+      // single-sandbox の場合。終了ステータスはセッションの制御用ソケットから届く
+      StatusForwarder(std::shared_ptr<boost::asio::io_context> ioc,
+                      std::shared_ptr<Session> session)
+          : ioc_(ioc), pidfd_(*ioc), session_(std::move(session)) {}
       void Close() noexcept override {}
-      bool Closed() const noexcept override { return pid_.finished(); }
+      bool Closed() const noexcept override {
+        return session_ ? session_finished_ : pid_.finished();
+      }
       void AsyncForward(std::function<void()> handler) noexcept override {
-        sigs_->async_wait(std::bind(&StatusForwarder::OnWait, this, handler));
+        if (session_) {
+          session_->Control().async_wait(
+              boost::asio::posix::stream_descriptor::wait_read,
+              std::bind(&StatusForwarder::OnSessionWait, this,
+                        std::placeholders::_1, handler));
+          return;
+        }
+        // pidfd が使える場合は、このプロセスの終了時にだけ起こされる。
+        // 使えない場合は SIGCHLD を待って、自分のプロセスかどうかを確認する。
+        if (pidfd_.is_open()) {
+          pidfd_.async_wait(
+              boost::asio::posix::stream_descriptor::wait_read,
+              std::bind(&StatusForwarder::OnWait, this, std::placeholders::_1,
+                        handler));
+        } else {
+          sigs_->async_wait(std::bind(&StatusForwarder::OnWait, this,
+                                      std::placeholders::_1, handler));
+        }
+      }
+      int GetStatus() noexcept {
+        return session_ ? session_result_.status : pid_.wait_nonblock();
+      }
+      const struct rusage& GetUsage() const noexcept {
+        return session_ ? session_result_.usage : pid_.usage();
       }
-      int GetStatus() noexcept { return pid_.wait_nonblock(); }
       void Kill(int signo) noexcept {
+        if (session_) {
+          // フェーズのプロセスには cattlegrid が転送する
+          if (!session_finished_) {
+            session_->Kill(signo);
+          }
+          return;
+        }
         if (!pid_.finished()) {
-          int n = ::kill(pid_.get(), signo);
+          int n;
+          if (pidfd_.is_open()) {
+            // pid の再利用を気にしなくて良いので pidfd 経由で送る
+            n = wandbox::pidfd_send_signal(pidfd_.native_handle(), signo);
+          } else {
+            n = ::kill(pid_.get(), signo);
+          }
           if (n == 0) {
             SPDLOG_INFO("kill sent: signo={}", signo);
           } else {
@@ -829,7 +1115,11 @@ class RunJobHandler
           }
         }
       }
-      void OnWait(std::function<void()> handler) {
+      void OnWait(const boost::system::error_code& ec,
+                  std::function<void()> handler) {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
         pid_.wait_nonblock();
         if (not pid_.finished()) {
           // プロセスが終わってなかったので待ち直し
@@ -840,16 +1130,95 @@ class RunJobHandler
         // プロセスが終わってたのでハンドラを読んで終了
         handler();
       }
+      void OnSessionWait(const boost::system::error_code& ec,
+                         std::function<void()> handler) {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+        const ssize_t n =
+            ::recv(session_->Control().native_handle(), &session_result_,
+                   sizeof(session_result_), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+          AsyncForward(handler);
+          return;
+        }
+        if (n != sizeof(session_result_)) {
+          // セッションごと死んだ（SIGKILL されたなど）
+          session_result_.status = session_->Wait();
+          session_result_.usage = session_->GetUsage();
+        }
+        session_finished_ = true;
+        handler();
+      }
 
      private:
       std::shared_ptr<boost::asio::io_context> ioc_;
       std::shared_ptr<boost::asio::signal_set> sigs_;
       wandbox::unique_child_pid pid_;
+      boost::asio::posix::stream_descriptor pidfd_;
+      std::shared_ptr<Session> session_;
+      wandbox::session_phase_result session_result_ = {};
+      bool session_finished_ = false;
+    };
+
+    // gRPC に渡したけど、まだ書き込みが終わっていないレスポンスの数を制限する
+    //
+    // 枠が一杯の間は出力の読み込みを止めるので、パイプが一杯になって
+    // サンドボックスの中のプログラムの書き込みがブロックする。
+    // なのでクライアントがどれだけ遅くても、ジョブ１つあたりのメモリ使用量は一定以下になる。
+    // シャードのスレッド上でだけ触ること。
+    struct WriteWindow {
+      static constexpr int kMaxPendingWrites = 8;
+
+      // レスポンスを gRPC に渡した
+      void Acquire() { pending_ += 1; }
+      // gRPC の書き込みが終わった
+      void Release() {
+        pending_ -= 1;
+        Wake();
+      }
+      // 制限を無くす。プロセスを殺した後、残りの出力を読み切るために使う
+      void Open() {
+        open_ = true;
+        Wake();
+      }
+      // 待っている handler を呼ばずに捨てて、以降は制限しない。
+      // ProgramRunner を破棄する時に呼ぶ。終わらない書き込みがあっても、それ以上は待たない
+      void Close() {
+        open_ = true;
+        waiters_.clear();
+      }
+      // 枠が空いていたらすぐに、空いていなければ空いた時に handler を呼ぶ
+      void AsyncWait(std::function<void()> handler) {
+        if (Available()) {
+          handler();
+          return;
+        }
+        waiters_.push_back(std::move(handler));
+      }
+
+     private:
+      bool Available() const { return open_ || pending_ < kMaxPendingWrites; }
+      void Wake() {
+        while (!waiters_.empty() && Available()) {
+          auto handler = std::move(waiters_.front());
+          waiters_.pop_front();
+          handler();
+        }
+      }
+
+      int pending_ = 0;
+      bool open_ = false;
+      std::deque<std::function<void()>> waiters_;
     };
 
     struct WriteLimitCounter {
-      explicit WriteLimitCounter(size_t soft_limit, size_t hard_limit)
-          : soft_limit_(soft_limit), hard_limit_(hard_limit), current_(0) {}
+      WriteLimitCounter(size_t soft_limit, size_t hard_limit,
+                        std::shared_ptr<WriteWindow> window)
+          : soft_limit_(soft_limit),
+            hard_limit_(hard_limit),
+            current_(0),
+            window_(std::move(window)) {}
       void SetProcess(std::shared_ptr<StatusForwarder> proc) {
         proc_ = std::move(proc);
       }
@@ -863,6 +1232,8 @@ class RunJobHandler
           if (hard_limit_ < current_) {
             SPDLOG_WARN("output hard limit. send SIGKILL");
             p->Kill(SIGKILL);
+            // 残りの出力を読み切って終われるようにする
+            window_->Open();
           } else if (soft_limit_ < current_) {
             SPDLOG_WARN("output soft limit. send SIGXFSZ");
             p->Kill(SIGXFSZ);
@@ -875,6 +1246,7 @@ class RunJobHandler
       size_t hard_limit_;
       size_t current_;
       std::weak_ptr<StatusForwarder> proc_;
+      std::shared_ptr<WriteWindow> window_;
     };
 
     struct InputForwarder : PipeForwarderBase {
@@ -903,25 +1275,91 @@ class RunJobHandler
       std::string input_;
     };
 
-    struct OutputForwarder : PipeForwarderBase {
-      OutputForwarder(
-          std::shared_ptr<boost::asio::io_context> ioc, wandbox::unique_fd fd,
-          wandbox::cattleshed::RunJobResponse::Type command_type,
-          std::shared_ptr<WriteLimitCounter> limit,
+    // 細かい出力を１つのレスポンスにまとめて送る
+    //
+    // 同じ種類の出力が続いている間は溜めておいて、一定サイズを超えるか、
+    // 少し時間が経つか、別の種類の出力が来るか、パイプが閉じられたら送る。
+    // stdout と stderr で共有するので、出力の順番は変わらない。
+    struct OutputCoalescer : std::enable_shared_from_this<OutputCoalescer> {
+      static constexpr std::size_t kFlushSize = 32 * 1024;
+      static constexpr std::chrono::milliseconds kFlushDelay{10};
+
+      OutputCoalescer(
+          std::shared_ptr<boost::asio::io_context> ioc,
           std::function<void(const wandbox::cattleshed::RunJobResponse&)> send)
+          : timer_(*ioc), send_(std::move(send)) {}
+
+      void Append(wandbox::cattleshed::RunJobResponse::Type type,
+                  const char* data, std::size_t len) {
+        if (!pending_.empty() && type != type_) {
+          Flush();
+        }
+        type_ = type;
+        pending_.append(data, len);
+        if (pending_.size() >= kFlushSize) {
+          Flush();
+          return;
+        }
+        if (!timer_armed_) {
+          timer_armed_ = true;
+          timer_.expires_after(kFlushDelay);
+          timer_.async_wait(
+              [self = shared_from_this()](const boost::system::error_code& ec) {
+                self->timer_armed_ = false;
+                if (!ec) {
+                  self->Flush();
+                }
+              });
+        }
+      }
+
+      void Flush() {
+        if (pending_.empty()) {
+          return;
+        }
+        wandbox::cattleshed::RunJobResponse resp;
+        resp.set_type(type_);
+        resp.set_data(std::move(pending_));
+        pending_.clear();
+        send_(resp);
+      }
+
+     private:
+      boost::asio::steady_timer timer_;
+      bool timer_armed_ = false;
+      wandbox::cattleshed::RunJobResponse::Type type_;
+      std::string pending_;
+      std::function<void(const wandbox::cattleshed::RunJobResponse&)> send_;
+    };
+
+    struct OutputForwarder : PipeForwarderBase,
+                             std::enable_shared_from_this<OutputForwarder> {
+      // 読み込みバッファのサイズ。一杯まで読めた場合は大きくしていく
+      static constexpr std::size_t kMinReadSize = BUFSIZ;
+      static constexpr std::size_t kMaxReadSize = 64 * 1024;
+
+      OutputForwarder(std::shared_ptr<boost::asio::io_context> ioc,
+                      wandbox::unique_fd fd,
+                      wandbox::cattleshed::RunJobResponse::Type command_type,
+                      std::shared_ptr<WriteLimitCounter> limit,
+                      std::shared_ptr<OutputCoalescer> coalescer,
+                      std::shared_ptr<WriteWindow> window)
           : ioc_(ioc),
             pipe_(*ioc),
             command_type_(command_type),
             limit_(std::move(limit)),
-            send_(std::move(send)) {
+            coalescer_(std::move(coalescer)),
+            window_(std::move(window)) {
         pipe_.assign(fd.get());
         fd.release();
       }
       void Close() noexcept override { pipe_.close(); }
       bool Closed() const noexcept override { return !pipe_.is_open(); }
+      // 今までに読んだバイト数
+      std::uint64_t Bytes() const noexcept { return bytes_; }
       void AsyncForward(std::function<void()> handler) noexcept override {
         handler_ = std::move(handler);
-        buf_.resize(BUFSIZ);
+        buf_.resize(kMinReadSize);
         pipe_.async_read_some(
             boost::asio::buffer(buf_),
             std::bind(&OutputForwarder::OnRead, this, std::placeholders::_1,
@@ -930,6 +1368,8 @@ class RunJobHandler
       void OnRead(boost::system::error_code ec, size_t len) {
         if (ec) {
           pipe_.close();
+          // 溜まっている分は全部送ってから終わる
+          coalescer_->Flush();
           if (handler_) {
             auto handler = std::move(handler_);
             handler_ = {};
@@ -937,19 +1377,29 @@ class RunJobHandler
           }
           return;
         }
-        wandbox::cattleshed::RunJobResponse resp;
-        resp.set_type(command_type_);
-        resp.set_data(std::string(buf_.begin(), buf_.begin() + len));
-        send_(resp);
+        coalescer_->Append(command_type_, buf_.data(), len);
+        bytes_ += len;
         if (auto l = limit_.lock()) {
           l->Add(len);
         }
 
-        // 再度読む
-        pipe_.async_read_some(
-            boost::asio::buffer(buf_),
-            std::bind(&OutputForwarder::OnRead, this, std::placeholders::_1,
-                      std::placeholders::_2));
+        if (len == buf_.size() && buf_.size() < kMaxReadSize) {
+          buf_.resize(std::min(buf_.size() * 2, kMaxReadSize));
+        }
+
+        // 送ったレスポンスの書き込みが追いつくまで、次を読まずに待つ。
+        // 待っている間にジョブが破棄されることがあるので、弱い参照で持っておく
+        window_->AsyncWait([self = std::weak_ptr<OutputForwarder>(
+                                shared_from_this())]() {
+          auto p = self.lock();
+          if (!p || !p->pipe_.is_open()) {
+            return;
+          }
+          p->pipe_.async_read_some(
+              boost::asio::buffer(p->buf_),
+              std::bind(&OutputForwarder::OnRead, p.get(),
+                        std::placeholders::_1, std::placeholders::_2));
+        });
       }
 
      private:
@@ -959,31 +1409,43 @@ class RunJobHandler
       std::vector<char> buf_;
       std::function<void()> handler_;
       std::weak_ptr<WriteLimitCounter> limit_;
-      std::function<void(const wandbox::cattleshed::RunJobResponse&)> send_;
+      std::shared_ptr<OutputCoalescer> coalescer_;
+      std::shared_ptr<WriteWindow> window_;
+      std::uint64_t bytes_ = 0;
     };
 
     ProgramRunner(std::shared_ptr<boost::asio::io_context> ioc,
-                  const wandbox::server_config& config,
+                  std::shared_ptr<const wandbox::server_config> config,
                   const wandbox::cattleshed::RunJobRequest::Start& req,
                   std::shared_ptr<boost::asio::signal_set> sigs,
                   std::shared_ptr<DIR> workdir, std::string workdirpath,
                   const wandbox::compiler_trait& target_compiler,
-                  std::function<void(const wandbox::cattleshed::RunJobResponse&)> send)
+                  std::shared_ptr<CompileCache> cache,
+                  std::shared_ptr<JailTiming> timing,
+                  std::function<void(const wandbox::cattleshed::RunJobResponse&)> send,
+                  std::shared_ptr<WriteWindow> window)
         : ioc_(ioc),
-          config_(&config),
+          config_(std::move(config)),
           req_(&req),
-          sigs_(sigs),
           workdir_(std::move(workdir)),
           workdirpath_(std::move(workdirpath)),
-          target_compiler_(target_compiler),
+          sigs_(sigs),
+          target_compiler_(&target_compiler),
+          cache_(std::move(cache)),
+          timing_(std::move(timing)),
           send_(std::move(send)),
-          kill_timer_(*ioc) {
-      limitter_ = std::make_shared<WriteLimitCounter>(jail().output_limit_warn,
-                                                      jail().output_limit_kill);
+          kill_timer_(*ioc),
+          window_(std::move(window)) {
+      limitter_ = std::make_shared<WriteLimitCounter>(
+          jail().output_limit_warn, jail().output_limit_kill, window_);
+    }
+    ~ProgramRunner() {
+      // 窓は RunJobHandler と共有しているので、このジョブの出力を待っているものを捨てておく
+      window_->Close();
     }
 
     void AsyncRun(std::function<void()> cb) {
-      SPDLOG_TRACE("running program with '{}'", target_compiler_.name);
+      SPDLOG_TRACE("running program with '{}'", target_compiler_->name);
 
       cb_ = std::move(cb);
 
@@ -991,8 +1453,8 @@ class RunJobHandler
       {
         namespace qi = boost::spirit::qi;
 
-        auto ccargs = target_compiler_.compile_command;
-        auto progargs = target_compiler_.run_command;
+        auto ccargs = target_compiler_->compile_command;
+        auto progargs = target_compiler_->run_command;
 
         std::unordered_set<std::string> selected_switches;
         qi::parse(
@@ -1002,8 +1464,8 @@ class RunJobHandler
         for (const auto& sw : selected_switches) {
           wandbox::switch_trait t;
           {
-            const auto it = target_compiler_.local_switches.get<1>().find(sw);
-            if (it == target_compiler_.local_switches.get<1>().end()) {
+            const auto it = target_compiler_->local_switches.get<1>().find(sw);
+            if (it == target_compiler_->local_switches.get<1>().end()) {
               const auto it2 = config_->switches.find(sw);
               if (it2 == config_->switches.end()) {
                 SPDLOG_WARN("[0x{}] not found option '{}'", (void*)this, sw);
@@ -1048,10 +1510,28 @@ class RunJobHandler
           f(req_->runtime_option_raw(), progargs);
         }
 
-        ccargs.insert(ccargs.begin(), jail().jail_command.begin(),
-                      jail().jail_command.end());
-        progargs.insert(progargs.begin(), jail().jail_command.begin(),
-                        jail().jail_command.end());
+        // 集計する場合は、サンドボックスの準備にかけた時間を cattlegrid に fd 3 に書いてもらう
+        auto jail_command = jail().jail_command;
+        timing_enabled_ =
+            timing_ && InsertCattlegridOption(jail_command, "--timing-fd=3");
+
+        // single-sandbox なら jail-command はセッションの開始時に一度だけ実行して、
+        // コンパイルも実行もその中で行う
+        session_command_ = MakeSessionCommand(jail_command);
+        // zygote 経由で１回ずつ実行する場合、wait4 で取れる使用量は
+        // cattlegrid --attach のもので、サンドボックスのものではない
+        usage_from_cgroup_ =
+            session_command_.empty() &&
+            std::any_of(jail_command.begin(), jail_command.end(),
+                        [](const std::string& s) {
+                          return s.compare(0, 9, "--attach=") == 0;
+                        });
+        if (session_command_.empty()) {
+          ccargs.insert(ccargs.begin(), jail_command.begin(),
+                        jail_command.end());
+          progargs.insert(progargs.begin(), jail_command.begin(),
+                          jail_command.end());
+        }
         commands_ = {
             {std::move(ccargs), "", wandbox::cattleshed::RunJobResponse::COMPILER_STDOUT,
              wandbox::cattleshed::RunJobResponse::COMPILER_STDERR,
@@ -1061,6 +1541,115 @@ class RunJobHandler
              wandbox::cattleshed::RunJobResponse::STDERR, jail().program_duration}};
       }
 
+      // キャッシュできるなら、コンパイルする前にキャッシュを探す
+      if (cache_ && target_compiler_->compile_cache) {
+        const auto key = MakeCacheKey();
+        if (key) {
+          cache_->AsyncLookup(
+              *key, workdirpath_ + "/store", ioc_,
+              std::bind(&ProgramRunner::Start, this, std::placeholders::_1,
+                        std::placeholders::_2));
+          return;
+        }
+      }
+
+      Start(nullptr, nullptr);
+    }
+
+   private:
+    // command の中の system.cattlegrid の直後に option を入れる。
+    // cattlegrid が含まれていなければ何もせずに false を返す
+    bool InsertCattlegridOption(std::vector<std::string>& command,
+                                const std::string& option) const {
+      const auto it = std::find(command.begin(), command.end(),
+                                config_->system.cattlegrid);
+      if (config_->system.cattlegrid.empty() || it == command.end()) {
+        return false;
+      }
+      command.insert(it + 1, option);
+      return true;
+    }
+
+    // jail_command の cattlegrid に --session を付けたもの。使わない場合は空
+    std::vector<std::string> MakeSessionCommand(
+        std::vector<std::string> jail_command) const {
+      if (!jail().single_sandbox) {
+        return {};
+      }
+      if (!InsertCattlegridOption(jail_command, "--session")) {
+        SPDLOG_WARN(
+            "single-sandbox is ignored, jail-command of {} does not contain {}",
+            target_compiler_->jail_name, config_->system.cattlegrid);
+        return {};
+      }
+      return jail_command;
+    }
+
+    // timing_enabled_ なら cattlegrid に fd 3 として渡すパイプを作る。
+    // 使わない場合は両方とも無効な fd
+    wandbox::unique_pipe MakeTimingPipe() const {
+      if (!timing_enabled_) {
+        return {wandbox::unique_fd(-1), wandbox::unique_fd(-1)};
+      }
+      return wandbox::pipe();
+    }
+
+    // spawn した後に呼ぶ。書き込み側を閉じて、読み込み側を集計に回す
+    void WatchTiming(wandbox::unique_pipe timing,
+                     std::chrono::steady_clock::time_point spawned) {
+      if (!timing.r) {
+        return;
+      }
+      timing.w.reset();
+      timing_->Watch(ioc_, std::move(timing.r), spawned);
+    }
+
+    // 例外を投げるので注意
+    void StartSession() {
+      int sv[2];
+      if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        wandbox::throw_system_error(errno);
+      }
+      wandbox::unique_fd ctl(sv[0]);
+      wandbox::unique_fd peer(sv[1]);
+      wandbox::unique_fd pidfd(-1);
+      auto timing = MakeTimingPipe();
+      const auto spawned = std::chrono::steady_clock::now();
+      // cattlegrid 自身のエラーは cattleshed のログに出す
+      const pid_t pid = wandbox::spawn_with_fds(
+          workdir_, session_command_, peer.get(), 1, 2,
+          cgroup_ ? cgroup_->fd() : -1, pidfd, timing.w.get());
+      WatchTiming(std::move(timing), spawned);
+      SPDLOG_INFO("[0x{}] session started: pid={}", (void*)this, pid);
+      session_ = std::make_shared<Session>(ioc_, wandbox::unique_child_pid(pid),
+                                           std::move(pidfd), std::move(ctl));
+    }
+
+    // コンパイラ名、バージョン、コンパイルコマンド、全てのソースからキーを作る
+    boost::optional<std::string> MakeCacheKey() const {
+      const auto version = cache_->GetVersion(target_compiler_->name);
+      if (!version) {
+        return boost::none;
+      }
+      std::vector<std::string> parts;
+      parts.push_back(target_compiler_->name);
+      parts.push_back(*version);
+      const auto& ccargs = commands_.front().arguments;
+      parts.push_back(std::to_string(ccargs.size()));
+      parts.insert(parts.end(), ccargs.begin(), ccargs.end());
+      parts.push_back(target_compiler_->output_file);
+      parts.push_back(req_->default_source());
+      for (const auto& x : req_->sources()) {
+        parts.push_back(x.file_name());
+        parts.push_back(x.source());
+      }
+      return CompileCache::MakeKey(parts);
+    }
+
+    void Start(std::shared_ptr<const CompileCache::Result> cached,
+               std::shared_ptr<CompileCache::Ticket> ticket) {
+      cache_ticket_ = std::move(ticket);
+
       auto handle_error = [&]() {
         wandbox::cattleshed::RunJobResponse resp;
         resp.set_type(wandbox::cattleshed::RunJobResponse::CONTROL);
@@ -1071,32 +1660,41 @@ class RunJobHandler
         cb_();
       };
 
-      // inotify で監視
-      int in_fd = inotify_init();
-      if (in_fd < 0) {
-        SPDLOG_ERROR("failed to inotify_init: {}", errno);
-        handle_error();
-        return;
-      }
-      in_desc_.reset(new boost::asio::posix::stream_descriptor(*ioc_, in_fd));
-      in_wd_ = inotify_add_watch(in_fd, (workdirpath_ + "/store").c_str(),
-                                 IN_CREATE | IN_CLOSE_WRITE);
-      if (in_wd_ < 0) {
-        SPDLOG_ERROR("failed to inotify_add_watch: {}", errno);
-        handle_error();
-        return;
-      }
+      // 作業ディレクトリが tmpfs なら、ファイル数や書き込み量の制限はカーネルに任せる
+      if (jail().tmpfs_size <= 0) {
+        // inotify で監視
+        int in_fd = inotify_init();
+        if (in_fd < 0) {
+          SPDLOG_ERROR("failed to inotify_init: {}", errno);
+          handle_error();
+          return;
+        }
+        in_desc_.reset(new boost::asio::posix::stream_descriptor(*ioc_, in_fd));
+        in_wd_ = inotify_add_watch(in_fd, (workdirpath_ + "/store").c_str(),
+                                   IN_CREATE | IN_CLOSE_WRITE);
+        if (in_wd_ < 0) {
+          SPDLOG_ERROR("failed to inotify_add_watch: {}", errno);
+          handle_error();
+          return;
+        }
 
-      SPDLOG_INFO("inotify_add_watch path={}", workdirpath_ + "/store");
+        SPDLOG_INFO("inotify_add_watch path={}", workdirpath_ + "/store");
 
-      in_event_buf_.resize(8192);
-      in_create_count_ = 0;
-      in_write_bytes_ = 0;
+        in_event_buf_.resize(8192);
+        in_create_count_ = 0;
+        in_write_bytes_ = 0;
 
-      in_desc_->async_read_some(
-          boost::asio::buffer(in_event_buf_),
-          std::bind(&ProgramRunner::OnNotify, this, std::placeholders::_1,
-                    std::placeholders::_2));
+        in_desc_->async_read_some(
+            boost::asio::buffer(in_event_buf_),
+            std::bind(&ProgramRunner::OnNotify, this, std::placeholders::_1,
+                      std::placeholders::_2));
+      }
+
+      // コンパイルも実行も同じ cgroup の中で行う
+      std::string cgroup_name = workdirpath_;
+      std::replace(cgroup_name.begin(), cgroup_name.end(), '/', '_');
+      cgroup_ = JobCgroup::Create(config_->system.cgroup_root, cgroup_name,
+                                  jail());
 
       // 開始
       wandbox::cattleshed::RunJobResponse resp;
@@ -1104,10 +1702,25 @@ class RunJobHandler
       resp.set_data("Start");
       send_(resp);
 
+      if (cached) {
+        // キャッシュにヒットしたので、コンパイラの出力を再現してコンパイルを飛ばす
+        SPDLOG_INFO("[0x{}] use compile cache", (void*)this);
+        for (const auto& output : cached->outputs) {
+          wandbox::cattleshed::RunJobResponse resp;
+          resp.set_type(
+              (wandbox::cattleshed::RunJobResponse::Type)output.first);
+          resp.set_data(output.second);
+          send_(resp);
+        }
+        commands_.pop_front();
+        laststatus_ = cached->status;
+        OnCommandFinished();
+        return;
+      }
+
       DoRun();
     }
 
-   private:
     void DoRun() {
       if (commands_.empty()) {
         // 全ての実行が終わったので終了
@@ -1124,24 +1737,77 @@ class RunJobHandler
       }
       SPDLOG_INFO("[0x{}] exec {}", (void*)this, ss.str());
 
+      // キャッシュに保存するので、コンパイラの出力を記録しておく
+      auto send = send_;
+      if (cache_ticket_) {
+        send = [this](const wandbox::cattleshed::RunJobResponse& resp) {
+          cache_result_.outputs.emplace_back(resp.type(), resp.data());
+          send_(resp);
+        };
+      }
+
       {
-        auto c = wandbox::piped_spawn(workdir_, current_.arguments);
+        wandbox::unique_fd fd_stdin(-1);
+        wandbox::unique_fd fd_stdout(-1);
+        wandbox::unique_fd fd_stderr(-1);
+        std::shared_ptr<StatusForwarder> status;
+        try {
+          if (!session_command_.empty()) {
+            if (!session_) {
+              StartSession();
+            }
+            auto pipe_stdin = wandbox::pipe();
+            auto pipe_stdout = wandbox::pipe();
+            auto pipe_stderr = wandbox::pipe();
+            wandbox::send_session_phase(
+                session_->Control().native_handle(), current_.arguments,
+                pipe_stdin.r.get(), pipe_stdout.w.get(), pipe_stderr.w.get());
+            fd_stdin = std::move(pipe_stdin.w);
+            fd_stdout = std::move(pipe_stdout.r);
+            fd_stderr = std::move(pipe_stderr.r);
+            status = std::make_shared<StatusForwarder>(ioc_, session_);
+          } else {
+            if (usage_from_cgroup_ && cgroup_) {
+              cgroup_->StartUsage();
+            }
+            auto timing = MakeTimingPipe();
+            const auto spawned = std::chrono::steady_clock::now();
+            auto c = wandbox::piped_spawn(workdir_, current_.arguments,
+                                          cgroup_ ? cgroup_->fd() : -1,
+                                          timing.w.get());
+            WatchTiming(std::move(timing), spawned);
+            fd_stdin = std::move(c.fd_stdin);
+            fd_stdout = std::move(c.fd_stdout);
+            fd_stderr = std::move(c.fd_stderr);
+            status = std::make_shared<StatusForwarder>(
+                ioc_, sigs_, std::move(c.pid), std::move(c.pidfd));
+          }
+        } catch (std::system_error& e) {
+          // posix_spawn は exec の失敗もここで返ってくる。
+          // シェルでコマンドが見つからなかった時と同じ扱いにする
+          SPDLOG_ERROR("[0x{}] failed to spawn: {}", (void*)this, e.what());
+          cache_ticket_.reset();
+          laststatus_ = 127 << 8;
+          Completed();
+          return;
+        }
+        auto coalescer = std::make_shared<OutputCoalescer>(ioc_, send);
 
         pipes_ = {
-            std::make_shared<InputForwarder>(ioc_, std::move(c.fd_stdin),
+            std::make_shared<InputForwarder>(ioc_, std::move(fd_stdin),
                                              current_.stdin),
-            std::make_shared<OutputForwarder>(ioc_, std::move(c.fd_stdout),
+            std::make_shared<OutputForwarder>(ioc_, std::move(fd_stdout),
                                               current_.stdout_type, limitter_,
-                                              send_),
-            std::make_shared<OutputForwarder>(ioc_, std::move(c.fd_stderr),
+                                              coalescer, window_),
+            std::make_shared<OutputForwarder>(ioc_, std::move(fd_stderr),
                                               current_.stderr_type, limitter_,
-                                              send_),
-            std::make_shared<StatusForwarder>(ioc_, sigs_, std::move(c.pid)),
+                                              coalescer, window_),
+            status,
         };
-        limitter_->SetProcess(
-            std::static_pointer_cast<StatusForwarder>(pipes_[3]));
+        limitter_->SetProcess(status);
       }
 
+      started_at_ = std::chrono::steady_clock::now();
       pipes_[0]->AsyncForward(std::bind(&ProgramRunner::OnForward, this));
       pipes_[1]->AsyncForward(std::bind(&ProgramRunner::OnForward, this));
       pipes_[2]->AsyncForward(std::bind(&ProgramRunner::OnForward, this));
@@ -1173,8 +1839,82 @@ class RunJobHandler
 
       // 実行完了した
       kill_timer_.cancel();
+      // 次のコマンドに影響しないように、残っているプロセスは全部殺しておく。
+      // single-sandbox の場合はセッションも殺してしまうので、cattlegrid に任せる
+      if (cgroup_ && !session_) {
+        cgroup_->Kill();
+      }
       laststatus_ =
           std::static_pointer_cast<StatusForwarder>(pipes_[3])->GetStatus();
+      // キャッシュから再現すると意味が無いので、記録せずに送る
+      SendUsage();
+
+      if (cache_ticket_) {
+        auto ticket = std::move(cache_ticket_);
+        // シグナルで止まった場合（タイムアウトなど）はキャッシュしない
+        if (WIFEXITED(laststatus_)) {
+          std::unordered_set<std::string> sources;
+          sources.insert(target_compiler_->output_file);
+          for (const auto& x : req_->sources()) {
+            sources.insert(x.file_name());
+          }
+          cache_result_.status = laststatus_;
+          ticket->AsyncCommit(workdirpath_ + "/store", std::move(sources),
+                              std::move(cache_result_), ioc_,
+                              std::bind(&ProgramRunner::OnCommandFinished, this));
+          return;
+        }
+      }
+
+      OnCommandFinished();
+    }
+
+    // コンパイルや実行にかかった時間やメモリなどを JSON で送る
+    void SendUsage() {
+      const auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - started_at_)
+                            .count();
+      const bool compile = current_.stdout_type ==
+                           wandbox::cattleshed::RunJobResponse::COMPILER_STDOUT;
+
+      std::string usage;
+      if (usage_from_cgroup_) {
+        // cgroup から取る。コンテキストスイッチの回数は分からないので送らない。
+        // cgroup が無ければ正しい値が分からないので、USAGE 自体を送らない
+        const auto u = cgroup_ ? cgroup_->GetUsage() : boost::none;
+        if (!u) {
+          return;
+        }
+        usage = fmt::format("\"user_time_us\":{},\"system_time_us\":{}",
+                            u->user_time_us, u->system_time_us);
+        if (u->max_memory_kb >= 0) {
+          usage += fmt::format(",\"max_rss_kb\":{}", u->max_memory_kb);
+        }
+      } else {
+        const auto& ru =
+            std::static_pointer_cast<StatusForwarder>(pipes_[3])->GetUsage();
+        const auto to_us = [](const struct timeval& tv) {
+          return (std::int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+        };
+        usage = fmt::format(
+            "\"user_time_us\":{},\"system_time_us\":{},\"max_rss_kb\":{},"
+            "\"voluntary_ctxsw\":{},\"involuntary_ctxsw\":{}",
+            to_us(ru.ru_utime), to_us(ru.ru_stime), ru.ru_maxrss, ru.ru_nvcsw,
+            ru.ru_nivcsw);
+      }
+
+      wandbox::cattleshed::RunJobResponse resp;
+      resp.set_type(wandbox::cattleshed::RunJobResponse::USAGE);
+      resp.set_data(fmt::format(
+          "{{\"phase\":\"{}\",\"wall_time_us\":{},{},\"stdout_bytes\":{},"
+          "\"stderr_bytes\":{}}}",
+          compile ? "compile" : "run", wall, usage,
+          std::static_pointer_cast<OutputForwarder>(pipes_[1])->Bytes(),
+          std::static_pointer_cast<OutputForwarder>(pipes_[2])->Bytes()));
+      send_(resp);
+    }
+
+    void OnCommandFinished() {
       // 実行に失敗したのでここで終了処理
       if (!WIFEXITED(laststatus_) || (WEXITSTATUS(laststatus_) != 0)) {
         Completed();
@@ -1212,6 +1952,11 @@ class RunJobHandler
 
       // SIGXCPU だとダメだったので SIGKILL
       std::static_pointer_cast<StatusForwarder>(pipes_[3])->Kill(SIGKILL);
+      if (cgroup_) {
+        cgroup_->Kill();
+      }
+      // クライアントが読んでくれなくても、パイプに残っている分を読み切って終われるようにする
+      window_->Open();
     }
 
     void OnNotify(const boost::system::error_code& ec,
@@ -1239,6 +1984,7 @@ class RunJobHandler
             SPDLOG_INFO("[0x{}] Too many create file, send SIGKILL",
                         (void*)this);
             std::static_pointer_cast<StatusForwarder>(pipes_[3])->Kill(SIGKILL);
+            window_->Open();
             in_desc_.reset();
             return;
           }
@@ -1288,32 +2034,58 @@ class RunJobHandler
       resp.set_data("Finish");
       send_(resp);
 
+      if (session_) {
+        Session::AsyncClose(std::move(session_));
+      }
+      if (cgroup_) {
+        cgroup_->AsyncRemove(ioc_);
+        cgroup_.reset();
+      }
+
       cb_();
 
       SPDLOG_INFO("[0x{}] finished", (void*)this);
     }
 
     const wandbox::jail_config& jail() const {
-      return config_->jails.at(target_compiler_.jail_name);
+      return config_->jails.at(target_compiler_->jail_name);
     }
 
     std::shared_ptr<boost::asio::io_context> ioc_;
-    const wandbox::server_config* config_;
+    std::shared_ptr<const wandbox::server_config> config_;
     const wandbox::cattleshed::RunJobRequest::Start* req_;
     std::shared_ptr<DIR> workdir_;
     std::string workdirpath_;
     std::shared_ptr<boost::asio::signal_set> sigs_;
-    wandbox::compiler_trait target_compiler_;
+    // config_ の中を指している
+    const wandbox::compiler_trait* target_compiler_;
+    std::shared_ptr<CompileCache> cache_;
+    std::shared_ptr<JailTiming> timing_;
     std::function<void(const wandbox::cattleshed::RunJobResponse&)> send_;
 
     std::function<void()> cb_;
 
+    // コンパイルキャッシュにミスした場合、コンパイル結果を保存するのに使う
+    std::shared_ptr<CompileCache::Ticket> cache_ticket_;
+    CompileCache::Result cache_result_;
+
     std::vector<std::shared_ptr<PipeForwarderBase>> pipes_;
     boost::asio::deadline_timer kill_timer_;
     std::deque<CommandType> commands_;
     CommandType current_;
+    // cattlegrid に --timing-fd=3 を付けた
+    bool timing_enabled_ = false;
+    // 使用量を wait4 ではなく cgroup から取る
+    bool usage_from_cgroup_ = false;
+    // single-sandbox の場合のセッションのコマンドと、開始したセッション
+    std::vector<std::string> session_command_;
+    std::shared_ptr<Session> session_;
     std::shared_ptr<WriteLimitCounter> limitter_;
+    std::shared_ptr<WriteWindow> window_;
     int laststatus_ = 0;
+    std::chrono::steady_clock::time_point started_at_;
+    // cgroup-root が設定されていなければ nullptr
+    std::shared_ptr<JobCgroup> cgroup_;
 
     // inotify
     int in_wd_ = 0;
@@ -1327,22 +2099,38 @@ class RunJobHandler
   wandbox::cattleshed::Cattleshed::AsyncService* service_;
   std::shared_ptr<boost::asio::io_context> ioc_;
   std::shared_ptr<boost::asio::signal_set> sigs_;
-  const wandbox::server_config* config_;
+  std::shared_ptr<boost::asio::thread_pool> file_pool_;
+  std::shared_ptr<CompileCache> cache_;
+  std::shared_ptr<JobScheduler> scheduler_;
+  std::shared_ptr<JobScheduler::Ticket> job_ticket_;
+  std::shared_ptr<WorkdirPool> workdirs_;
+  std::string workdirpath_;
+  std::shared_ptr<RunLog> run_log_;
+  // jail-timing-file が設定されていなければ nullptr
+  std::shared_ptr<JailTiming> jail_timing_;
+  std::shared_ptr<ConfigStore> config_store_;
+  std::shared_ptr<const wandbox::server_config> config_;
+  const wandbox::compiler_trait* target_compiler_ = nullptr;
   bool started_ = false;
   std::shared_ptr<ProgramWriter> program_writer_;
   std::shared_ptr<ProgramRunner> program_runner_;
+  std::shared_ptr<ProgramRunner::WriteWindow> write_window_;
   wandbox::cattleshed::RunJobRequest::Start req_start_;
 };
 
 class CattleshedServer {
  public:
-  CattleshedServer(std::shared_ptr<boost::asio::io_context> ioc,
-                   wandbox::server_config config)
-      : ioc_(ioc), config_(std::move(config)) {
-    sigs_ = std::make_shared<boost::asio::signal_set>(*ioc_, SIGCHLD, SIGHUP);
+  // config_paths は設定の読み直しに使うので絶対パスであること
+  CattleshedServer(wandbox::server_config config, int threads,
+                   std::vector<std::string> config_paths) {
+    const auto initial =
+        std::make_shared<const wandbox::server_config>(std::move(config));
+    const wandbox::system_config& system = initial->system;
+    config_store_ = std::make_shared<ConfigStore>(initial);
+    shards_ = std::make_shared<CattleshedShards>(threads);
 
     try {
-      wandbox::mkdir(config_.system.basedir, 0700);
+      wandbox::mkdir(system.basedir, 0700);
     } catch (std::system_error& e) {
       if (e.code().value() != EEXIST) {
         SPDLOG_ERROR(
@@ -1351,8 +2139,58 @@ class CattleshedServer {
         throw;
       }
     }
-    auto basedir = wandbox::opendir(config_.system.basedir);
+    auto basedir = wandbox::opendir(system.basedir);
     wandbox::chdir(basedir);
+
+    version_cache_ = std::make_shared<VersionCache>(system.version_cache_file);
+    version_cache_->Load();
+
+    if (!system.compile_cache_dir.empty()) {
+      cache_ = std::make_shared<CompileCache>(
+          system.compile_cache_dir,
+          (std::uint64_t)system.compile_cache_size * 1024 * 1024,
+          shards_->All().front().file_pool);
+      cache_->Load();
+    }
+
+    JobCgroup::EnableControllers(system.cgroup_root);
+
+    UnmountRootTemplates(*initial);
+
+    scheduler_ = std::make_shared<JobScheduler>(system.max_connections);
+
+    workdirs_ = std::make_shared<WorkdirPool>(
+        system.workdir_pool_size, system.workdir_reclaim_rate,
+        system.workdir_disk_usage_max, system.cattlegrid,
+        shards_->All().front().file_pool);
+    {
+      std::set<WorkdirPool::Tmpfs> tmpfs_list = {WorkdirPool::Tmpfs()};
+      for (const auto& p : initial->jails) {
+        tmpfs_list.insert({p.second.tmpfs_size, p.second.tmpfs_inodes});
+      }
+      workdirs_->Start(tmpfs_list);
+    }
+
+    run_log_ = std::make_shared<RunLog>(
+        system.storedir,
+        (std::uint64_t)system.run_log_segment_size * 1024 * 1024,
+        system.run_log_compression, shards_->All().front().file_pool);
+    run_log_->Load();
+
+    if (!system.jail_timing_file.empty()) {
+      jail_timing_ = std::make_shared<JailTiming>(
+          shards_->All().front().ioc, system.jail_timing_file,
+          shards_->All().front().file_pool);
+      jail_timing_->Start();
+    }
+
+    zygotes_ = std::make_shared<ZygoteSupervisor>(shards_->All().front().ioc,
+                                                  system.cgroup_root);
+    zygotes_->Start(*initial);
+
+    config_watcher_ = std::make_shared<ConfigWatcher>(
+        shards_->All().front().ioc, shards_->All().front().file_pool,
+        std::move(config_paths), config_store_);
   }
 
   void Start(std::string address, int threads) {
@@ -1363,21 +2201,72 @@ class CattleshedServer {
     SPDLOG_INFO("gRPC Server listening on {}", address);
 
     // ハンドラの登録
-    server_.AddResponseWriterHandler<GetVersionHandler>(&service_, ioc_, sigs_,
-                                                        &config_);
-    server_.AddReaderWriterHandler<RunJobHandler>(&service_, ioc_, sigs_,
-                                                  &config_);
+    server_.AddResponseWriterHandler<GetVersionHandler>(
+        &service_, shards_, cache_, version_cache_, config_store_);
+    server_.AddReaderWriterHandler<RunJobHandler>(
+        &service_, shards_, cache_, scheduler_, workdirs_, run_log_,
+        jail_timing_, config_store_);
 
     server_.Start(builder, threads);
+
+    config_watcher_->Start();
   }
   void Wait() { server_.Wait(); }
 
+  // 各シャードの io_context
+  std::vector<std::shared_ptr<boost::asio::io_context>> GetIoContexts() const {
+    std::vector<std::shared_ptr<boost::asio::io_context>> iocs;
+    for (const auto& shard : shards_->All()) {
+      iocs.push_back(shard.ioc);
+    }
+    return iocs;
+  }
+
  private:
+  // 前回の起動時に cattlegrid --template で作ったルートディレクトリのテンプレートを外しておく。
+  // 設定が変わっていると古いテンプレートはもう使われないし、残しておくとマウントが溜まっていく
+  static void UnmountRootTemplates(const wandbox::server_config& config) {
+    const std::string& cattlegrid = config.system.cattlegrid;
+    if (cattlegrid.empty()) {
+      return;
+    }
+    const std::string option = "--template=";
+    std::vector<std::string> dirs;
+    for (const auto& jail : config.jails) {
+      for (const auto* command :
+           {&jail.second.jail_command, &jail.second.zygote_command}) {
+        for (const auto& arg : *command) {
+          if (arg.compare(0, option.size(), option) != 0) {
+            continue;
+          }
+          const auto dir = arg.substr(option.size());
+          if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+            dirs.push_back(dir);
+          }
+        }
+      }
+    }
+    for (const auto& dir : dirs) {
+      const int st = wandbox::spawn_and_wait(
+          {cattlegrid, "--umount-templates", option + dir});
+      if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+        SPDLOG_WARN("failed to unmount root templates in {}", dir);
+      }
+    }
+  }
+
   ggrpc::Server server_;
   wandbox::cattleshed::Cattleshed::AsyncService service_;
-  std::shared_ptr<boost::asio::io_context> ioc_;
-  std::shared_ptr<boost::asio::signal_set> sigs_;
-  wandbox::server_config config_;
+  std::shared_ptr<CattleshedShards> shards_;
+  std::shared_ptr<CompileCache> cache_;
+  std::shared_ptr<VersionCache> version_cache_;
+  std::shared_ptr<JobScheduler> scheduler_;
+  std::shared_ptr<WorkdirPool> workdirs_;
+  std::shared_ptr<RunLog> run_log_;
+  std::shared_ptr<JailTiming> jail_timing_;
+  std::shared_ptr<ZygoteSupervisor> zygotes_;
+  std::shared_ptr<ConfigStore> config_store_;
+  std::shared_ptr<ConfigWatcher> config_watcher_;
 };
 
 
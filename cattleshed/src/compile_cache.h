@@ -0,0 +1,512 @@
+#ifndef COMPILE_CACHE_H_INCLUDED
+#define COMPILE_CACHE_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Linux
+#include <sys/stat.h>
+
+// Boost
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+
+// OpenSSL
+#include <openssl/evp.h>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "posixapi.hpp"
+
+// コンパイル結果のキャッシュ
+//
+// コンパイラ名、バージョン、実際のコンパイルコマンド、全てのソースから作ったハッシュをキーにして、
+// コンパイル後の store/ の中身と、コンパイラの出力をディスク上に保存しておく。
+//
+// キャッシュディレクトリの構成:
+//   <dir>/<key>/files/   コンパイル後に store/ に増えていたファイル
+//   <dir>/<key>/outputs  コンパイラの標準出力/標準エラー出力を出てきた順に並べたもの
+//   <dir>/<key>/status   コンパイラの終了ステータス
+//
+// ディスクの読み書きは全て thread_pool 上で行い、結果は呼び出し元の io_context に返す。
+class CompileCache : public std::enable_shared_from_this<CompileCache> {
+ public:
+  struct Result {
+    int status = 0;
+    // RunJobResponse::Type と、そのデータ
+    std::vector<std::pair<int, std::string>> outputs;
+  };
+
+  class Ticket;
+
+  // ヒットした場合は result が入っている。
+  // ミスした場合は ticket が入っていて、コンパイルが終わったら ticket->AsyncCommit を呼ぶこと。
+  // 両方 nullptr の場合はキャッシュを使わずにそのままコンパイルすること。
+  typedef std::function<void(std::shared_ptr<const Result> result,
+                             std::shared_ptr<Ticket> ticket)>
+      LookupHandler;
+
+  // キャッシュミスした最初のジョブに渡される。
+  // Commit せずに破棄された場合、同じキーで待っていたジョブは各自でコンパイルする。
+  class Ticket {
+   public:
+    Ticket(std::shared_ptr<CompileCache> cache, std::string key)
+        : cache_(std::move(cache)), key_(std::move(key)) {}
+    ~Ticket() {
+      if (!finished_) {
+        cache_->Abandon(key_);
+      }
+    }
+
+    // storedir 以下の exclude に含まれないファイルと outputs を保存して、
+    // 保存が終わったら ioc 上で handler を呼ぶ
+    void AsyncCommit(std::string storedir,
+                     std::unordered_set<std::string> exclude, Result result,
+                     std::shared_ptr<boost::asio::io_context> ioc,
+                     std::function<void()> handler) {
+      finished_ = true;
+      cache_->Commit(key_, std::move(storedir), std::move(exclude),
+                     std::move(result), std::move(ioc), std::move(handler));
+    }
+
+   private:
+    std::shared_ptr<CompileCache> cache_;
+    std::string key_;
+    bool finished_ = false;
+  };
+
+  CompileCache(std::string dir, std::uint64_t max_size,
+               std::shared_ptr<boost::asio::thread_pool> pool)
+      : dir_(std::move(dir)), max_size_(max_size), pool_(std::move(pool)) {}
+
+  // 起動時に呼ぶ。既存のキャッシュを更新日時順に LRU に積んでおく。
+  void Load() {
+    wandbox::mkdir_p_open_at(nullptr, dir_, 0700);
+    const auto dir = wandbox::opendir(dir_);
+    std::vector<std::pair<::time_t, std::string>> entries;
+    for (auto ent = ::readdir(dir.get()); ent; ent = ::readdir(dir.get())) {
+      const std::string name = ent->d_name;
+      if (name == "." || name == "..") continue;
+      if (name.compare(0, 4, "tmp-") == 0) {
+        // 書き込み途中や削除途中のゴミ
+        wandbox::remove_tree_at(::dirfd(dir.get()), name);
+        continue;
+      }
+      struct stat st;
+      if (::fstatat(::dirfd(dir.get()), name.c_str(), &st, 0) < 0) continue;
+      entries.emplace_back(st.st_mtime, name);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& e : entries) {
+      std::uint64_t size;
+      try {
+        size = DiskUsage(::dirfd(dir.get()), e.second);
+      } catch (std::system_error& ex) {
+        // 大きさが分からないものは使わない
+        SPDLOG_WARN("skip compile cache entry {}: {}", e.second, ex.what());
+        continue;
+      }
+      lru_.push_front(e.second);
+      index_[e.second] = {lru_.begin(), size};
+      total_size_ += size;
+    }
+    SPDLOG_INFO("compile cache loaded: dir={} entries={} size={}", dir_,
+                index_.size(), total_size_);
+    Evict();
+  }
+
+  // GetVersion で取得したバージョンを覚えておく
+  void SetVersions(
+      const std::vector<std::pair<std::string, std::string>>& versions) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& v : versions) {
+      versions_[v.first] = v.second;
+    }
+  }
+
+  // バージョンが分からないコンパイラはキャッシュしない
+  boost::optional<std::string> GetVersion(const std::string& compiler) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = versions_.find(compiler);
+    if (it == versions_.end()) {
+      return boost::none;
+    }
+    return it->second;
+  }
+
+  // 各要素の長さも含めてハッシュを取るので、区切り位置が違うだけの入力は別のキーになる
+  static std::string MakeKey(const std::vector<std::string>& parts) {
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx(
+        ::EVP_MD_CTX_new(), &::EVP_MD_CTX_free);
+    ::EVP_DigestInit_ex(ctx.get(), ::EVP_sha256(), nullptr);
+    for (const auto& part : parts) {
+      const std::uint64_t len = part.size();
+      ::EVP_DigestUpdate(ctx.get(), &len, sizeof(len));
+      ::EVP_DigestUpdate(ctx.get(), part.data(), part.size());
+    }
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen = 0;
+    ::EVP_DigestFinal_ex(ctx.get(), md, &mdlen);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string key;
+    for (unsigned int i = 0; i < mdlen; i++) {
+      key.push_back(hex[md[i] >> 4]);
+      key.push_back(hex[md[i] & 0xf]);
+    }
+    return key;
+  }
+
+  // key のキャッシュを探して、見つかったら storedir にファイルを復元する
+  void AsyncLookup(std::string key, std::string storedir,
+                   std::shared_ptr<boost::asio::io_context> ioc,
+                   LookupHandler handler) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      // ヒットした
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      ++hits_;
+      lock.unlock();
+      SPDLOG_INFO("compile cache hit: key={} hits={} misses={} merged={}", key,
+                  hits_.load(), misses_.load(), merged_.load());
+      AsyncRestore(std::move(key), std::move(storedir), std::move(ioc),
+                   std::move(handler));
+      return;
+    }
+
+    auto it2 = inflight_.find(key);
+    if (it2 != inflight_.end()) {
+      // 同じキーでコンパイル中のジョブがいるので、その結果を待つ
+      ++merged_;
+      it2->second.push_back(
+          {std::move(storedir), std::move(ioc), std::move(handler)});
+      SPDLOG_INFO("compile cache merged: key={} hits={} misses={} merged={}",
+                  key, hits_.load(), misses_.load(), merged_.load());
+      return;
+    }
+
+    // ミスしたので、このジョブにコンパイルしてもらう
+    ++misses_;
+    inflight_[key];
+    lock.unlock();
+    SPDLOG_INFO("compile cache miss: key={} hits={} misses={} merged={}", key,
+                hits_.load(), misses_.load(), merged_.load());
+    auto ticket = std::make_shared<Ticket>(shared_from_this(), std::move(key));
+    boost::asio::post(*ioc, [handler = std::move(handler), ticket]() {
+      handler(nullptr, ticket);
+    });
+  }
+
+ private:
+  struct Waiter {
+    std::string storedir;
+    std::shared_ptr<boost::asio::io_context> ioc;
+    LookupHandler handler;
+  };
+  struct IndexEntry {
+    std::list<std::string>::iterator lru;
+    std::uint64_t size;
+  };
+
+  // name 以下にある通常ファイルの合計サイズ。
+  // copy_tree_at と同じく、深すぎるディレクトリがあったら ELOOP の例外を投げる
+  static std::uint64_t DiskUsage(int at, const std::string& name) {
+    std::uint64_t size = 0;
+    std::vector<std::shared_ptr<DIR>> stack;
+    const auto enter = [&stack, &size](int parent, const char* n) {
+      const int fd = ::openat(parent, n,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd == -1) {
+        struct stat st;
+        if (::fstatat(parent, n, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(st.st_mode)) {
+          size += st.st_size;
+        }
+        return;
+      }
+      if (stack.size() >= wandbox::tree_depth_max) {
+        ::close(fd);
+        wandbox::throw_system_error(ELOOP);
+      }
+      DIR* d = ::fdopendir(fd);
+      if (!d) {
+        ::close(fd);
+        return;
+      }
+      stack.emplace_back(d, &::closedir);
+    };
+
+    enter(at, name.c_str());
+    while (!stack.empty()) {
+      DIR* dir = stack.back().get();
+      const auto ent = ::readdir(dir);
+      if (!ent) {
+        stack.pop_back();
+        continue;
+      }
+      if (::strcmp(ent->d_name, ".") == 0 || ::strcmp(ent->d_name, "..") == 0)
+        continue;
+      enter(::dirfd(dir), ent->d_name);
+    }
+    return size;
+  }
+
+  static void WriteFile(int at, const std::string& name,
+                        const std::string& data) {
+    const wandbox::unique_fd fd(
+        ::openat(at, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 0600));
+    if (!fd) wandbox::throw_system_error(errno);
+    for (std::size_t off = 0; off < data.size();) {
+      const auto n = ::write(fd.get(), data.data() + off, data.size() - off);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        wandbox::throw_system_error(errno);
+      }
+      off += n;
+    }
+  }
+
+  static std::string ReadFile(int at, const std::string& name) {
+    const wandbox::unique_fd fd(
+        ::openat(at, name.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd) wandbox::throw_system_error(errno);
+    std::string data;
+    char buf[65536];
+    while (true) {
+      const auto n = ::read(fd.get(), buf, sizeof(buf));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        wandbox::throw_system_error(errno);
+      }
+      if (n == 0) break;
+      data.append(buf, n);
+    }
+    return data;
+  }
+
+  // outputs ファイルの中身は [type:int32][length:uint64][data] の繰り返し
+  static std::string SerializeOutputs(
+      const std::vector<std::pair<int, std::string>>& outputs) {
+    std::string data;
+    for (const auto& o : outputs) {
+      const std::int32_t type = o.first;
+      const std::uint64_t len = o.second.size();
+      data.append(reinterpret_cast<const char*>(&type), sizeof(type));
+      data.append(reinterpret_cast<const char*>(&len), sizeof(len));
+      data.append(o.second);
+    }
+    return data;
+  }
+
+  static std::vector<std::pair<int, std::string>> DeserializeOutputs(
+      const std::string& data) {
+    std::vector<std::pair<int, std::string>> outputs;
+    std::size_t pos = 0;
+    while (pos < data.size()) {
+      std::int32_t type;
+      std::uint64_t len;
+      if (data.size() - pos < sizeof(type) + sizeof(len)) {
+        throw std::runtime_error("broken compile cache outputs");
+      }
+      ::memcpy(&type, data.data() + pos, sizeof(type));
+      pos += sizeof(type);
+      ::memcpy(&len, data.data() + pos, sizeof(len));
+      pos += sizeof(len);
+      if (data.size() - pos < len) {
+        throw std::runtime_error("broken compile cache outputs");
+      }
+      outputs.emplace_back(type, data.substr(pos, len));
+      pos += len;
+    }
+    return outputs;
+  }
+
+  void AsyncRestore(std::string key, std::string storedir,
+                    std::shared_ptr<boost::asio::io_context> ioc,
+                    LookupHandler handler) {
+    boost::asio::post(*pool_, [self = shared_from_this(),
+                               key = std::move(key),
+                               storedir = std::move(storedir),
+                               ioc = std::move(ioc),
+                               handler = std::move(handler)]() {
+      std::shared_ptr<Result> result;
+      try {
+        const auto dir = wandbox::opendir(self->dir_ + "/" + key);
+        const auto store = wandbox::opendir(storedir);
+        auto r = std::make_shared<Result>();
+        r->status = std::stoi(ReadFile(::dirfd(dir.get()), "status"));
+        r->outputs = DeserializeOutputs(ReadFile(::dirfd(dir.get()), "outputs"));
+        wandbox::copy_tree_at(::dirfd(dir.get()), "files", ::dirfd(store.get()),
+                              ".", nullptr);
+        // 更新日時を LRU の順番として使うので触っておく
+        ::utimensat(::dirfd(dir.get()), ".", nullptr, 0);
+        result = r;
+      } catch (std::exception& e) {
+        // 途中で追い出された場合なども、キャッシュを使わずにコンパイルしてもらう
+        SPDLOG_WARN("failed to restore compile cache: key={} error={}", key,
+                    e.what());
+      }
+      boost::asio::post(*ioc, [handler, result]() { handler(result, nullptr); });
+    });
+  }
+
+  void Commit(std::string key, std::string storedir,
+              std::unordered_set<std::string> exclude, Result result,
+              std::shared_ptr<boost::asio::io_context> ioc,
+              std::function<void()> handler) {
+    boost::asio::post(*pool_, [self = shared_from_this(), key = std::move(key),
+                               storedir = std::move(storedir),
+                               exclude = std::move(exclude),
+                               result = std::move(result), ioc = std::move(ioc),
+                               handler = std::move(handler)]() {
+      const std::string tmpname = "tmp-" + key;
+      std::uint64_t size = 0;
+      bool ok = false;
+      try {
+        const auto dir = wandbox::opendir(self->dir_);
+        const int dirfd = ::dirfd(dir.get());
+        wandbox::remove_tree_at(dirfd, tmpname);
+        wandbox::mkdirat(dir, tmpname, 0700);
+        const auto tmpdir = wandbox::opendirat(dir, tmpname);
+        const auto store = wandbox::opendir(storedir);
+
+        // ソースファイルは復元時に必ず存在するので保存しない
+        size += wandbox::copy_tree_at(
+            ::dirfd(store.get()), ".", ::dirfd(tmpdir.get()), "files",
+            [&exclude](const std::string& path) {
+              return exclude.count(path) == 0;
+            });
+        const auto outputs = SerializeOutputs(result.outputs);
+        size += outputs.size();
+        WriteFile(::dirfd(tmpdir.get()), "outputs", outputs);
+        WriteFile(::dirfd(tmpdir.get()), "status",
+                  std::to_string(result.status));
+
+        if (size > self->max_size_ / 4) {
+          // 大きすぎるものは他のキャッシュを追い出してしまうので保存しない
+          SPDLOG_INFO("compile cache too large: key={} size={}", key, size);
+          wandbox::remove_tree_at(dirfd, tmpname);
+        } else {
+          if (::renameat(dirfd, tmpname.c_str(), dirfd, key.c_str()) < 0) {
+            wandbox::throw_system_error(errno);
+          }
+          ok = true;
+        }
+      } catch (std::exception& e) {
+        // 読めないファイルがあった場合などはキャッシュしない
+        SPDLOG_WARN("failed to store compile cache: key={} error={}", key,
+                    e.what());
+        try {
+          wandbox::remove_tree_at(::dirfd(wandbox::opendir(self->dir_).get()),
+                                  tmpname);
+        } catch (std::exception&) {
+        }
+      }
+
+      if (ok) {
+        std::vector<Waiter> waiters;
+        {
+          std::lock_guard<std::mutex> lock(self->mutex_);
+          self->lru_.push_front(key);
+          self->index_[key] = {self->lru_.begin(), size};
+          self->total_size_ += size;
+          auto it = self->inflight_.find(key);
+          if (it != self->inflight_.end()) {
+            waiters = std::move(it->second);
+            self->inflight_.erase(it);
+          }
+          self->Evict();
+        }
+        SPDLOG_INFO("compile cache stored: key={} size={} waiters={}", key,
+                    size, waiters.size());
+        for (auto& w : waiters) {
+          self->AsyncRestore(key, std::move(w.storedir), std::move(w.ioc),
+                             std::move(w.handler));
+        }
+      } else {
+        self->Abandon(key);
+      }
+      boost::asio::post(*ioc, handler);
+    });
+  }
+
+  // 待っていたジョブには各自でコンパイルしてもらう
+  void Abandon(const std::string& key) {
+    std::vector<Waiter> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = inflight_.find(key);
+      if (it == inflight_.end()) {
+        return;
+      }
+      waiters = std::move(it->second);
+      inflight_.erase(it);
+    }
+    for (auto& w : waiters) {
+      boost::asio::post(*w.ioc, [handler = std::move(w.handler)]() {
+        handler(nullptr, nullptr);
+      });
+    }
+  }
+
+  // mutex_ をロックした状態で呼ぶこと
+  void Evict() {
+    static std::atomic<std::uint64_t> counter{0};
+    while (total_size_ > max_size_ && !lru_.empty()) {
+      const std::string key = lru_.back();
+      lru_.pop_back();
+      total_size_ -= index_[key].size;
+      index_.erase(key);
+
+      // 先にリネームしておけば、同じキーで新しく保存し直されても問題ない
+      const std::string tmpname =
+          "tmp-evict-" + std::to_string(counter++) + "-" + key;
+      const std::string from = dir_ + "/" + key;
+      const std::string to = dir_ + "/" + tmpname;
+      if (::rename(from.c_str(), to.c_str()) < 0) {
+        SPDLOG_WARN("failed to rename evicted compile cache: key={} errno={}",
+                    key, errno);
+        continue;
+      }
+      SPDLOG_INFO("compile cache evicted: key={}", key);
+      boost::asio::post(*pool_, [dir = dir_, tmpname]() {
+        try {
+          wandbox::remove_tree_at(AT_FDCWD, dir + "/" + tmpname);
+        } catch (std::exception& e) {
+          SPDLOG_WARN("failed to remove evicted compile cache: {}", e.what());
+        }
+      });
+    }
+  }
+
+  std::string dir_;
+  std::uint64_t max_size_;
+  std::shared_ptr<boost::asio::thread_pool> pool_;
+
+  mutable std::mutex mutex_;
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, IndexEntry> index_;
+  std::unordered_map<std::string, std::vector<Waiter>> inflight_;
+  std::unordered_map<std::string, std::string> versions_;
+  std::uint64_t total_size_ = 0;
+  std::atomic<std::uint64_t> hits_{0};
+  std::atomic<std::uint64_t> misses_{0};
+  std::atomic<std::uint64_t> merged_{0};
+};
+
+#endif  // COMPILE_CACHE_H_INCLUDED
@@ -0,0 +1,234 @@
+#ifndef CONFIG_WATCHER_H_INCLUDED
+#define CONFIG_WATCHER_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Linux
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+// Boost
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "load_config.hpp"
+#include "posixapi.hpp"
+
+// 現在の設定
+//
+// 設定は読み込んだ後は変更しないので、各ジョブは開始時に Get() したものをずっと使えば良い。
+// 設定が読み直された場合は新しいジョブから新しい設定が使われる。
+class ConfigStore {
+ public:
+  explicit ConfigStore(std::shared_ptr<const wandbox::server_config> config)
+      : config_(std::move(config)) {}
+
+  std::shared_ptr<const wandbox::server_config> Get() const {
+    return std::atomic_load(&config_);
+  }
+  void Set(std::shared_ptr<const wandbox::server_config> config) {
+    std::atomic_store(&config_, std::move(config));
+  }
+
+ private:
+  std::shared_ptr<const wandbox::server_config> config_;
+};
+
+// 設定ファイルを inotify で監視して、変更されたら読み直して ConfigStore を差し替える
+//
+// 読み込みは thread_pool 上で行うので、io_context をブロックしない。
+// 読み込みに失敗した場合は今の設定をそのまま使い続ける。
+// system の設定（ポート番号や basedir など）は起動時のものから変えられないので、読み直しても反映しない。
+class ConfigWatcher : public std::enable_shared_from_this<ConfigWatcher> {
+ public:
+  ConfigWatcher(std::shared_ptr<boost::asio::io_context> ioc,
+                std::shared_ptr<boost::asio::thread_pool> pool,
+                std::vector<std::string> paths,
+                std::shared_ptr<ConfigStore> store)
+      : ioc_(ioc),
+        pool_(std::move(pool)),
+        paths_(std::move(paths)),
+        store_(std::move(store)),
+        timer_(*ioc) {}
+
+  void Start() {
+    boost::asio::post(*ioc_, [self = shared_from_this()]() { self->Watch(); });
+  }
+
+ private:
+  // エディタはファイルを rename で置き換えることが多いので、ファイルの場合は親ディレクトリを監視する
+  void Watch() {
+    if (desc_) {
+      desc_->close();
+      desc_.reset();
+    }
+    filters_.clear();
+
+    int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+      SPDLOG_ERROR("failed to inotify_init1 for config: {}", errno);
+      return;
+    }
+    desc_ = std::make_shared<boost::asio::posix::stream_descriptor>(*ioc_, fd);
+
+    for (const auto& path : paths_) {
+      struct stat st;
+      if (::stat(path.c_str(), &st) < 0) {
+        SPDLOG_WARN("failed to stat config {}: {}", path, errno);
+        continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+        AddDirectory(path);
+      } else {
+        const auto pos = path.find_last_of('/');
+        const std::string dir =
+            pos == std::string::npos ? "." : pos == 0 ? "/" : path.substr(0, pos);
+        const std::string name =
+            pos == std::string::npos ? path : path.substr(pos + 1);
+        AddWatch(dir, name);
+      }
+    }
+
+    buf_.resize(8192);
+    DoRead();
+  }
+
+  // 設定ディレクトリはサブディレクトリも含めて全部読まれるので、全部監視する
+  void AddDirectory(const std::string& path) {
+    AddWatch(path, "");
+    std::shared_ptr<DIR> dir;
+    try {
+      dir = wandbox::opendir(path);
+    } catch (std::system_error& e) {
+      return;
+    }
+    for (auto ent = ::readdir(dir.get()); ent; ent = ::readdir(dir.get())) {
+      if (::strcmp(ent->d_name, ".") == 0 || ::strcmp(ent->d_name, "..") == 0)
+        continue;
+      const std::string sub = path + "/" + ent->d_name;
+      struct stat st;
+      if (::stat(sub.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        AddDirectory(sub);
+      }
+    }
+  }
+
+  void AddWatch(const std::string& dir, const std::string& name) {
+    const int wd = ::inotify_add_watch(
+        desc_->native_handle(), dir.c_str(),
+        IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if (wd < 0) {
+      SPDLOG_WARN("failed to inotify_add_watch {}: {}", dir, errno);
+      return;
+    }
+    SPDLOG_INFO("watching config {}", name.empty() ? dir : dir + "/" + name);
+    // 同じディレクトリを複数回監視した場合、どれかがディレクトリ全体なら全体を見る
+    auto it = filters_.find(wd);
+    if (it == filters_.end()) {
+      filters_[wd] = {name};
+    } else if (!it->second.empty()) {
+      if (name.empty()) {
+        it->second.clear();
+      } else {
+        it->second.push_back(name);
+      }
+    }
+  }
+
+  void DoRead() {
+    desc_->async_read_some(
+        boost::asio::buffer(buf_),
+        [self = shared_from_this(), desc = desc_](
+            const boost::system::error_code& ec, std::size_t n) {
+          self->OnRead(desc, ec, n);
+        });
+  }
+
+  void OnRead(std::shared_ptr<boost::asio::posix::stream_descriptor> desc,
+              const boost::system::error_code& ec, std::size_t n) {
+    // 監視し直したので古い方は無視する
+    if (desc != desc_) {
+      return;
+    }
+    if (ec) {
+      SPDLOG_ERROR("failed to read config events: {}", ec.message());
+      return;
+    }
+
+    bool changed = false;
+    for (std::size_t off = 0; off < n;) {
+      auto event = (const inotify_event*)(buf_.data() + off);
+      off += sizeof(inotify_event) + event->len;
+      const auto it = filters_.find(event->wd);
+      if (it == filters_.end()) {
+        continue;
+      }
+      if (it->second.empty()) {
+        changed = true;
+        continue;
+      }
+      const std::string name = event->len != 0 ? event->name : "";
+      for (const auto& f : it->second) {
+        if (f == name) {
+          changed = true;
+        }
+      }
+    }
+
+    if (changed) {
+      // 保存途中の中途半端な状態を読まないように、変更が落ち着くまで少し待つ
+      timer_.expires_after(std::chrono::milliseconds(500));
+      timer_.async_wait([self = shared_from_this()](
+                            const boost::system::error_code& ec) {
+        if (!ec) {
+          self->Reload();
+        }
+      });
+    }
+
+    DoRead();
+  }
+
+  void Reload() {
+    boost::asio::post(*pool_, [self = shared_from_this()]() {
+      std::shared_ptr<wandbox::server_config> config;
+      try {
+        config = std::make_shared<wandbox::server_config>(
+            wandbox::load_config(self->paths_));
+      } catch (std::exception& e) {
+        SPDLOG_ERROR("failed to reload config, keep current one: {}",
+                     e.what());
+      }
+      boost::asio::post(*self->ioc_, [self, config]() {
+        if (config) {
+          const auto current = self->store_->Get();
+          config->system = current->system;
+          self->store_->Set(config);
+          SPDLOG_INFO("config reloaded: {} compilers",
+                      config->compilers.size());
+        }
+        // サブディレクトリが増えたりしているかもしれないので監視し直す
+        self->Watch();
+      });
+    });
+  }
+
+  std::shared_ptr<boost::asio::io_context> ioc_;
+  std::shared_ptr<boost::asio::thread_pool> pool_;
+  std::vector<std::string> paths_;
+  std::shared_ptr<ConfigStore> store_;
+  boost::asio::steady_timer timer_;
+
+  std::shared_ptr<boost::asio::posix::stream_descriptor> desc_;
+  std::unordered_map<int, std::vector<std::string>> filters_;
+  std::vector<char> buf_;
+};
+
+#endif  // CONFIG_WATCHER_H_INCLUDED
@@ -3,20 +3,29 @@
 #include <getopt.h>
 #include <grp.h>
 #include <libgen.h>
+#include <limits.h>
 #include <linux/securebits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/capability.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <boost/asio.hpp>
@@ -24,12 +33,43 @@
 #include <boost/fusion/adapted/std_pair.hpp>
 #include <boost/optional.hpp>
 #include <boost/spirit/include/qi.hpp>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <iterator>
+#include <map>
 #include <random>
 #include <string>
 #include <vector>
 
+#include "session_phase.h"
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#endif
+#ifndef MOUNT_ATTR_NOSUID
+#define MOUNT_ATTR_NOSUID 0x00000002
+#endif
+#ifndef MOUNT_ATTR_IDMAP
+#define MOUNT_ATTR_IDMAP 0x00100000
+#endif
+// --mount-tmpfs と --umount-tmpfs は、このディレクトリの下の作業ディレクトリにしか使えない。
+// --template のディレクトリもこの下に置く。
+// 呼び出し側に指定させると好きな場所をマウントできてしまうので、ビルド時に決める
+#ifndef CATTLESHED_BASEDIR
+#define CATTLESHED_BASEDIR "/tmp/wandbox"
+#endif
+
 namespace wandbox {
 namespace jail {
 int wait_and_forward_signals(int primary_child_pid, bool wait_grandchilds) {
@@ -78,6 +118,67 @@ int wait_and_forward_signals(int primary_child_pid, bool wait_grandchilds) {
   for (int n = 0; n < 256; ++n) sigaction(n, &actions[n], nullptr);
   return ret;
 }
+// --timing が指定された場合に、サンドボックスの準備にかかった時間を計測する
+//
+// --timing-fd が指定された場合は、各フェーズが終わった時刻（CLOCK_MONOTONIC の us）を
+// " start:<us> caps:<us> clone:<us> ... exec:<us>\n" の１行にしてその fd に書く。
+// cattleshed はこれをジョブごとに読んで、フェーズごとに集計する。
+// --attach の場合は、cattlegrid --attach が書いた続きをサンドボックスが書いて１行にする。
+struct phase_timer {
+  bool enabled = false;
+  int fd = -1;
+  timespec last = {};
+  std::string report;
+  std::string record;
+  static long long elapsed_us(const timespec& from, const timespec& to) {
+    return (to.tv_sec - from.tv_sec) * 1000000LL +
+           (to.tv_nsec - from.tv_nsec) / 1000;
+  }
+  bool active() const { return enabled || fd != -1; }
+  void start() {
+    if (!active()) return;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    append("start", last);
+  }
+  // 前回から今までにかかった時間を phase の時間として記録する
+  void mark(const std::string& phase) {
+    if (!active()) return;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (enabled) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), " %s=%lldus", phase.c_str(),
+               elapsed_us(last, now));
+      report += buf;
+    }
+    append(phase, now);
+    last = now;
+  }
+  void append(const std::string& phase, const timespec& t) {
+    if (fd == -1) return;
+    record += " " + phase + ":" +
+              std::to_string(t.tv_sec * 1000000LL + t.tv_nsec / 1000);
+  }
+  // ここまでの記録を fd に書く。続きを他のプロセスが書く場合は改行を付けない。
+  // PIPE_BUF より短ければ一度に書かれるので、他のジョブの記録と混ざることは無い
+  void emit(bool finish) {
+    if (fd == -1) return;
+    if (finish) record += '\n';
+    if (write(fd, record.data(), record.size()) == -1) perror("timing-fd");
+    record.clear();
+  }
+  void close_fd() {
+    if (fd != -1) close(fd);
+    fd = -1;
+  }
+  void print(const timespec& begin) const {
+    if (!enabled) return;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "cattlegrid: setup %lldus:%s\n", elapsed_us(begin, now),
+            report.c_str());
+  }
+};
 struct mount_target {
   std::string realdir;
   std::string mountpoint;
@@ -87,6 +188,8 @@ struct device_file {
   std::string filename;
   mode_t mode;
   dev_t dev;
+  // ホストでのパス。テンプレートにはこれをバインドマウントする
+  std::string source;
 };
 struct proc_arg_t {
   std::string rootdir;
@@ -96,7 +199,21 @@ struct proc_arg_t {
   bool kill_grandchilds;
   int pipefd[2];
   unsigned newuid;
+  // 作業ディレクトリのファイルを newuid の物に見せるための user namespace
+  // 使えない場合は -1 で、chown_r で所有者を書き換える
+  int idmap_userns_fd;
+  phase_timer timer;
+  timespec started;
+  // 読み込み専用のルートディレクトリのテンプレート。空なら使わない
+  std::string root_template;
   char** argv;
+  // --session: コンパイルと実行を同じサンドボックスで行う
+  bool session;
+  // zygote のプールから渡された network namespace。-1 なら CLONE_NEWNET で作る
+  int netns_fd;
+  // --tmpfs-size と --tmpfs-inodes。0 なら指定なし
+  unsigned long tmpfs_size;
+  unsigned long tmpfs_inodes;
 };
 __attribute__((noreturn)) void exit_error(const char* str) {
   perror(str);
@@ -112,27 +229,41 @@ void clear_all_caps() {
   if (cap_set_proc(caps) == -1) exit_error("cap_set_proc");
   cap_free(caps);
 }
+// mkdir -p と同じ。プロセスを作らずに親から順に mkdir していく
 int mkdir_p(const char* name) {
-  if (const int pid = vfork()) {
-    if (pid == -1) return -1;
-    int st;
-    waitpid(pid, &st, 0);
-    return (WIFEXITED(st) && WEXITSTATUS(st) == 0) ? 0 : -1;
-  } else {
-    execl("/bin/mkdir", "/bin/mkdir", "-p", name, (void*)0);
-    _exit(1);
+  std::string path(name);
+  for (std::size_t pos = 1; pos <= path.size(); ++pos) {
+    if (pos != path.size() && path[pos] != '/') continue;
+    if (path[pos - 1] == '/') continue;
+    const std::string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return -1;
   }
+  struct stat st;
+  if (stat(name, &st) == -1) return -1;
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  return 0;
 }
+// rm -rf と同じ。シンボリックリンクは辿らない
 int rm_rf(const char* name) {
-  if (const int pid = vfork()) {
-    if (pid == -1) return -1;
-    int st;
-    waitpid(pid, &st, 0);
-    return (WIFEXITED(st) && WEXITSTATUS(st) == 0) ? 0 : -1;
-  } else {
-    execl("/bin/rm", "/bin/rm", "-rf", name, (void*)0);
-    _exit(1);
-  }
+  static bool (*const f)(int, const char*) = [](int at, const char* name) {
+    if (unlinkat(at, name, 0) == 0 || errno == ENOENT) return true;
+    if (errno != EISDIR) return false;
+    const int fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1) return false;
+    DIR* d = fdopendir(fd);
+    if (!d) return close(fd), false;
+    bool failed = false;
+    while (auto p = readdir(d)) {
+      if (strcmp(p->d_name, ".") == 0 || strcmp(p->d_name, "..") == 0) continue;
+      failed |= !f(dirfd(d), p->d_name);
+    }
+    closedir(d);
+    return unlinkat(at, name, AT_REMOVEDIR) == 0 && !failed;
+  };
+  return f(AT_FDCWD, name) ? 0 : -1;
 }
 int chown_r(const char* name, unsigned uid, unsigned gid) {
   static bool (*const f)(unsigned, unsigned, DIR*) = [](unsigned uid,
@@ -153,6 +284,86 @@ int chown_r(const char* name, unsigned uid, unsigned gid) {
   chown(name, uid, gid);
   return f(uid, gid, opendir(name)) ? 0 : -1;
 }
+// from_uid/from_gid のファイルを to のファイルとして見せるための user namespace を作る。
+// 中身の無いプロセスを新しい user namespace で作って、マッピングを書き込んでから fd だけ取っておく。
+int make_idmap_userns(unsigned from_uid, unsigned from_gid, unsigned to) {
+  static char stack[4096];
+  const int pid = ::clone(
+      [](void*) -> int {
+        for (;;) pause();
+      },
+      stack + sizeof(stack), SIGCHLD | CLONE_NEWUSER, nullptr);
+  if (pid == -1) return -1;
+  const auto write_map = [pid](const char* file, unsigned inner,
+                               unsigned outer) {
+    const auto path = (boost::format("/proc/%1%/%2%") % pid % file).str();
+    const auto map = (boost::format("%1% %2% 1\n") % inner % outer).str();
+    const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    const bool ok = write(fd, map.data(), map.size()) == (ssize_t)map.size();
+    close(fd);
+    return ok;
+  };
+  int fd = -1;
+  if (write_map("uid_map", from_uid, to) && write_map("gid_map", from_gid, to))
+    fd = open((boost::format("/proc/%1%/ns/user") % pid).str().c_str(),
+              O_RDONLY | O_CLOEXEC);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return fd;
+}
+// src を複製した、まだどこにも付いていないマウントを作って、その fd を返す。
+// userns_fd が -1 でなければ idmapped mount にする。
+// 作ったマウントは別の mount namespace に渡して、そこで付けることもできる。
+// カーネルやファイルシステムが対応していなければ -1 を返す。
+int open_detached_bind(const std::string& src, bool writable, int userns_fd) {
+#if defined(SYS_open_tree) && defined(SYS_mount_setattr)
+  struct {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+  } attr = {(uint64_t)((userns_fd != -1 ? MOUNT_ATTR_IDMAP : 0) |
+                       MOUNT_ATTR_NOSUID | (writable ? 0 : MOUNT_ATTR_RDONLY)),
+            0, 0, (uint64_t)(userns_fd != -1 ? userns_fd : 0)};
+  const int fd = syscall(SYS_open_tree, AT_FDCWD, src.c_str(),
+                         OPEN_TREE_CLONE | AT_SYMLINK_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) return -1;
+  if (syscall(SYS_mount_setattr, fd, "", AT_EMPTY_PATH, &attr, sizeof(attr)) ==
+      -1) {
+    const int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return fd;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+// open_detached_bind で作ったマウントを dst に付ける。fd は閉じる
+int attach_detached_mount(int fd, const std::string& dst) {
+#if defined(SYS_move_mount)
+  const int r = syscall(SYS_move_mount, fd, "", AT_FDCWD, dst.c_str(),
+                        MOVE_MOUNT_F_EMPTY_PATH);
+#else
+  const int r = -1;
+  errno = ENOSYS;
+#endif
+  const int e = errno;
+  close(fd);
+  errno = e;
+  return r == -1 ? -1 : 0;
+}
+// src を idmapped mount として dst にマウントする。
+// カーネルやファイルシステムが対応していなければ -1 を返す。
+int idmapped_bind(const std::string& src, const std::string& dst, bool writable,
+                  int userns_fd) {
+  const int fd = open_detached_bind(src, writable, userns_fd);
+  if (fd == -1) return -1;
+  return attach_detached_mount(fd, dst);
+}
 std::string catpath(const std::string& dir, const std::string& file) {
   if (file.empty()) return dir;
   if (dir.empty()) return file;
@@ -160,102 +371,776 @@ std::string catpath(const std::string& dir, const std::string& file) {
   if (file.front() == '/' || dir.back() == '/') return dir + file;
   return dir + "/" + file;
 }
+// テンプレートに含める（どのジョブでも同じ）マウントかどうか
+bool is_template_mount(const mount_target& m) {
+  return !m.writable && !m.realdir.empty() && m.realdir.front() == '/';
+}
+// CATTLESHED_BASEDIR の本当のパスに "/" を付けたもの
+std::string basedir_prefix() {
+  char* base = realpath(CATTLESHED_BASEDIR, nullptr);
+  if (!base) exit_error("realpath " CATTLESHED_BASEDIR);
+  const std::string r = std::string(base) + "/";
+  free(base);
+  return r;
+}
+// CATTLESHED_BASEDIR の下のディレクトリ dir を開いて、呼び出したユーザの物になっているか確かめる。
+// 開いた fd を返して、シンボリックリンクを辿った本当のパスを realdir に入れる
+int open_in_basedir(const std::string& dir, std::string& realdir) {
+  const int fd =
+      open(dir.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) exit_error(("open " + dir).c_str());
+  char buf[PATH_MAX];
+  const ssize_t n = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(),
+                             buf, sizeof(buf));
+  if (n == -1 || n == sizeof(buf)) exit_error(("readlink " + dir).c_str());
+  realdir.assign(buf, n);
+  const auto prefix = basedir_prefix();
+  if (realdir.compare(0, prefix.size(), prefix) != 0 ||
+      realdir.find_first_of(" \t\n\\") != std::string::npos)
+    exit_fail((dir + " is not in " CATTLESHED_BASEDIR).c_str());
+  struct stat st;
+  if (fstat(fd, &st) == -1) exit_error(("stat " + dir).c_str());
+  if (st.st_uid != getuid())
+    exit_fail((dir + " is not owned by caller").c_str());
+  return fd;
+}
+// cattleshed の作業ディレクトリ（<basedir>/wandbox_* か <basedir>/xx/wandbox_*）を開く
+int open_workdir(const std::string& dir, std::string& realdir) {
+  const int fd = open_in_basedir(dir, realdir);
+  auto name = realdir.substr(basedir_prefix().size());
+  if (name.size() > 3 && name[2] == '/') name = name.substr(3);
+  if (name.compare(0, 8, "wandbox_") != 0 || name.find('/') != std::string::npos)
+    exit_fail((dir + " is not a workdir in " CATTLESHED_BASEDIR).c_str());
+  return fd;
+}
+// /proc/self/mountinfo のマウントポイントと、ファイルシステムの種類とソースを
+// "tmpfs cattlegrid-workdir" のようにつなげたものの組。
+// 後から重ねてマウントされたものほど後ろに並ぶ
+std::vector<std::pair<std::string, std::string> > read_mountinfo() {
+  FILE* f = fopen("/proc/self/mountinfo", "re");
+  if (!f) exit_error("open /proc/self/mountinfo");
+  std::vector<std::pair<std::string, std::string> > r;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    // 5 番目がマウントポイントで、" - " の後ろが種類とソース
+    char mp[4096], fstype[256], source[4096];
+    const char* sep = strstr(line, " - ");
+    if (!sep || sscanf(line, "%*s %*s %*s %*s %4095s", mp) != 1 ||
+        sscanf(sep + 3, "%255s %4095s", fstype, source) != 2)
+      continue;
+    r.emplace_back(mp, std::string(fstype) + " " + source);
+  }
+  fclose(f);
+  return r;
+}
+// path にいちばん上にマウントされているものの種類とソース。マウントポイントでなければ空文字列
+std::string mount_source_at(const std::string& path) {
+  std::string r;
+  for (const auto& m : read_mountinfo())
+    if (m.first == path) r = m.second;
+  return r;
+}
+// mount_workdir_tmpfs でマウントしたことが分かるように、マウントのソースに付けておく名前
+const char* const workdir_tmpfs_source = "cattlegrid-workdir";
+// 同じように prepare_root_template で作ったテンプレートに付けておく名前
+const char* const template_source = "cattlegrid-template";
+// --devices で作れるデバイス。テンプレートにはホストのこのパスの物をバインドマウントする
+const struct {
+  const char* path;
+  unsigned major;
+  unsigned minor;
+} allowed_devices[] = {
+    {"/dev/null", 1, 3},   {"/dev/zero", 1, 5},    {"/dev/full", 1, 7},
+    {"/dev/random", 1, 8}, {"/dev/urandom", 1, 9}, {"/dev/tty", 5, 0},
+};
+// dev が作って良いキャラクタデバイスならホストでのパスを返す。だめなら nullptr
+const char* allowed_device_path(dev_t dev) {
+  for (const auto& d : allowed_devices)
+    if (makedev(d.major, d.minor) == dev) return d.path;
+  return nullptr;
+}
+// テンプレートの名前に使う、設定の SHA-256 の 16 進数表記
+std::string sha256_hex(const std::string& data) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen = 0;
+  if (EVP_Digest(data.data(), data.size(), md, &mdlen, EVP_sha256(),
+                 nullptr) != 1)
+    exit_fail("cattlegrid: EVP_Digest failed");
+  static const char hex[] = "0123456789abcdef";
+  std::string r;
+  for (unsigned int i = 0; i < mdlen; ++i) {
+    r.push_back(hex[md[i] >> 4]);
+    r.push_back(hex[md[i] & 0xf]);
+  }
+  return r;
+}
+// 読み込み専用のマウントとデバイスファイルを全部済ませたルートディレクトリを作っておく。
+// 設定ごとに template_dir/<設定の SHA-256> に１度だけ作って、以降のジョブはそれを複製して使う。
+// template_dir は CATTLESHED_BASEDIR の下で、呼び出したユーザしか入れないようにする。
+// テンプレートは nosuid,nodev で、デバイスファイルは作らずにホストの /dev の物をバインドマウントするので、
+// ホストから見えていても、呼び出したユーザのデバイスファイルができることは無い。
+// 作れなかった場合は空文字列を返す。
+std::string prepare_root_template(const std::string& template_dir,
+                                  const proc_arg_t& arg) {
+  std::string spec;
+  for (const auto& m : arg.mounts)
+    spec += (boost::format("m%1%=%2%:%3%\n") % m.mountpoint % m.realdir %
+             m.writable)
+                .str();
+  for (const auto& d : arg.devices)
+    spec += (boost::format("d%1%=%2%\n") % d.filename % d.source).str();
+
+  if (mkdir_p(template_dir.c_str()) == -1) return "";
+  std::string realdir;
+  close(open_in_basedir(template_dir, realdir));
+  if (chmod(realdir.c_str(), 0700) == -1) return "";
+  const auto dir = catpath(realdir, sha256_hex(spec));
+  const auto tag = std::string("tmpfs ") + template_source;
+  // 同時に作らないようにロックする
+  const int lock = open((dir + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                        0600);
+  if (lock == -1) return "";
+  if (flock(lock, LOCK_EX) == -1) return close(lock), "";
+  const auto build = [&]() {
+    if (mount_source_at(dir) == tag) return true;
+    if (mkdir_p(dir.c_str()) == -1) return false;
+    if (mount(template_source, dir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV,
+              "mode=0755") == -1)
+      return false;
+    // 失敗したら中途半端なテンプレートが残らないように外す
+    const auto fail = [&]() {
+      umount2(dir.c_str(), MNT_DETACH);
+      return false;
+    };
+    for (const auto& m : arg.mounts) {
+      const auto e = catpath(dir, m.mountpoint);
+      if (mkdir_p(e.c_str()) == -1) return fail();
+      if (!is_template_mount(m)) continue;
+      if (mount(m.realdir.c_str(), e.c_str(), "none", MS_BIND, nullptr) ==
+              -1 ||
+          mount(nullptr, e.c_str(), nullptr,
+                MS_REMOUNT | MS_RDONLY | MS_BIND | MS_NOSUID, nullptr) == -1)
+        return fail();
+    }
+    for (const auto& d : arg.devices) {
+      const auto f = catpath(dir, d.filename);
+      std::vector<char> x(f.begin(), f.end());
+      if (mkdir_p(dirname(&x[0])) == -1) return fail();
+      const int fd =
+          open(f.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (fd == -1) return fail();
+      close(fd);
+      if (mount(d.source.c_str(), f.c_str(), "none", MS_BIND, nullptr) ==
+              -1 ||
+          mount(nullptr, f.c_str(), nullptr,
+                MS_REMOUNT | MS_RDONLY | MS_BIND | MS_NOSUID | MS_NOEXEC,
+                nullptr) == -1)
+        return fail();
+    }
+    if (mkdir_p(catpath(dir, "proc").c_str()) == -1) return fail();
+    if (mount(nullptr, dir.c_str(), nullptr,
+              MS_REMOUNT | MS_RDONLY | MS_BIND | MS_NOSUID | MS_NODEV,
+              nullptr) == -1)
+      return fail();
+    return true;
+  };
+  const bool ok = build();
+  close(lock);
+  return ok ? dir : "";
+}
+// template_dir にある、prepare_root_template で作ったテンプレートを全部外して消す。
+// 複製してマウントした後のサンドボックスには影響しない
+int umount_root_templates(const std::string& template_dir) {
+  std::string realdir;
+  close(open_in_basedir(template_dir, realdir));
+  const auto tag = std::string("tmpfs ") + template_source;
+  std::vector<std::string> dirs;
+  for (const auto& m : read_mountinfo()) {
+    if (m.second != tag ||
+        m.first.compare(0, realdir.size() + 1, realdir + "/") != 0 ||
+        m.first.find('/', realdir.size() + 1) != std::string::npos ||
+        std::find(dirs.begin(), dirs.end(), m.first) != dirs.end())
+      continue;
+    dirs.push_back(m.first);
+  }
+  for (const auto& dir : dirs) {
+    // 作っている途中のテンプレートを外さないようにロックする
+    const int lock = open((dir + ".lock").c_str(), O_RDWR | O_CLOEXEC);
+    if (lock != -1) flock(lock, LOCK_EX);
+    while (mount_source_at(dir) == tag)
+      if (umount2(dir.c_str(), MNT_DETACH | UMOUNT_NOFOLLOW) == -1)
+        exit_error(("umount " + dir).c_str());
+    rmdir(dir.c_str());
+    if (lock != -1) close(lock);
+  }
+  return 0;
+}
+// テンプレートを複製して rootdir にマウントする
+int attach_root_template(const std::string& tmpl, const std::string& rootdir) {
+#if defined(SYS_open_tree) && defined(SYS_move_mount)
+  const int fd = syscall(SYS_open_tree, AT_FDCWD, tmpl.c_str(),
+                         OPEN_TREE_CLONE | AT_RECURSIVE | O_CLOEXEC);
+  if (fd == -1) return -1;
+  const int r = syscall(SYS_move_mount, fd, "", AT_FDCWD, rootdir.c_str(),
+                        MOVE_MOUNT_F_EMPTY_PATH);
+  close(fd);
+  return r == -1 ? -1 : 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+// cattleshed の作業ディレクトリに、大きさを制限した tmpfs をマウントする。
+// ジョブの書き込みはこの tmpfs に収まるので、ディスクには書かれないし、大きさの制限はカーネルが行う。
+// 呼び出したユーザの物になっている、まだ何もマウントされていない作業ディレクトリにしかマウントしない。
+int mount_workdir_tmpfs(const std::string& dir, unsigned long size_mb,
+                        unsigned long nr_inodes) {
+  std::string realdir;
+  const int fd = open_workdir(dir, realdir);
+  if (!mount_source_at(realdir).empty())
+    exit_fail((dir + " is already mounted").c_str());
+  std::string opts = "mode=0711,size=" + std::to_string(size_mb) + "m" +
+                     ",uid=" + std::to_string(getuid()) +
+                     ",gid=" + std::to_string(getgid());
+  if (nr_inodes != 0) opts += ",nr_inodes=" + std::to_string(nr_inodes);
+  const auto target = "/proc/self/fd/" + std::to_string(fd);
+  if (mount(workdir_tmpfs_source, target.c_str(), "tmpfs",
+            MS_NOSUID | MS_NODEV, opts.c_str()) == -1)
+    exit_error(("mount -t tmpfs " + dir).c_str());
+  close(fd);
+  return 0;
+}
+// mount_workdir_tmpfs でマウントした tmpfs を外す。
+// 他の tmpfs を外せないように、ソースの名前で cattlegrid がマウントしたものか確かめる
+int umount_workdir_tmpfs(const std::string& dir) {
+  std::string realdir;
+  const int fd = open_workdir(dir, realdir);
+  if (mount_source_at(realdir) !=
+      std::string("tmpfs ") + workdir_tmpfs_source)
+    exit_fail((dir + " is not a workdir tmpfs").c_str());
+  const auto target = "/proc/self/fd/" + std::to_string(fd);
+  if (umount2(target.c_str(), MNT_DETACH | UMOUNT_NOFOLLOW) == -1)
+    exit_error(("umount " + dir).c_str());
+  close(fd);
+  return 0;
+}
+// テンプレートを使う場合に、ルートディレクトリの中の書き込めるディレクトリ（/tmp=./jail/tmp など）に
+// ジョブ用の tmpfs をマウントする。ホストのメモリを使い切れないように、作業ディレクトリの tmpfs と同じ制限をかける
+void mount_job_tmpfs(const proc_arg_t& arg, const std::string& dir) {
+  std::string opts = "mode=0755";
+  if (arg.tmpfs_size != 0)
+    opts += ",size=" + std::to_string(arg.tmpfs_size) + "m";
+  if (arg.tmpfs_inodes != 0)
+    opts += ",nr_inodes=" + std::to_string(arg.tmpfs_inodes);
+  if (mount("none", dir.c_str(), "tmpfs", MS_NOSUID, opts.c_str()) == -1)
+    exit_error(("mount -t tmpfs " + dir).c_str());
+}
+// --zygote と --attach
+//
+// cattlegrid --zygote は常駐して、ジョブによらない準備（namespace の作成、lo の有効化、
+// テンプレートの複製、/proc のマウント）を済ませたサンドボックスを何個か待たせておく。
+// cattlegrid --attach は zygote に接続して、作業ディレクトリ、標準入出力、cgroup、
+// 環境変数、rlimit、nice 値を渡すと、待っていたサンドボックスがそれを使ってプログラムを実行する。
+// 終了ステータスは --attach の方に返ってくるので、cattleshed からは今までの cattlegrid と同じに見える。
+//
+// zygote とのやりとりは全部 SOCK_SEQPACKET で、１回の sendmsg が１つのメッセージになる。
+struct zygote_request {
+  std::vector<std::string> argv;
+  std::vector<std::string> envp;
+  std::vector<std::pair<int, rlimit> > limits;
+  int nice;
+  // --session が指定されていた
+  bool session;
+  // --timing-fd が指定されていた
+  bool timing;
+  // 作業ディレクトリ、標準入力、標準出力、標準エラー出力、（timing なら）--timing-fd、
+  // （あれば）cgroup のディレクトリ
+  std::vector<int> fds;
+};
+// 作業ディレクトリの中のディレクトリのマウントも fd で渡すので、少し多めにしておく
+static const std::size_t zygote_max_fds = 16;
+static const std::size_t zygote_max_message = 1024 * 1024;
+int send_message(int sock, const std::string& data,
+                 const std::vector<int>& fds) {
+  iovec iov = {const_cast<char*>(data.data()), data.size()};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+// 受け取った fd は全部 O_CLOEXEC になる。
+// 相手が閉じていれば 0、失敗したら -1 を返す
+ssize_t recv_message(int sock, std::string& data, std::vector<int>& fds) {
+  std::vector<char> buf(zygote_max_message);
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * zygote_max_fds));
+  iovec iov = {buf.data(), buf.size()};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+    ;
+  if (n <= 0) return n;
+  for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    const std::size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const std::size_t first = fds.size();
+    fds.resize(first + count);
+    memcpy(&fds[first], CMSG_DATA(c), sizeof(int) * count);
+  }
+  // 途中で切れたメッセージは受け付けない
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  data.assign(buf.data(), n);
+  return n;
+}
+void put_u32(std::string& r, uint32_t v) {
+  r.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+void put_strings(std::string& r, const std::vector<std::string>& v) {
+  put_u32(r, v.size());
+  for (const auto& s : v) {
+    put_u32(r, s.size());
+    r += s;
+  }
+}
+// data の pos から読む。足りなければ false を返す
+bool get_bytes(const std::string& data, std::size_t& pos, void* p,
+               std::size_t n) {
+  if (data.size() - pos < n) return false;
+  memcpy(p, data.data() + pos, n);
+  pos += n;
+  return true;
+}
+bool get_u32(const std::string& data, std::size_t& pos, uint32_t& v) {
+  return get_bytes(data, pos, &v, sizeof(v));
+}
+bool get_strings(const std::string& data, std::size_t& pos,
+                 std::vector<std::string>& v) {
+  uint32_t count;
+  if (!get_u32(data, pos, count)) return false;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t len;
+    if (!get_u32(data, pos, len) || data.size() - pos < len) return false;
+    v.emplace_back(data, pos, len);
+    pos += len;
+  }
+  return true;
+}
+// --session のフェーズのコマンド
+bool decode_strings(const std::string& data, std::vector<std::string>& v) {
+  std::size_t pos = 0;
+  return get_strings(data, pos, v) && pos == data.size();
+}
+std::string encode_request(const zygote_request& req) {
+  std::string r;
+  const auto put = [&r](uint32_t v) { put_u32(r, v); };
+  put_strings(r, req.argv);
+  put_strings(r, req.envp);
+  put(req.limits.size());
+  for (const auto& l : req.limits) {
+    put(l.first);
+    r.append(reinterpret_cast<const char*>(&l.second), sizeof(l.second));
+  }
+  put(req.nice);
+  put(req.session);
+  put(req.timing);
+  return r;
+}
+bool decode_request(const std::string& data, zygote_request& req) {
+  std::size_t pos = 0;
+  const auto get = [&](uint32_t& v) { return get_u32(data, pos, v); };
+  uint32_t count;
+  if (!get_strings(data, pos, req.argv) ||
+      !get_strings(data, pos, req.envp) || !get(count))
+    return false;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t resource;
+    rlimit l;
+    if (!get(resource) || !get_bytes(data, pos, &l, sizeof(l))) return false;
+    req.limits.emplace_back(resource, l);
+  }
+  uint32_t nice, session, timing;
+  if (!get(nice) || !get(session) || !get(timing)) return false;
+  req.nice = (int)nice;
+  req.session = session != 0;
+  req.timing = timing != 0;
+  return pos == data.size();
+}
+// 作業ディレクトリの中のディレクトリのマウント
+//
+// 作業ディレクトリはホストの mount namespace にあるので、ジョブより先に mount namespace を
+// 分けているサンドボックスからはバインドマウントできない（別の namespace のマウントは複製できない）。
+// そこで、サンドボックスからは必要なディレクトリを --attach に頼んで、--attach がホスト側で
+// 切り離したマウントを作って fd で送り返し、サンドボックスはそれを自分の中に付ける。
+//
+// 頼む方は newuid、ディレクトリ、書き込めるかどうかを送る。
+// idmapped mount を使う場合は、そのための user namespace の fd も送る。
+// 送り返す方は "m" というメッセージに、頼まれた順番でマウントの fd を付けて送る。
+std::vector<int> request_workdir_mounts(
+    int conn, unsigned newuid, int userns_fd,
+    const std::vector<const mount_target*>& mounts) {
+  if (mounts.size() > zygote_max_fds)
+    exit_fail("cattlegrid: too many mounts in the workdir");
+  std::string r;
+  std::vector<std::string> dirs;
+  for (const auto* m : mounts) dirs.push_back(m->realdir);
+  put_u32(r, newuid);
+  put_strings(r, dirs);
+  for (const auto* m : mounts) put_u32(r, m->writable);
+  std::vector<int> fds;
+  if (userns_fd != -1) fds.push_back(userns_fd);
+  if (send_message(conn, r, fds) == -1) exit_error("send mount request");
+  std::string data;
+  std::vector<int> mount_fds;
+  if (recv_message(conn, data, mount_fds) <= 0 || data != "m" ||
+      mount_fds.size() != mounts.size())
+    exit_fail("cattlegrid: invalid mounts from --attach");
+  return mount_fds;
+}
+// request_workdir_mounts で頼まれたマウントを作って送り返す。
+// 作業ディレクトリの外のディレクトリは複製しない
+void send_workdir_mounts(int conn) {
+  std::string data;
+  std::vector<int> fds;
+  if (recv_message(conn, data, fds) <= 0)
+    exit_fail("cattlegrid: sandbox has gone");
+  std::size_t pos = 0;
+  uint32_t newuid;
+  std::vector<std::string> dirs;
+  bool ok = fds.size() <= 1 && get_u32(data, pos, newuid) &&
+            get_strings(data, pos, dirs);
+  std::vector<uint32_t> writable(dirs.size());
+  for (auto& w : writable) ok = ok && get_u32(data, pos, w);
+  if (!ok || pos != data.size())
+    exit_fail("cattlegrid: invalid mount request");
+  const int userns_fd = fds.empty() ? -1 : fds[0];
+  std::vector<int> mounts;
+  for (std::size_t i = 0; i < dirs.size(); ++i) {
+    const auto& d = dirs[i];
+    if (d.empty() || d.front() == '/')
+      exit_fail(("cattlegrid: " + d + " is not in the workdir").c_str());
+    int fd = userns_fd == -1 ? -1
+                             : open_detached_bind(d, writable[i], userns_fd);
+    if (fd == -1) {
+      // このファイルシステムでは idmapped mount が使えなかったので、所有者を書き換えて普通に複製する
+      if (userns_fd != -1 && chown_r(d.c_str(), newuid, newuid) == -1)
+        exit_error(("chown -r " + d).c_str());
+      fd = open_detached_bind(d, writable[i], -1);
+      if (fd == -1) exit_error(("open_tree " + d).c_str());
+    }
+    mounts.push_back(fd);
+  }
+  if (send_message(conn, "m", mounts) == -1) exit_error("send mounts");
+  for (const int fd : mounts) close(fd);
+  if (userns_fd != -1) close(userns_fd);
+}
+// 自分が所属している cgroup v2 のディレクトリを開く。無ければ -1
+int open_own_cgroup() {
+  FILE* f = fopen("/proc/self/cgroup", "re");
+  if (!f) return -1;
+  int fd = -1;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+    std::string path(line + 3);
+    if (!path.empty() && path.back() == '\n') path.pop_back();
+    fd = open(("/sys/fs/cgroup" + path).c_str(),
+              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    break;
+  }
+  fclose(f);
+  return fd;
+}
+// wait_and_forward_signals の signalfd 版。
+// sfd は SIGCHLD を含む signalfd で、SIGCHLD 以外のシグナルは primary_child_pid に転送する。
+// conn が有効なら、cattlegrid --attach からソケットで送られてくるシグナルも転送する。
+// conn が閉じられた（cattlegrid --attach が殺された）場合は、サンドボックスの中を全部殺して
+// detached を true にする。
+int wait_and_forward_fd(int primary_child_pid, int sfd, int conn,
+                        bool wait_grandchilds, rusage* usage, bool& detached) {
+  int ret = 0;
+  bool waited = false;
+  while (true) {
+    int st;
+    rusage ru;
+    const int r = wait4(-1, &st, WNOHANG | __WALL, &ru);
+    // 子も孫もいなくなった
+    if (r == -1) break;
+    if (r > 0) {
+      if (r == primary_child_pid && (WIFEXITED(st) || WIFSIGNALED(st))) {
+        ret = st;
+        waited = true;
+        if (usage) *usage = ru;
+        if (!wait_grandchilds) break;
+      }
+      continue;
+    }
+    const bool use_conn = conn != -1 && !detached;
+    pollfd fds[] = {{sfd, POLLIN, 0}, {conn, POLLIN, 0}};
+    if (poll(fds, use_conn ? 2 : 1, -1) == -1) {
+      if (errno == EINTR) continue;
+      exit_error("poll");
+    }
+    signalfd_siginfo si;
+    while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+      if (si.ssi_signo != SIGCHLD && !waited)
+        kill(primary_child_pid, si.ssi_signo);
+    }
+    if (use_conn && fds[1].revents) {
+      int sig;
+      const ssize_t n = recv(conn, &sig, sizeof(sig), 0);
+      if (n == sizeof(sig)) {
+        if (!waited) kill(primary_child_pid, sig);
+      } else if (n == 0 || (n == -1 && errno != EINTR)) {
+        kill(-1, SIGKILL);
+        detached = true;
+      }
+    }
+  }
+  return ret;
+}
+// all_signals なら全てのシグナルを、そうでなければ SIGCHLD だけを受け取る signalfd。
+// read で止まらないように O_NONBLOCK にする
+int signalfd_for(bool all_signals) {
+  sigset_t mask;
+  if (all_signals) {
+    sigfillset(&mask);
+  } else {
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+  }
+  const int sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (sfd == -1) exit_error("signalfd");
+  return sfd;
+}
+// サンドボックスの中でプログラムを exec する直前に、権限を全部捨てる
+void drop_privileges() {
+  prctl(PR_SET_SECUREBITS, SECBIT_KEEP_CAPS | SECBIT_KEEP_CAPS_LOCKED |
+                               SECBIT_NO_SETUID_FIXUP |
+                               SECBIT_NO_SETUID_FIXUP_LOCKED | SECBIT_NOROOT |
+                               SECBIT_NOROOT_LOCKED);
+  clear_all_caps();
+  {
+    sigset_t sigs;
+    sigfillset(&sigs);
+    sigprocmask(SIG_UNBLOCK, &sigs, nullptr);
+  }
+  setsid();
+}
+// --session: コンパイルと実行を同じサンドボックスの中で順番に行う。
+// ctl は cattleshed との SOCK_SEQPACKET のソケットで、フェーズごとにコマンドと
+// 標準入出力の fd が送られてくる（形式は cattleshed の posixapi.hpp の send_session_phase を参照）。
+// 実行が終わったら、次のフェーズに影響しないようにサンドボックスの中のプロセスを全部殺してから、
+// 終了ステータスとリソース使用量を返す。cattleshed がソケットを閉じたら終了する。
+// 返す session_phase_result は cattleshed と共通の session_phase.h にある。
+// 呼び出す時は全てのシグナルをブロックしておくこと。
+void run_session(int ctl, int conn, bool wait_grandchilds,
+                 const std::function<void()>& setup_child, char** envp) {
+  // zygote 経由ならシグナルは conn から来る
+  const int sfd = signalfd_for(conn == -1);
+  bool detached = false;
+  while (!detached) {
+    std::string data;
+    std::vector<int> fds;
+    if (recv_message(ctl, data, fds) <= 0) break;
+    std::vector<std::string> args;
+    session_phase_result r = {};
+    if (fds.size() != 3 || !decode_strings(data, args) || args.empty()) {
+      for (const int fd : fds) close(fd);
+      r.status = 127 << 8;
+      if (send(ctl, &r, sizeof(r), MSG_NOSIGNAL) == -1) break;
+      continue;
+    }
+    // 前のフェーズの間に届いたシグナルは捨てる
+    signalfd_siginfo si;
+    while (read(sfd, &si, sizeof(si)) == sizeof(si))
+      ;
+    const int pid = fork();
+    if (pid == -1) exit_error("fork");
+    if (pid == 0) {
+      for (int i = 0; i < 3; ++i)
+        if (dup2(fds[i], i) == -1) exit_error("dup2");
+      setup_child();
+      std::vector<char*> argv;
+      for (auto& s : args) argv.push_back(&s[0]);
+      argv.push_back(nullptr);
+      execve(argv[0], argv.data(), envp);
+      exit_error("execve");
+    }
+    for (const int fd : fds) close(fd);
+    r.status = wait_and_forward_fd(pid, sfd, conn, wait_grandchilds, &r.usage,
+                                   detached);
+    kill(-1, SIGKILL);
+    while (waitpid(-1, nullptr, __WALL) > 0)
+      ;
+    if (send(ctl, &r, sizeof(r), MSG_NOSIGNAL) == -1) break;
+  }
+  close(sfd);
+}
+void activate_loopback() {
+  ifreq ifr;
+  strncpy(ifr.ifr_name, "lo", IFNAMSIZ);
+  const int fd = socket(PF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) exit_error("socket(PF_INET, SOCK_DGRAM, 0)");
+  if (ioctl(fd, SIOCGIFFLAGS, &ifr)) close(fd), exit_error("SIOCGIFFLAGS");
+  ifr.ifr_flags |= IFF_UP;
+  if (ioctl(fd, SIOCSIFFLAGS, &ifr)) close(fd), exit_error("SIOCSIFFLAGS");
+  close(fd);
+}
 int proc(void* arg_) {
   if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1) exit_error("prctl SET_PDEATHSIG");
   const auto& arg = *static_cast<proc_arg_t*>(arg_);
   close(arg.pipefd[0]);
   const auto& argv = arg.argv;
   const auto olduid = getuid();
+  auto timer = arg.timer;
+  timer.mark("clone");
 
-  // activate loopback interface
-  {
-    ifreq ifr;
-    strncpy(ifr.ifr_name, "lo", IFNAMSIZ);
-    const int fd = socket(PF_INET, SOCK_DGRAM, 0);
-    if (fd == -1) exit_error("socket(PF_INET, SOCK_DGRAM, 0)");
-    if (ioctl(fd, SIOCGIFFLAGS, &ifr)) close(fd), exit_error("SIOCGIFFLAGS");
-    ifr.ifr_flags |= IFF_UP;
-    if (ioctl(fd, SIOCSIFFLAGS, &ifr)) close(fd), exit_error("SIOCSIFFLAGS");
-  }
+  activate_loopback();
+  timer.mark("loopback");
 
   // adjust uid/gid
-  if (chown(".", arg.newuid, arg.newuid) == -1) exit_error("chown .");
+  // idmapped mount を使う場合、作業ディレクトリはサーバのユーザの物のままにしておく。
+  // サーバが後で削除できるようにするためで、辿れるようにするのはサーバ側でやっておく。
+  const bool use_idmap = arg.idmap_userns_fd != -1;
+  if (!use_idmap && chown(".", arg.newuid, arg.newuid) == -1)
+    exit_error("chown .");
   if (setuid(arg.newuid) == -1 || setgid(arg.newuid) == -1)
     exit_error("setuid");
   setgroups(0, &olduid);
-  if (chmod(".", 0755) == -1) exit_error("chmod .");
-  if (chown_r(".", arg.newuid, arg.newuid) == -1) exit_error("chown -r .");
+  if (!use_idmap && chmod(".", 0755) == -1) exit_error("chmod .");
+  // idmapped mount が使えるなら、作業ディレクトリの中身は所有者を書き換えなくても
+  // newuid の物に見えるので、ファイル数に比例する chown_r をしなくて済む
+  if (!use_idmap && chown_r(".", arg.newuid, arg.newuid) == -1)
+    exit_error("chown -r .");
+  timer.mark("chown");
 
   // prepare root directory
   const auto& rootdir = arg.rootdir;
   if (mount("/", "/", "none", MS_PRIVATE | MS_REC, nullptr) == -1)
     exit_error("mount --make-rprivate /");
   mkdir_p(rootdir.c_str());
-  if (mount("none", rootdir.c_str(), "tmpfs", 0, "") == -1)
+  // テンプレートがあれば、読み込み専用のマウントとデバイスファイルはそこに全部入っている
+  const bool use_template =
+      !arg.root_template.empty() &&
+      attach_root_template(arg.root_template, rootdir) == 0;
+  if (!use_template &&
+      mount("none", rootdir.c_str(), "tmpfs", 0, "") == -1)
     exit_error(("mount -t tmpfs " + rootdir).c_str());
+  timer.mark(use_template ? "template" : "tmpfs");
 
   // mount binds
-  for (const auto& m : arg.mounts) {
+  const auto bind = [&](const mount_target& m) {
     const auto& d = m.realdir;
     const auto e = catpath(rootdir, m.mountpoint);
-    mkdir_p(e.c_str());
+    if (!use_template) mkdir_p(e.c_str());
+    // ルートディレクトリの中のディレクトリ（/tmp=./jail/tmp など）は、
+    // 元々このジョブの tmpfs の中にある newuid のディレクトリなので idmapped mount は使わない。
+    // テンプレートは全ジョブで共有しているので、代わりにこのジョブ用の tmpfs をマウントする。
+    const bool inside_root =
+        d.compare(0, rootdir.size() + 1, rootdir + "/") == 0;
+    if (inside_root && use_template) {
+      mount_job_tmpfs(arg, e);
+      return;
+    }
+    // 作業ディレクトリの中のディレクトリは idmapped mount でマウントする
+    if (arg.idmap_userns_fd != -1 && !inside_root && !d.empty() &&
+        d.front() != '/') {
+      if (idmapped_bind(d, e, m.writable, arg.idmap_userns_fd) == 0) return;
+      // このファイルシステムでは使えなかったので、所有者を書き換えて普通にマウントする
+      if (chown_r(d.c_str(), arg.newuid, arg.newuid) == -1)
+        exit_error(("chown -r " + d).c_str());
+    }
     if (mount(d.c_str(), e.c_str(), "none", MS_BIND, nullptr) == -1)
       exit_error(("mount --bind " + d + " " + e).c_str());
     if (mount(nullptr, e.c_str(), nullptr,
               MS_REMOUNT | (m.writable ? 0 : MS_RDONLY) | MS_BIND | MS_NOSUID,
               nullptr) == -1)
       exit_error(("mount -o remount,bind,nosuid " + e).c_str());
+  };
+  for (const auto& m : arg.mounts) {
+    if (use_template && is_template_mount(m)) continue;
+    bind(m);
+    timer.mark("mount:" + m.mountpoint);
   }
 
   // create device files
-  for (const auto& d : arg.devices) {
-    const auto& f = catpath(rootdir, d.filename);
-    std::vector<char> x(f.begin(), f.end());
-    mkdir_p(dirname(&x[0]));
-    if (mknod(f.c_str(), d.mode, d.dev) == -1)
-      exit_error(("mknod " + f).c_str());
+  if (!use_template) {
+    for (const auto& d : arg.devices) {
+      const auto& f = catpath(rootdir, d.filename);
+      std::vector<char> x(f.begin(), f.end());
+      mkdir_p(dirname(&x[0]));
+      if (mknod(f.c_str(), d.mode, d.dev) == -1)
+        exit_error(("mknod " + f).c_str());
+    }
   }
+  timer.mark("devices");
 
   // mount /proc
-  mkdir_p(catpath(rootdir, "proc").c_str());
+  if (!use_template) mkdir_p(catpath(rootdir, "proc").c_str());
   if (mount("proc", catpath(rootdir, "proc").c_str(), "proc",
             MS_RDONLY | MS_NOSUID | MS_NOEXEC | MS_NODEV, nullptr) == -1)
     exit_error("mount -o ro,nosuid,noexec,nodev /proc");
+  timer.mark("proc");
 
   // finish
-  if (mount(nullptr, rootdir.c_str(), nullptr,
+  // テンプレートは最初から読み込み専用になっている
+  if (!use_template &&
+      mount(nullptr, rootdir.c_str(), nullptr,
             MS_REMOUNT | MS_RDONLY | MS_BIND | MS_NOSUID, nullptr) == -1)
     exit_error("mount -o remount,ro,bind,nosuid /");
   if (chroot(rootdir.c_str()) == -1) exit_error(("chroot " + rootdir).c_str());
   if (chdir(arg.startdir.c_str()) == -1)
     exit_error(("chdir " + arg.startdir).c_str());
+  timer.mark("chroot");
   {
     sigset_t sigs;
     sigfillset(&sigs);
     sigprocmask(SIG_BLOCK, &sigs, nullptr);
   }
+  if (arg.session) {
+    if (setresuid(olduid, -1, -1) == -1) exit_error("setresuid");
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+      exit_error("prctl SET_PDEATHSIG");
+    timer.mark("session");
+    timer.print(arg.started);
+    timer.emit(true);
+    timer.close_fd();
+    run_session(0, -1, !arg.kill_grandchilds, drop_privileges, environ);
+    return 0;
+  }
   if (const int pid = fork()) {
     if (pid == -1) exit_error("fork");
     if (setresuid(olduid, -1, -1) == -1) exit_error("setresuid");
     if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
       exit_error("prctl SET_PDEATHSIG");
+    timer.close_fd();
     const int fd = arg.pipefd[1];
     if (write(fd, &fd, sizeof(fd)) == -1) exit_error("parent process has gone");
     const int st = wait_and_forward_signals(pid, !arg.kill_grandchilds);
     if (write(fd, &st, sizeof(st)) == -1) exit_error("write");
     close(fd);
   } else {
-    prctl(PR_SET_SECUREBITS, SECBIT_KEEP_CAPS | SECBIT_KEEP_CAPS_LOCKED |
-                                 SECBIT_NO_SETUID_FIXUP |
-                                 SECBIT_NO_SETUID_FIXUP_LOCKED | SECBIT_NOROOT |
-                                 SECBIT_NOROOT_LOCKED);
-    clear_all_caps();
-    {
-      sigset_t sigs;
-      sigfillset(&sigs);
-      sigprocmask(SIG_UNBLOCK, &sigs, nullptr);
-    }
-    setsid();
+    drop_privileges();
+    timer.mark("exec");
+    timer.print(arg.started);
+    timer.emit(true);
+    timer.close_fd();
     if (argv[0])
       execv(argv[0], argv);
     else
@@ -264,6 +1149,472 @@ int proc(void* arg_) {
   }
   return 0;
 }
+// zygote が待たせておくサンドボックス。
+// arg.pipefd[1] は zygote とのソケットで、ジョブが来るとここに cattlegrid --attach との接続が送られてくる。
+int zygote_proc(void* arg_) {
+  if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1) exit_error("prctl SET_PDEATHSIG");
+  const auto& arg = *static_cast<proc_arg_t*>(arg_);
+  close(arg.pipefd[0]);
+  const auto olduid = getuid();
+  // ジョブの作業ディレクトリはまだ分からないので、テンプレートの複製はテンプレート自身の上に重ねる。
+  // mount namespace を分けているので、ホストや他のサンドボックスからは見えない。
+  const auto& rootdir = arg.root_template;
+
+  // プールの network namespace は loopback を有効にしてあるので、入るだけで良い
+  if (arg.netns_fd != -1) {
+    if (setns(arg.netns_fd, CLONE_NEWNET) == -1) exit_error("setns net");
+    close(arg.netns_fd);
+  } else {
+    activate_loopback();
+  }
+  if (mount("/", "/", "none", MS_PRIVATE | MS_REC, nullptr) == -1)
+    exit_error("mount --make-rprivate /");
+  if (attach_root_template(rootdir, rootdir) == -1)
+    exit_error(("attach template " + rootdir).c_str());
+  for (const auto& m : arg.mounts) {
+    if (m.realdir.compare(0, arg.rootdir.size() + 1, arg.rootdir + "/") != 0)
+      continue;
+    mount_job_tmpfs(arg, catpath(rootdir, m.mountpoint));
+  }
+  if (mount("proc", catpath(rootdir, "proc").c_str(), "proc",
+            MS_RDONLY | MS_NOSUID | MS_NOEXEC | MS_NODEV, nullptr) == -1)
+    exit_error("mount -o ro,nosuid,noexec,nodev /proc");
+
+  // ここからはジョブごとの処理
+  std::string data;
+  std::vector<int> fds;
+  // zygote が終了した
+  if (recv_message(arg.pipefd[1], data, fds) <= 0 || fds.size() != 1) _exit(0);
+  close(arg.pipefd[1]);
+  const int conn = fds[0];
+  zygote_request req;
+  if (recv_message(conn, data, req.fds) <= 0 || !decode_request(data, req) ||
+      req.fds.size() < (req.timing ? 5u : 4u))
+    exit_fail("cattlegrid: invalid zygote request");
+  phase_timer timer;
+  if (req.timing) {
+    timer.fd = req.fds[4];
+    req.fds.erase(req.fds.begin() + 4);
+  }
+  timer.mark("recv");
+  if (fchdir(req.fds[0]) == -1) exit_error("fchdir");
+  for (int i = 0; i < 3; ++i)
+    if (dup2(req.fds[i + 1], i) == -1) exit_error("dup2");
+  // ジョブの cgroup に入れなければ、メモリなどの制限も kill もジョブに効かないので失敗にする
+  if (req.fds.size() > 4) {
+    const int fd = openat(req.fds[4], "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) exit_error("open cgroup.procs");
+    if (write(fd, "0", 1) == -1) exit_error("write cgroup.procs");
+    close(fd);
+  }
+  for (const int fd : req.fds) close(fd);
+  timer.mark("cgroup");
+
+  const bool use_idmap = arg.idmap_userns_fd != -1;
+  if (!use_idmap && chown(".", arg.newuid, arg.newuid) == -1)
+    exit_error("chown .");
+  if (!use_idmap && chown_r(".", arg.newuid, arg.newuid) == -1)
+    exit_error("chown -r .");
+  timer.mark("chown");
+  // テンプレートに入っているものと、ルートディレクトリの中の tmpfs は準備済み
+  const auto prepared = [&arg](const mount_target& m) {
+    return is_template_mount(m) ||
+           m.realdir.compare(0, arg.rootdir.size() + 1, arg.rootdir + "/") == 0;
+  };
+  const auto in_workdir = [](const mount_target& m) {
+    return !m.realdir.empty() && m.realdir.front() != '/';
+  };
+  std::vector<const mount_target*> workdir_mounts;
+  for (const auto& m : arg.mounts)
+    if (!prepared(m) && in_workdir(m)) workdir_mounts.push_back(&m);
+  const auto mount_fds = request_workdir_mounts(
+      conn, arg.newuid, arg.idmap_userns_fd, workdir_mounts);
+  timer.mark("recv-mounts");
+  std::size_t next_mount = 0;
+  for (const auto& m : arg.mounts) {
+    const auto& d = m.realdir;
+    if (prepared(m)) continue;
+    const auto e = catpath(rootdir, m.mountpoint);
+    if (in_workdir(m)) {
+      if (attach_detached_mount(mount_fds[next_mount++], e) == -1)
+        exit_error(("move_mount " + d + " " + e).c_str());
+      timer.mark("mount:" + m.mountpoint);
+      continue;
+    }
+    if (mount(d.c_str(), e.c_str(), "none", MS_BIND, nullptr) == -1)
+      exit_error(("mount --bind " + d + " " + e).c_str());
+    if (mount(nullptr, e.c_str(), nullptr,
+              MS_REMOUNT | (m.writable ? 0 : MS_RDONLY) | MS_BIND | MS_NOSUID,
+              nullptr) == -1)
+      exit_error(("mount -o remount,bind,nosuid " + e).c_str());
+    timer.mark("mount:" + m.mountpoint);
+  }
+  if (chroot(rootdir.c_str()) == -1) exit_error(("chroot " + rootdir).c_str());
+  // テンプレートは zygote のユーザしか辿れないので、newuid になるのはマウントと chroot の後にする
+  if (setuid(arg.newuid) == -1 || setgid(arg.newuid) == -1)
+    exit_error("setuid");
+  setgroups(0, &olduid);
+  // カレントディレクトリはまだ作業ディレクトリなので、ここで辿れるようにする
+  if (!use_idmap && chmod(".", 0755) == -1) exit_error("chmod .");
+  if (chdir(arg.startdir.c_str()) == -1)
+    exit_error(("chdir " + arg.startdir).c_str());
+  timer.mark("chroot");
+  {
+    sigset_t sigs;
+    sigfillset(&sigs);
+    sigprocmask(SIG_BLOCK, &sigs, nullptr);
+  }
+  std::vector<char*> envp;
+  for (auto& s : req.envp) envp.push_back(&s[0]);
+  envp.push_back(nullptr);
+  const auto setup_child = [&req]() {
+    drop_privileges();
+    // zygote 自身の制限より緩くはできないので、それを上限にする
+    for (const auto& l : req.limits) {
+      rlimit cur;
+      if (getrlimit(l.first, &cur) == -1) continue;
+      rlimit x = l.second;
+      x.rlim_max = std::min(x.rlim_max, cur.rlim_max);
+      x.rlim_cur = std::min(x.rlim_cur, x.rlim_max);
+      if (setrlimit(l.first, &x) == -1) exit_error("setrlimit");
+    }
+    // nice 値を下げるのは権限が無いとできないので、失敗しても無視する
+    setpriority(PRIO_PROCESS, 0, req.nice);
+  };
+  if (req.session) {
+    if (setresuid(olduid, -1, -1) == -1) exit_error("setresuid");
+    timer.mark("session");
+    timer.emit(true);
+    timer.close_fd();
+    run_session(0, conn, !arg.kill_grandchilds, setup_child, envp.data());
+    const int st = 0;
+    send(conn, &st, sizeof(st), MSG_NOSIGNAL);
+    close(conn);
+    return 0;
+  }
+  if (const int pid = fork()) {
+    if (pid == -1) exit_error("fork");
+    if (setresuid(olduid, -1, -1) == -1) exit_error("setresuid");
+    timer.close_fd();
+    const int sfd = signalfd_for(false);
+    bool detached = false;
+    const int st = wait_and_forward_fd(pid, sfd, conn, !arg.kill_grandchilds,
+                                       nullptr, detached);
+    send(conn, &st, sizeof(st), MSG_NOSIGNAL);
+    close(conn);
+  } else {
+    setup_child();
+    timer.mark("exec");
+    timer.emit(true);
+    timer.close_fd();
+    std::vector<char*> argv;
+    for (auto& s : req.argv) argv.push_back(&s[0]);
+    argv.push_back(nullptr);
+    if (argv[0])
+      execve(argv[0], argv.data(), envp.data());
+    else
+      execle("/bin/sh", "/bin/sh", (void*)0, envp.data());
+    exit_error("execve");
+  }
+  return 0;
+}
+// loopback だけを有効にした network namespace を作って、その fd を返す。
+// 自分は orig_netns に戻る。失敗したら -1 を返す
+int create_netns(int orig_netns) {
+  if (unshare(CLONE_NEWNET) == -1) return perror("unshare(CLONE_NEWNET)"), -1;
+  activate_loopback();
+  const int fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) perror("open /proc/self/ns/net");
+  if (setns(orig_netns, CLONE_NEWNET) == -1) exit_error("setns net");
+  return fd;
+}
+// 待たせておくサンドボックスは、ジョブを待つ間も含めて少し多めにスタックを使う
+static const int zygote_stacksize = 65536;
+// netns_reuse: １つの network namespace を使い回すサンドボックスの数。0 なら使い回さない
+int zygote_main(const std::string& socket_path, int pool_size, int netns_reuse,
+                std::pair<unsigned, unsigned> uids, const proc_arg_t& args) {
+  if (args.root_template.empty()) exit_fail("--zygote requires --template");
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+    exit_fail("--zygote: socket path is too long");
+  strcpy(addr.sun_path, socket_path.c_str());
+  {
+    std::vector<char> x(socket_path.begin(), socket_path.end());
+    x.push_back('\0');
+    if (mkdir_p(dirname(&x[0])) == -1) exit_error("mkdir socket directory");
+  }
+  // 補充している間に来たジョブを先に受け付けられるように、待ち受けは O_NONBLOCK にする
+  const int lfd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (lfd == -1) exit_error("socket(AF_UNIX, SOCK_SEQPACKET, 0)");
+  unlink(socket_path.c_str());
+  // cattleshed と同じユーザからしか接続できないようにする
+  const mode_t mask = umask(0077);
+  if (bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+    exit_error(("bind " + socket_path).c_str());
+  umask(mask);
+  if (listen(lfd, 128) == -1) exit_error("listen");
+
+  static char stack[zygote_stacksize];
+  std::minstd_rand g((getpid() << 16) ^ std::time(nullptr));
+  // pid と、そのサンドボックスとのソケット
+  std::deque<std::pair<int, int> > idle;
+
+  // network namespace の作成と破棄はカーネルの中でロックを取るので、ジョブが多いと詰まる。
+  // サンドボックスが終わったら、その network namespace を次のサンドボックスで使い回す。
+  // PID namespace の init が終了した時点で中のプロセスは全て終了しているので、
+  // 前のジョブのプロセスが残っていることは無い。
+  // TIME_WAIT のソケットなどは残るので、netns_reuse 回使ったら閉じて捨てる。
+  // 破棄はカーネルが非同期に行うので、ジョブを待たせることは無い。
+  struct netns {
+    int fd;
+    int uses;
+  };
+  std::deque<netns> spare_netns;
+  // サンドボックスの pid と、そこで使っている network namespace
+  std::map<int, netns> used_netns;
+  const int orig_netns =
+      netns_reuse > 0 ? open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC) : -1;
+  if (netns_reuse > 0 && orig_netns == -1) perror("open /proc/self/ns/net");
+  const auto take_netns = [&]() -> netns {
+    if (orig_netns == -1) return {-1, 0};
+    if (!spare_netns.empty()) {
+      const auto n = spare_netns.front();
+      spare_netns.pop_front();
+      return n;
+    }
+    return {create_netns(orig_netns), 0};
+  };
+  const auto release_netns = [&](int pid) {
+    const auto it = used_netns.find(pid);
+    if (it == used_netns.end()) return;
+    if (it->second.uses < netns_reuse)
+      spare_netns.push_back(it->second);
+    else
+      close(it->second.fd);
+    used_netns.erase(it);
+  };
+
+  const auto spawn = [&]() {
+    proc_arg_t a = args;
+    a.newuid = std::uniform_int_distribution<unsigned>(uids.first,
+                                                       uids.second)(g);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, a.pipefd) == -1)
+      return perror("socketpair"), false;
+    a.idmap_userns_fd = make_idmap_userns(getuid(), getgid(), a.newuid);
+    auto n = take_netns();
+    a.netns_fd = n.fd;
+    const int pid = ::clone(&zygote_proc, stack + zygote_stacksize,
+                            SIGCHLD | CLONE_NEWIPC | CLONE_NEWNS |
+                                CLONE_NEWPID | CLONE_NEWUTS |
+                                (n.fd == -1 ? CLONE_NEWNET : 0),
+                            &a);
+    close(a.pipefd[1]);
+    if (a.idmap_userns_fd != -1) close(a.idmap_userns_fd);
+    if (pid == -1) {
+      perror("clone");
+      close(a.pipefd[0]);
+      if (n.fd != -1) spare_netns.push_front(n);
+      return false;
+    }
+    if (n.fd != -1) {
+      ++n.uses;
+      used_netns[pid] = n;
+    }
+    idle.emplace_back(pid, a.pipefd[0]);
+    return true;
+  };
+  // 終わったサンドボックスを回収する。待っていたものが死んでいたら取り除く
+  const auto reap = [&]() {
+    for (int pid; (pid = waitpid(-1, nullptr, WNOHANG)) > 0;) {
+      release_netns(pid);
+      for (auto it = idle.begin(); it != idle.end(); ++it) {
+        if (it->first != pid) continue;
+        close(it->second);
+        idle.erase(it);
+        break;
+      }
+    }
+  };
+  // 待っているサンドボックスにジョブを渡す。
+  // 全部使い切っている場合だけ、ここで作って渡す
+  const auto hand_off = [&](int conn) {
+    while (!idle.empty() || spawn()) {
+      const auto s = idle.front();
+      idle.pop_front();
+      const bool ok = send_message(s.second, "j", {conn}) == 0;
+      close(s.second);
+      if (ok) break;
+    }
+    close(conn);
+  };
+
+  // 回収は SIGCHLD で、補充はジョブを渡し終わってから１個ずつ行う。
+  // 補充の間に来たジョブは、補充より先に待っているサンドボックスに渡す
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigs, nullptr);
+  const int sfd = signalfd_for(false);
+  // 作れなかった時は、少し待ってからやり直す
+  bool spawn_failed = false;
+  while (true) {
+    reap();
+    const bool refill = (int)idle.size() < pool_size;
+    pollfd fds[] = {{lfd, POLLIN, 0}, {sfd, POLLIN, 0}};
+    if (poll(fds, 2, !refill ? -1 : spawn_failed ? 1000 : 0) == -1) {
+      if (errno == EINTR) continue;
+      exit_error("poll");
+    }
+    signalfd_siginfo si;
+    while (read(sfd, &si, sizeof(si)) == sizeof(si))
+      ;
+    if (fds[0].revents & POLLIN) {
+      for (int conn; (conn = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC)) !=
+                     -1;)
+        hand_off(conn);
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        exit_error("accept");
+      continue;
+    }
+    if (refill) spawn_failed = !spawn();
+  }
+}
+// 作業ディレクトリの中のディレクトリをマウントするので、権限は送るまで持っておく。
+// 失敗したら 1 を返す
+int attach_main(const std::string& socket_path, char** argv, bool session,
+                phase_timer& timer) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+    exit_fail("--attach: socket path is too long");
+  strcpy(addr.sun_path, socket_path.c_str());
+  const int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (conn == -1) exit_error("socket(AF_UNIX, SOCK_SEQPACKET, 0)");
+  // zygote の起動直後はまだ待ち受けていないことがあるので、少しだけ待つ
+  for (int retry = 0;
+       connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1;
+       ++retry) {
+    if ((errno != ENOENT && errno != ECONNREFUSED) || retry >= 100)
+      exit_error(("connect " + socket_path).c_str());
+    usleep(20000);
+  }
+  timer.mark("connect");
+
+  // env や nice や prlimit で設定したものは、このプロセスのものをそのまま渡す
+  zygote_request req;
+  for (char** p = argv; *p; ++p) req.argv.push_back(*p);
+  for (char** p = environ; *p; ++p) req.envp.push_back(*p);
+  for (int r = 0; r < RLIM_NLIMITS; ++r) {
+    rlimit l;
+    if (getrlimit(r, &l) == 0) req.limits.emplace_back(r, l);
+  }
+  req.nice = getpriority(PRIO_PROCESS, 0);
+  req.session = session;
+  const int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd == -1) exit_error("open .");
+  req.fds = {cwd, 0, 1, 2};
+  // ここまでの記録を書いておいて、続きはサンドボックスに書いてもらう
+  req.timing = timer.fd != -1;
+  if (req.timing) {
+    timer.emit(false);
+    req.fds.push_back(timer.fd);
+  }
+  const int cgroup = open_own_cgroup();
+  if (cgroup != -1) req.fds.push_back(cgroup);
+
+  // 届いたシグナルはサンドボックスに転送する
+  sigset_t sigs;
+  sigfillset(&sigs);
+  sigprocmask(SIG_BLOCK, &sigs, nullptr);
+  const int sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+  if (sfd == -1) exit_error("signalfd");
+  if (send_message(conn, encode_request(req), req.fds) == -1)
+    exit_error("send zygote request");
+  close(cwd);
+  if (cgroup != -1) close(cgroup);
+  timer.close_fd();
+  send_workdir_mounts(conn);
+  clear_all_caps();
+
+  int st;
+  while (true) {
+    pollfd fds[] = {{sfd, POLLIN, 0}, {conn, POLLIN, 0}};
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      exit_error("poll");
+    }
+    if (fds[0].revents & POLLIN) {
+      signalfd_siginfo si;
+      if (read(sfd, &si, sizeof(si)) == sizeof(si) && si.ssi_signo != SIGCHLD) {
+        const int sig = si.ssi_signo;
+        send(conn, &sig, sizeof(sig), MSG_NOSIGNAL);
+      }
+    }
+    if (fds[1].revents) {
+      const ssize_t n = recv(conn, &st, sizeof(st), 0);
+      if (n == sizeof(st)) break;
+      if (n == -1 && errno == EINTR) continue;
+      exit_fail("cattlegrid: sandbox has gone");
+    }
+  }
+  close(sfd);
+  close(conn);
+  sigprocmask(SIG_UNBLOCK, &sigs, nullptr);
+  if (WIFEXITED(st)) return WEXITSTATUS(st);
+  if (WIFSIGNALED(st)) raise(WTERMSIG(st));
+  return 1;
+}
+
+// 10 進数の文字列全体を整数にする。符号や余計な文字があれば false
+bool parse_ull(const char* str, unsigned long long& val) {
+  if (*str < '0' || '9' < *str) return false;
+  char* end;
+  errno = 0;
+  val = strtoull(str, &end, 10);
+  return errno == 0 && *end == '\0';
+}
+// --rlimit=name=value を設定する。名前は prlimit のオプションと同じ。
+// soft と hard の両方を value にする。value は数値か unlimited
+bool set_rlimit(const char* spec) {
+  static const struct {
+    const char* name;
+    int resource;
+  } table[] = {
+      {"core", RLIMIT_CORE},
+      {"data", RLIMIT_DATA},
+      {"nice", RLIMIT_NICE},
+      {"fsize", RLIMIT_FSIZE},
+      {"sigpending", RLIMIT_SIGPENDING},
+      {"memlock", RLIMIT_MEMLOCK},
+      {"rss", RLIMIT_RSS},
+      {"nofile", RLIMIT_NOFILE},
+      {"msgqueue", RLIMIT_MSGQUEUE},
+      {"stack", RLIMIT_STACK},
+      {"cpu", RLIMIT_CPU},
+      {"nproc", RLIMIT_NPROC},
+      {"as", RLIMIT_AS},
+      {"locks", RLIMIT_LOCKS},
+      {"rttime", RLIMIT_RTTIME},
+  };
+  const char* eq = strchr(spec, '=');
+  if (!eq) return false;
+  const std::string name(spec, eq - spec);
+  for (const auto& t : table) {
+    if (name != t.name) continue;
+    unsigned long long n = RLIM_INFINITY;
+    if (strcmp(eq + 1, "unlimited") != 0 &&
+        (!parse_ull(eq + 1, n) || n > RLIM_INFINITY)) {
+      errno = EINVAL;
+      return false;
+    }
+    const rlimit lim = {rlim_t(n), rlim_t(n)};
+    return setrlimit(t.resource, &lim) == 0;
+  }
+  errno = EINVAL;
+  return false;
+}
 void print_help() {}
 int exit_help(const char*) { return 1; }
 
@@ -273,14 +1624,44 @@ int main(int argc, char** argv) {
   if (kill(getppid(), 0) < 0) raise(SIGKILL);
 
   char stack[stacksize];
-  proc_arg_t args = {".", "/", {}, {}, false, {-1, -1}, getuid(), nullptr};
+  std::string template_dir;
+  std::string mount_tmpfs_dir;
+  std::string umount_tmpfs_dir;
+  bool umount_templates = false;
+  std::string zygote_socket;
+  std::string attach_socket;
+  int zygote_pool = 2;
+  int netns_reuse = 0;
+  std::pair<unsigned, unsigned> uids(getuid(), getuid());
+  proc_arg_t args = {
+      ".", "/", {}, {}, false, {-1, -1}, getuid(), -1, {}, {}, "", nullptr,
+      false, -1, 0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &args.started);
 
   {
     static const option opts[] = {
         {"mounts", 1, nullptr, 'm'},  {"rwmounts", 1, nullptr, 'w'},
+        // --mount-tmpfs と区別できるように、設定で使っている名前はそのまま登録する
+        {"mount", 1, nullptr, 'm'},   {"rwmount", 1, nullptr, 'w'},
         {"devices", 1, nullptr, 'd'}, {"rootdir", 1, nullptr, 'r'},
         {"chdir", 1, nullptr, 'c'},   {"kill", 0, nullptr, 'k'},
-        {"uids", 1, nullptr, 'u'},    {nullptr, 0, nullptr, 0},
+        {"uids", 1, nullptr, 'u'},    {"timing", 0, nullptr, 't'},
+        {"template", 1, nullptr, 'T'},
+        {"mount-tmpfs", 1, nullptr, 'M'},
+        {"umount-tmpfs", 1, nullptr, 'U'},
+        {"umount-templates", 0, nullptr, 'R'},
+        {"tmpfs-size", 1, nullptr, 'S'},
+        {"tmpfs-inodes", 1, nullptr, 'I'},
+        {"zygote", 1, nullptr, 'Z'},
+        {"zygote-pool", 1, nullptr, 'P'},
+        {"attach", 1, nullptr, 'A'},
+        {"session", 0, nullptr, 's'},
+        {"env", 1, nullptr, 'E'},
+        {"nice", 1, nullptr, 'N'},
+        {"rlimit", 1, nullptr, 'L'},
+        {"netns-reuse", 1, nullptr, 'n'},
+        {"timing-fd", 1, nullptr, 'D'},
+        {nullptr, 0, nullptr, 0},
     };
     for (int opt;
          (opt = getopt_long(argc, argv, "m:d:u:g:h:", opts, nullptr)) != -1;)
@@ -319,7 +1700,7 @@ int main(int argc, char** argv) {
             if (d.first.empty()) continue;
             device_file x = {
                 std::move(d.first), d.second ? (S_IFCHR | 0666) : 0u,
-                d.second ? makedev(d.second->first, d.second->second) : 0};
+                d.second ? makedev(d.second->first, d.second->second) : 0, ""};
             if (!d.second) {
               struct stat s;
               if (stat(x.filename.c_str(), &s) == -1)
@@ -329,6 +1710,11 @@ int main(int argc, char** argv) {
               x.mode = s.st_mode;
               x.dev = s.st_rdev;
             }
+            // 好きなデバイスを作れると、ジョブからホストのディスクなどに触れてしまう
+            const char* source = allowed_device_path(x.dev);
+            if (!source)
+              exit_fail((x.filename + " is not an allowed device").c_str());
+            x.source = source;
             args.devices.emplace_back(std::move(x));
           }
         } break;
@@ -336,7 +1722,6 @@ int main(int argc, char** argv) {
           namespace qi = boost::spirit::qi;
           const auto* ite = optarg;
           const auto end = ite + strlen(optarg);
-          std::pair<unsigned, unsigned> uids;
           qi::parse(ite, end, (qi::uint_ > ':' > qi::uint_), uids);
           std::minstd_rand g((getpid() << 16) ^ std::time(nullptr));
           args.newuid = std::uniform_int_distribution<unsigned>(uids.first,
@@ -351,15 +1736,80 @@ int main(int argc, char** argv) {
         case 'k':
           args.kill_grandchilds = true;
           break;
+        case 't':
+          args.timer.enabled = true;
+          break;
+        // ジョブには渡さないように、exec で閉じるようにしておく
+        case 'D':
+          args.timer.fd = atoi(optarg);
+          if (fcntl(args.timer.fd, F_SETFD, FD_CLOEXEC) == -1)
+            exit_error("--timing-fd");
+          break;
+        case 'T':
+          template_dir = optarg;
+          break;
+        case 'M':
+          mount_tmpfs_dir = optarg;
+          break;
+        case 'U':
+          umount_tmpfs_dir = optarg;
+          break;
+        case 'R':
+          umount_templates = true;
+          break;
+        // 0 や数値でないものを受け付けると、制限が無くなってしまう
+        case 'S':
+        case 'I': {
+          unsigned long long n;
+          if (!parse_ull(optarg, n) || n == 0 || n > ULONG_MAX)
+            exit_fail((std::string(opt == 'S' ? "invalid --tmpfs-size "
+                                              : "invalid --tmpfs-inodes ") +
+                       optarg)
+                          .c_str());
+          (opt == 'S' ? args.tmpfs_size : args.tmpfs_inodes) = n;
+        } break;
+        case 'Z':
+          zygote_socket = optarg;
+          break;
+        case 'P':
+          zygote_pool = atoi(optarg);
+          break;
+        case 'A':
+          attach_socket = optarg;
+          break;
+        case 'n':
+          netns_reuse = atoi(optarg);
+          break;
+        case 's':
+          args.session = true;
+          break;
+        // env, nice, prlimit を別々に exec しなくて済むように、ここで設定する。
+        // 設定したものは clone や exec したプロセスにそのまま引き継がれる
+        case 'E': {
+          const char* eq = strchr(optarg, '=');
+          if (!eq) exit_fail(("invalid --env " + std::string(optarg)).c_str());
+          setenv(std::string(optarg, eq - optarg).c_str(), eq + 1, 1);
+        } break;
+        case 'N': {
+          const bool neg = optarg[0] == '-';
+          unsigned long long n;
+          if (!parse_ull(optarg + (neg ? 1 : 0), n) || n > 40)
+            exit_fail(("invalid --nice " + std::string(optarg)).c_str());
+          errno = 0;
+          if (nice(neg ? -int(n) : int(n)) == -1 && errno != 0)
+            exit_error("nice");
+        } break;
+        case 'L':
+          if (!set_rlimit(optarg))
+            exit_error(("setrlimit " + std::string(optarg)).c_str());
+          break;
         case 'h':
         default:
           print_help();
           return 1;
       }
   }
-  if (pipe2(args.pipefd, O_CLOEXEC) == -1) exit_error("pipe");
-  args.argv = argv + optind;
-
+  args.timer.start();
   {
     cap_t caps = cap_get_proc();
     cap_value_t cap_list[] = {CAP_SYS_ADMIN, CAP_SYS_CHROOT, CAP_MKNOD,
@@ -372,6 +1822,44 @@ int main(int argc, char** argv) {
     if (cap_set_proc(caps) == -1) exit_error("cap_set_proc");
     cap_free(caps);
   }
+  args.timer.mark("caps");
+
+  // zygote に準備済みのサンドボックスを貰う場合は、ここでは何も準備しない
+  if (!attach_socket.empty())
+    return attach_main(attach_socket, argv + optind, args.session, args.timer);
+  if (pipe2(args.pipefd, O_CLOEXEC) == -1) exit_error("pipe");
+  args.argv = argv + optind;
+
+  // cattleshed から作業ディレクトリの tmpfs を操作するために呼ばれた場合
+  if (!mount_tmpfs_dir.empty()) {
+    if (args.tmpfs_size == 0) exit_fail("--mount-tmpfs requires --tmpfs-size");
+    return mount_workdir_tmpfs(mount_tmpfs_dir, args.tmpfs_size,
+                               args.tmpfs_inodes);
+  }
+  if (!umount_tmpfs_dir.empty()) return umount_workdir_tmpfs(umount_tmpfs_dir);
+  // cattleshed から古いテンプレートを消すために呼ばれた場合
+  if (umount_templates) {
+    if (template_dir.empty()) exit_fail("--umount-templates requires --template");
+    return umount_root_templates(template_dir);
+  }
+
+  if (!template_dir.empty()) {
+    // zygote のテンプレートは自分の mount namespace の中にだけ作る。
+    // サンドボックスはそれを引き継ぐのでホストから見える必要は無いし、zygote が終われば消える
+    if (!zygote_socket.empty() &&
+        (unshare(CLONE_NEWNS) == -1 ||
+         mount("/", "/", "none", MS_PRIVATE | MS_REC, nullptr) == -1))
+      exit_error("unshare(CLONE_NEWNS)");
+    args.root_template = prepare_root_template(template_dir, args);
+    args.timer.mark("prepare-template");
+  }
+  if (!zygote_socket.empty())
+    return zygote_main(zygote_socket, std::max(zygote_pool, 1), netns_reuse,
+                       uids, args);
+
+  // /proc/<pid> を見るので、PID namespace を分ける前に作っておく
+  args.idmap_userns_fd = make_idmap_userns(getuid(), getgid(), args.newuid);
+  args.timer.mark("userns");
 
   int pid = ::clone(&proc, stack + stacksize,
                     SIGCHLD | CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWNS |
@@ -383,6 +1871,9 @@ int main(int argc, char** argv) {
   }
   clear_all_caps();
   close(args.pipefd[1]);
+  if (args.idmap_userns_fd != -1) close(args.idmap_userns_fd);
+  // 残りはサンドボックスの中で書く
+  args.timer.close_fd();
 
   int st = wait_and_forward_signals(pid, !args.kill_grandchilds);
   int buf;
@@ -0,0 +1,240 @@
+#ifndef JAIL_TIMING_H_INCLUDED
+#define JAIL_TIMING_H_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Linux
+#include <stdio.h>
+
+// Boost
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "posixapi.hpp"
+
+// cattlegrid がサンドボックスの準備にかけた時間の集計
+//
+// cattlegrid に --timing-fd=3 を付けて実行すると、各フェーズが終わった時刻が
+// " start:<us> caps:<us> clone:<us> ... exec:<us>" の１行で fd 3 に書かれる。
+// 時刻は CLOCK_MONOTONIC の us で、std::chrono::steady_clock と同じ時計なので、
+// cattleshed が実行した時刻と比べることもできる。
+//
+// フェーズの時間は前のフェーズが終わってからの時間で、フェーズごとにヒストグラムを作る。
+// start は cattleshed が実行してから cattlegrid が動き出すまで（spawn）、
+// total は cattleshed が実行してから exec するまで全体の時間にする。
+// ヒストグラムは 2 の累乗の us ごとの個数で、起動してからの累計を定期的にファイルに書く。
+class JailTiming : public std::enable_shared_from_this<JailTiming> {
+ public:
+  // path: 集計結果を書き込むファイル
+  JailTiming(std::shared_ptr<boost::asio::io_context> ioc, std::string path,
+             std::shared_ptr<boost::asio::thread_pool> pool)
+      : ioc_(std::move(ioc)),
+        path_(std::move(path)),
+        pool_(std::move(pool)),
+        timer_(*ioc_) {}
+
+  void Start() { ScheduleDump(); }
+
+  // fd は cattlegrid に fd 3 として渡したパイプの読み込み側。
+  // 記録を１行読んだら集計する。途中で cattlegrid が失敗した場合は何もしない
+  void Watch(std::shared_ptr<boost::asio::io_context> ioc,
+             wandbox::unique_fd fd,
+             std::chrono::steady_clock::time_point spawned) {
+    auto reader = std::make_shared<Reader>(*ioc, fd.release(), spawned);
+    Read(reader);
+  }
+
+ private:
+  static constexpr int kBuckets = 26;
+  static constexpr int kDumpIntervalSeconds = 60;
+
+  struct Histogram {
+    std::uint64_t count = 0;
+    std::uint64_t sum_us = 0;
+    // buckets[i] は 2^(i-1) us 以上 2^i us 未満の個数。最後は残り全部
+    std::uint64_t buckets[kBuckets] = {};
+
+    void Add(std::int64_t us) {
+      if (us < 0) us = 0;
+      int i = 0;
+      while (i < kBuckets - 1 && (std::int64_t(1) << i) <= us) ++i;
+      ++count;
+      sum_us += us;
+      ++buckets[i];
+    }
+    // パーセンタイルの上限の見積もり
+    std::int64_t Percentile(double p) const {
+      std::uint64_t n = 0;
+      for (int i = 0; i < kBuckets; ++i) {
+        n += buckets[i];
+        if (n >= count * p) return std::int64_t(1) << i;
+      }
+      return std::int64_t(1) << (kBuckets - 1);
+    }
+  };
+
+  struct Reader {
+    Reader(boost::asio::io_context& ioc, int fd,
+           std::chrono::steady_clock::time_point spawned)
+        : desc(ioc, fd), spawned(spawned) {}
+    boost::asio::posix::stream_descriptor desc;
+    std::chrono::steady_clock::time_point spawned;
+    char buf[4096];
+    std::string line;
+  };
+
+  void Read(std::shared_ptr<Reader> reader) {
+    reader->desc.async_read_some(
+        boost::asio::buffer(reader->buf),
+        [self = shared_from_this(), reader](const boost::system::error_code& ec,
+                                            std::size_t n) {
+          if (ec) {
+            return;
+          }
+          reader->line.append(reader->buf, n);
+          const auto pos = reader->line.find('\n');
+          if (pos == std::string::npos) {
+            if (reader->line.size() < sizeof(reader->buf)) {
+              self->Read(reader);
+            }
+            return;
+          }
+          reader->line.resize(pos);
+          self->Record(reader->line, reader->spawned);
+        });
+  }
+
+  void Record(const std::string& line,
+              std::chrono::steady_clock::time_point spawned) {
+    const std::int64_t spawned_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            spawned.time_since_epoch())
+            .count();
+    std::vector<std::pair<std::string, std::int64_t>> phases;
+    std::istringstream ss(line);
+    std::string token;
+    while (ss >> token) {
+      // マウントのフェーズは "mount:/usr/lib:<us>" のようになっている
+      // JSON にそのまま書くので、エスケープが必要な名前は捨てる
+      const auto pos = token.rfind(':');
+      if (pos == std::string::npos || pos == 0 ||
+          token.find_first_of("\"\\") != std::string::npos) {
+        continue;
+      }
+      phases.emplace_back(token.substr(0, pos),
+                          std::strtoll(token.c_str() + pos + 1, nullptr, 10));
+    }
+    if (phases.empty()) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::int64_t last = spawned_us;
+    for (const auto& p : phases) {
+      const std::string name = p.first == "start" ? "spawn" : p.first;
+      histograms_[name].Add(p.second - last);
+      last = p.second;
+    }
+    histograms_["total"].Add(last - spawned_us);
+    ++records_;
+  }
+
+  void ScheduleDump() {
+    timer_.expires_after(std::chrono::seconds(kDumpIntervalSeconds));
+    timer_.async_wait(
+        [self = shared_from_this()](const boost::system::error_code& ec) {
+          if (ec) {
+            return;
+          }
+          self->Dump();
+          self->ScheduleDump();
+        });
+  }
+
+  void Dump() {
+    std::string json;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (records_ == dumped_records_) {
+        return;
+      }
+      dumped_records_ = records_;
+      json = ToJson();
+      const auto it = histograms_.find("total");
+      if (it != histograms_.end()) {
+        SPDLOG_INFO("jail timing: records={} total p50<{}us p99<{}us",
+                    records_, it->second.Percentile(0.5),
+                    it->second.Percentile(0.99));
+      }
+    }
+    boost::asio::post(*pool_, [self = shared_from_this(),
+                               json = std::move(json)]() { self->Save(json); });
+  }
+
+  // mutex_ をロックした状態で呼ぶこと
+  std::string ToJson() const {
+    std::string r = "{\"records\":" + std::to_string(records_) +
+                    ",\"bucket_upper_us\":[";
+    for (int i = 0; i < kBuckets; ++i) {
+      if (i != 0) r += ',';
+      r += i == kBuckets - 1 ? "null" : std::to_string(std::int64_t(1) << i);
+    }
+    r += "],\"phases\":{";
+    bool first = true;
+    for (const auto& p : histograms_) {
+      if (!first) r += ',';
+      first = false;
+      r += "\"" + p.first + "\":{\"count\":" + std::to_string(p.second.count) +
+           ",\"sum_us\":" + std::to_string(p.second.sum_us) + ",\"buckets\":[";
+      for (int i = 0; i < kBuckets; ++i) {
+        if (i != 0) r += ',';
+        r += std::to_string(p.second.buckets[i]);
+      }
+      r += "]}";
+    }
+    r += "}}\n";
+    return r;
+  }
+
+  // スレッドプール上で呼ばれる
+  void Save(const std::string& json) {
+    std::lock_guard<std::mutex> lock(save_mutex_);
+    const std::string tmp = path_ + ".tmp";
+    {
+      std::ofstream ofs(tmp, std::ios::trunc);
+      ofs << json;
+      if (!ofs) {
+        SPDLOG_WARN("failed to write jail timing: {}", tmp);
+        return;
+      }
+    }
+    if (::rename(tmp.c_str(), path_.c_str()) < 0) {
+      SPDLOG_WARN("failed to rename jail timing: {} errno={}", tmp, errno);
+    }
+  }
+
+  std::shared_ptr<boost::asio::io_context> ioc_;
+  std::string path_;
+  std::shared_ptr<boost::asio::thread_pool> pool_;
+  boost::asio::steady_timer timer_;
+
+  std::mutex mutex_;
+  // フェーズ名ごとのヒストグラム。名前順に出力する
+  std::map<std::string, Histogram> histograms_;
+  std::uint64_t records_ = 0;
+  std::uint64_t dumped_records_ = 0;
+  std::mutex save_mutex_;
+};
+
+#endif  // JAIL_TIMING_H_INCLUDED
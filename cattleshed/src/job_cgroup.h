@@ -0,0 +1,281 @@
+#ifndef JOB_CGROUP_H_INCLUDED
+#define JOB_CGROUP_H_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Linux
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Boost
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "load_config.hpp"
+#include "posixapi.hpp"
+
+// ジョブごとの cgroup v2
+//
+// prlimit はプロセスごとの制限なので、fork されるとその数だけ使えてしまうけど、
+// cgroup ならジョブ全体（コンパイルも実行も孫プロセスも含めて）で制限できる。
+// 終了時は cgroup.kill で中のプロセスを全部殺すので、デーモン化したプロセスも残らない。
+//
+// root は cattleshed に委譲された cgroup v2 のディレクトリで、
+// cattleshed 自身はここに所属していてはいけない（cgroup v2 の no internal process 制約のため）。
+class JobCgroup : public std::enable_shared_from_this<JobCgroup> {
+ public:
+  // StartUsage からの使用量。cgroup の中の全てのプロセスの合計
+  struct Usage {
+    std::int64_t user_time_us = 0;
+    std::int64_t system_time_us = 0;
+    // memory.peak の値。分からなければ -1
+    std::int64_t max_memory_kb = -1;
+  };
+
+  // root の下でコントローラを使えるようにする。起動時に一度だけ呼ぶ
+  static void EnableControllers(const std::string& root) {
+    if (root.empty()) {
+      return;
+    }
+    for (const char* c : {"+memory", "+cpu", "+pids", "+io"}) {
+      // 使えないコントローラがあっても他は有効にしたいので１つずつ書く
+      if (!WriteFile(root + "/cgroup.subtree_control", c)) {
+        SPDLOG_WARN("failed to enable cgroup controller {} in {}: errno={}", c,
+                    root, errno);
+      }
+    }
+  }
+
+  // root が空だったり作成に失敗した場合は nullptr を返す。
+  // その場合は今まで通り jail-command の prlimit による制限だけになる。
+  static std::shared_ptr<JobCgroup> Create(const std::string& root,
+                                           const std::string& name,
+                                           const wandbox::jail_config& jail) {
+    if (root.empty()) {
+      return nullptr;
+    }
+    const std::string path = root + "/" + name;
+    if (::mkdir(path.c_str(), 0755) < 0) {
+      SPDLOG_WARN("failed to create cgroup {}: errno={}", path, errno);
+      return nullptr;
+    }
+    auto cg = std::shared_ptr<JobCgroup>(new JobCgroup(path));
+    cg->fd_.reset(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!cg->fd_) {
+      SPDLOG_WARN("failed to open cgroup {}: errno={}", path, errno);
+      return nullptr;
+    }
+
+    if (jail.cgroup_memory_max > 0) {
+      const auto bytes = (std::int64_t)jail.cgroup_memory_max * 1024 * 1024;
+      cg->Set("memory.max", std::to_string(bytes));
+      cg->Set("memory.swap.max", "0");
+    }
+    if (jail.cgroup_cpu_max > 0) {
+      // 100 で CPU 1 個分
+      const int period = 100000;
+      cg->Set("cpu.max", std::to_string((std::int64_t)jail.cgroup_cpu_max *
+                                        period / 100) +
+                             " " + std::to_string(period));
+    }
+    if (jail.cgroup_pids_max > 0) {
+      cg->Set("pids.max", std::to_string(jail.cgroup_pids_max));
+    }
+    if (jail.cgroup_io_weight > 0) {
+      cg->Set("io.weight", "default " + std::to_string(jail.cgroup_io_weight));
+    }
+    return cg;
+  }
+
+  // AsyncRemove を呼ばずに破棄された場合はここで削除する。
+  // io_context が止まっていることもあるので、プロセスがいなくなるのを同期的に待つ
+  ~JobCgroup() {
+    if (!removed_) {
+      Kill();
+      if (!WaitUnpopulated(std::chrono::seconds(1))) {
+        SPDLOG_WARN("processes in cgroup {} did not exit in time", path_);
+      }
+      if (::rmdir(path_.c_str()) < 0) {
+        SPDLOG_WARN("failed to remove cgroup {}: errno={}", path_, errno);
+      }
+    }
+  }
+
+  int fd() const { return fd_.get(); }
+  const std::string& path() const { return path_; }
+
+  // cgroup の中のプロセスを全部 SIGKILL する
+  void Kill() {
+    if (WriteFile(path_ + "/cgroup.kill", "1")) {
+      return;
+    }
+    // cgroup.kill が無い古いカーネルなので、１つずつ殺す
+    std::ifstream ifs(path_ + "/cgroup.procs");
+    pid_t pid;
+    while (ifs >> pid) {
+      ::kill(pid, SIGKILL);
+    }
+  }
+
+  // 使用量の計測を始める。cpu.stat の値を覚えておいて、memory.peak をリセットする
+  void StartUsage() {
+    cpu_base_ = ReadCpuStat();
+    const std::string peak = path_ + "/memory.peak";
+    peak_fd_.reset(::open(peak.c_str(), O_RDWR | O_CLOEXEC));
+    // memory.peak を開いた fd ごとにリセットできるのは Linux 6.12 から。
+    // リセットできない場合、値は cgroup を作ってからの最大値なので、最初の計測でだけ使える
+    bool reset = false;
+    if (peak_fd_) {
+      reset = ::write(peak_fd_.get(), "reset", 5) == 5;
+    } else {
+      peak_fd_.reset(::open(peak.c_str(), O_RDONLY | O_CLOEXEC));
+    }
+    peak_valid_ = peak_fd_ && (reset || !usage_started_);
+    usage_started_ = true;
+  }
+
+  // StartUsage からの使用量。cpu.stat が読めなければ boost::none
+  boost::optional<Usage> GetUsage() const {
+    const auto cpu = ReadCpuStat();
+    if (!cpu_base_ || !cpu) {
+      return boost::none;
+    }
+    Usage u;
+    u.user_time_us = cpu->first - cpu_base_->first;
+    u.system_time_us = cpu->second - cpu_base_->second;
+    if (peak_valid_) {
+      char buf[32];
+      const auto n = ::pread(peak_fd_.get(), buf, sizeof(buf) - 1, 0);
+      if (n > 0) {
+        buf[n] = '\0';
+        u.max_memory_kb = std::strtoll(buf, nullptr, 10) / 1024;
+      }
+    }
+    return u;
+  }
+
+  // 中のプロセスを全部殺して、いなくなったら cgroup を削除する。
+  // プロセスが消えるのは非同期なので、削除できるまで少し待つ。
+  void AsyncRemove(std::shared_ptr<boost::asio::io_context> ioc) {
+    Kill();
+    fd_.reset();
+    peak_fd_.reset();
+    timer_ = std::make_shared<boost::asio::steady_timer>(*ioc);
+    TryRemove(0);
+  }
+
+ private:
+  explicit JobCgroup(std::string path) : path_(std::move(path)), fd_(-1) {}
+
+  void TryRemove(int retry) {
+    if (::rmdir(path_.c_str()) == 0 || errno == ENOENT) {
+      removed_ = true;
+      timer_.reset();
+      return;
+    }
+    if (errno != EBUSY || retry >= 100) {
+      SPDLOG_WARN("failed to remove cgroup {}: errno={}", path_, errno);
+      removed_ = true;
+      timer_.reset();
+      return;
+    }
+    timer_->expires_after(std::chrono::milliseconds(10));
+    timer_->async_wait(
+        [self = shared_from_this(), retry](const boost::system::error_code& ec) {
+          if (!ec) {
+            self->TryRemove(retry + 1);
+          }
+        });
+  }
+
+  // cgroup.events が "populated 0" になるまで待つ。
+  // cgroup.events は中身が変わると POLLPRI で通知される
+  bool WaitUnpopulated(std::chrono::milliseconds timeout) const {
+    const wandbox::unique_fd fd(
+        ::open((path_ + "/cgroup.events").c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd) {
+      return false;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      char buf[256];
+      const auto n = ::pread(fd.get(), buf, sizeof(buf) - 1, 0);
+      if (n < 0) {
+        return false;
+      }
+      buf[n] = '\0';
+      if (::strstr(buf, "populated 0") != nullptr) {
+        return true;
+      }
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now())
+                            .count();
+      if (left <= 0) {
+        return false;
+      }
+      struct pollfd pfd = {fd.get(), POLLPRI, 0};
+      if (::poll(&pfd, 1, (int)left) < 0 && errno != EINTR) {
+        return false;
+      }
+    }
+  }
+
+  // cpu.stat の user_usec と system_usec
+  boost::optional<std::pair<std::int64_t, std::int64_t>> ReadCpuStat() const {
+    std::ifstream ifs(path_ + "/cpu.stat");
+    std::string key;
+    std::int64_t value;
+    boost::optional<std::int64_t> user;
+    boost::optional<std::int64_t> system;
+    while (ifs >> key >> value) {
+      if (key == "user_usec") {
+        user = value;
+      } else if (key == "system_usec") {
+        system = value;
+      }
+    }
+    if (!user || !system) {
+      return boost::none;
+    }
+    return std::make_pair(*user, *system);
+  }
+
+  void Set(const std::string& file, const std::string& value) {
+    if (!WriteFile(path_ + "/" + file, value)) {
+      SPDLOG_WARN("failed to write {} to {}/{}: errno={}", value, path_, file,
+                  errno);
+    }
+  }
+
+  static bool WriteFile(const std::string& path, const std::string& value) {
+    const wandbox::unique_fd fd(::open(path.c_str(), O_WRONLY | O_CLOEXEC));
+    if (!fd) {
+      return false;
+    }
+    return ::write(fd.get(), value.data(), value.size()) ==
+           (ssize_t)value.size();
+  }
+
+  std::string path_;
+  wandbox::unique_fd fd_;
+  std::shared_ptr<boost::asio::steady_timer> timer_;
+  bool removed_ = false;
+  boost::optional<std::pair<std::int64_t, std::int64_t>> cpu_base_;
+  wandbox::unique_fd peak_fd_{-1};
+  bool peak_valid_ = false;
+  bool usage_started_ = false;
+};
+
+#endif  // JOB_CGROUP_H_INCLUDED
@@ -0,0 +1,258 @@
+#ifndef JOB_SCHEDULER_H_INCLUDED
+#define JOB_SCHEDULER_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Boost
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+// 同時に実行するジョブの数を制限する
+//
+// 全体で max_running 個まで、jail ごとに jail_cap 個までしか同時に実行しない。
+// 実行できないジョブは発行者ごとの FIFO に積んでおいて、発行者をラウンドロビンで回しながら実行していく。
+// なので、ある発行者が大量にジョブを投げても、他の発行者のジョブが後回しにされ続けることは無い。
+class JobScheduler : public std::enable_shared_from_this<JobScheduler> {
+ public:
+  // position は 1 始まりで、自分より先に実行されるジョブの数 + 1
+  typedef std::function<void(int position)> PositionHandler;
+  typedef std::function<void()> StartHandler;
+
+  // 破棄すると、実行中なら枠を空けて、待っている途中ならキューから取り除く
+  class Ticket {
+   public:
+    ~Ticket() {
+      if (auto scheduler = scheduler_.lock()) {
+        scheduler->Release(this);
+      }
+    }
+
+   private:
+    friend class JobScheduler;
+    std::weak_ptr<JobScheduler> scheduler_;
+    std::weak_ptr<Ticket> self_;
+    std::string issuer;
+    std::string jail;
+    int jail_cap = 0;
+    std::shared_ptr<boost::asio::io_context> ioc;
+    PositionHandler on_position;
+    StartHandler on_start;
+    int position = 0;
+    bool running = false;
+    // 最後に on_position で通知した待ち順と時刻
+    int notified_position = 0;
+    std::chrono::steady_clock::time_point notified_at;
+    bool notify_pending = false;
+  };
+
+  // max_running が 0 以下なら全体の制限は無し
+  explicit JobScheduler(int max_running) : max_running_(max_running) {}
+
+  // ジョブを登録する。
+  // 実行できるようになったら ioc 上で on_start が呼ばれる。
+  // 待たされる場合は、待ち順が変わると ioc 上で on_position が呼ばれる。
+  // 通知はジョブごとに kPositionIntervalMs に１回までで、その間の変化はまとめて最新の待ち順だけを通知する。
+  // jail_cap が 0 以下なら jail ごとの制限は無し。
+  std::shared_ptr<Ticket> Enqueue(std::string issuer, std::string jail,
+                                  int jail_cap,
+                                  std::shared_ptr<boost::asio::io_context> ioc,
+                                  PositionHandler on_position,
+                                  StartHandler on_start) {
+    auto ticket = std::make_shared<Ticket>();
+    ticket->scheduler_ = shared_from_this();
+    ticket->self_ = ticket;
+    ticket->issuer = std::move(issuer);
+    ticket->jail = std::move(jail);
+    ticket->jail_cap = jail_cap;
+    ticket->ioc = std::move(ioc);
+    ticket->on_position = std::move(on_position);
+    ticket->on_start = std::move(on_start);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& queue = queues_[ticket->issuer];
+    if (queue.empty()) {
+      issuers_.push_back(ticket->issuer);
+    }
+    queue.push_back(ticket.get());
+    waiting_ += 1;
+    Dispatch();
+    if (!ticket->running) {
+      SPDLOG_INFO("job queued: issuer={} jail={} running={} waiting={}",
+                  ticket->issuer, ticket->jail, running_, waiting_);
+    }
+    return ticket;
+  }
+
+ private:
+  // mutex_ をロックした状態で呼ぶこと
+  bool Runnable(const Ticket* t) const {
+    if (max_running_ > 0 && running_ >= max_running_) {
+      return false;
+    }
+    if (t->jail_cap > 0) {
+      const auto it = jail_running_.find(t->jail);
+      if (it != jail_running_.end() && it->second >= t->jail_cap) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // 実行できるジョブを全部実行して、待っているジョブに待ち順を通知する
+  // mutex_ をロックした状態で呼ぶこと
+  void Dispatch() {
+    bool progressed = true;
+    while (progressed && !issuers_.empty()) {
+      progressed = false;
+      for (auto it = issuers_.begin(); it != issuers_.end(); ++it) {
+        auto& queue = queues_[*it];
+        Ticket* t = queue.front();
+        if (!Runnable(t)) {
+          // 先頭が jail の制限で実行できない発行者は飛ばす
+          continue;
+        }
+        queue.pop_front();
+        waiting_ -= 1;
+        running_ += 1;
+        jail_running_[t->jail] += 1;
+        t->running = true;
+        boost::asio::post(*t->ioc, [wt = t->self_]() {
+          if (auto t = wt.lock()) {
+            t->on_start();
+          }
+        });
+
+        // 実行した発行者は最後に回す
+        const auto issuer = *it;
+        issuers_.erase(it);
+        if (queue.empty()) {
+          queues_.erase(issuer);
+        } else {
+          issuers_.push_back(issuer);
+        }
+        progressed = true;
+        break;
+      }
+    }
+    NotifyPositions();
+  }
+
+  // ラウンドロビンで実行していった場合に、何番目に実行されるかを通知する。
+  // 発行者を順番に１つずつ取り出していくのをそのままなぞるので、待っているジョブの数に比例する時間で済む
+  // mutex_ をロックした状態で呼ぶこと
+  void NotifyPositions() {
+    if (waiting_ == 0) {
+      return;
+    }
+    std::vector<const std::deque<Ticket*>*> active;
+    for (const auto& issuer : issuers_) {
+      active.push_back(&queues_[issuer]);
+    }
+    int position = 0;
+    for (std::size_t k = 0; !active.empty(); k++) {
+      std::size_t n = 0;
+      for (const auto* queue : active) {
+        Ticket* t = (*queue)[k];
+        position += 1;
+        if (t->position != position) {
+          t->position = position;
+          SchedulePositionNotify(t);
+        }
+        // k+1 番目が残っている発行者だけを次の周に回す
+        if (queue->size() > k + 1) {
+          active[n++] = queue;
+        }
+      }
+      active.resize(n);
+    }
+  }
+
+  // 待ち順が変わるたびに gRPC で書き込むと、ジョブが１つ実行されるたびに
+  // 待っている全部のジョブに書き込むことになるので、ジョブごとに間隔を空けて通知する
+  // mutex_ をロックした状態で呼ぶこと
+  void SchedulePositionNotify(Ticket* t) {
+    if (t->notify_pending) {
+      return;
+    }
+    t->notify_pending = true;
+    const auto delay = std::max(
+        std::chrono::steady_clock::duration::zero(),
+        t->notified_at + std::chrono::milliseconds(kPositionIntervalMs) -
+            std::chrono::steady_clock::now());
+    auto timer = std::make_shared<boost::asio::steady_timer>(*t->ioc, delay);
+    timer->async_wait([self = shared_from_this(), wt = t->self_,
+                       timer](const boost::system::error_code&) {
+      auto t = wt.lock();
+      if (!t) {
+        return;
+      }
+      int position;
+      {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        t->notify_pending = false;
+        if (t->running || t->position == t->notified_position) {
+          return;
+        }
+        position = t->position;
+        t->notified_position = position;
+        t->notified_at = std::chrono::steady_clock::now();
+      }
+      t->on_position(position);
+    });
+  }
+
+  void Release(Ticket* ticket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ticket->running) {
+      running_ -= 1;
+      jail_running_[ticket->jail] -= 1;
+    } else {
+      // まだ待っている途中だった
+      const auto it = queues_.find(ticket->issuer);
+      if (it == queues_.end()) {
+        return;
+      }
+      auto& queue = it->second;
+      const auto pos =
+          std::find_if(queue.begin(), queue.end(),
+                       [ticket](const Ticket* t) { return t == ticket; });
+      if (pos == queue.end()) {
+        return;
+      }
+      queue.erase(pos);
+      waiting_ -= 1;
+      if (queue.empty()) {
+        queues_.erase(it);
+        issuers_.remove(ticket->issuer);
+      }
+    }
+    Dispatch();
+  }
+
+  static constexpr int kPositionIntervalMs = 1000;
+
+  int max_running_;
+
+  std::mutex mutex_;
+  int running_ = 0;
+  int waiting_ = 0;
+  std::unordered_map<std::string, int> jail_running_;
+  // 待っているジョブがある発行者を、次に実行する順に並べたもの
+  std::list<std::string> issuers_;
+  // Ticket は破棄される時に自分を取り除くので、生ポインタで持っておく
+  std::unordered_map<std::string, std::deque<Ticket*>> queues_;
+};
+
+#endif  // JOB_SCHEDULER_H_INCLUDED
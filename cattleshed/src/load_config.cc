@@ -1,5 +1,10 @@
 #include "load_config.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <functional>
+#include <limits>
 #include <map>
 #include <sstream>
 #include <string>
@@ -13,13 +18,11 @@
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 #include <boost/multi_index_container.hpp>
-#include <boost/spirit/include/phoenix.hpp>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/support_istream_iterator.hpp>
-#include <boost/spirit/include/support_line_pos_iterator.hpp>
-#include <boost/spirit/include/support_multi_pass.hpp>
 #include <boost/variant.hpp>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <spdlog/spdlog.h>
 
 #include "posixapi.hpp"
@@ -35,35 +38,174 @@ typedef std::string string;
 typedef std::unordered_map<string, value> object;
 typedef std::vector<value> array;
 
-namespace qi = boost::spirit::qi;
+// 末尾のカンマを許す JSON のパーサ
+//
+// 以前は Spirit で１バイトずつ読みながらパースしていたが、設定ファイルが大きいと遅いので、
+// mmap したバッファを直接なめるようにしている。
+struct parse_error : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
 
-template <typename Iter>
-struct config_grammar : qi::grammar<Iter, value(), qi::space_type> {
-  config_grammar() : qi::grammar<Iter, value(), qi::space_type>(top) {
-    namespace phx = boost::phoenix;
-    top %= (obj | arr) > qi::eoi;
-    val %= obj | arr | str | qi::int_ | qi::bool_;
-    pair %= str > ':' > val;
-    obj %= '{' > (((pair % ',') > -qi::lit(',')) | qi::eps) > '}';
-    arr %= '[' > (((val % ',') > -qi::lit(',')) | qi::eps) > ']';
-    str %= qi::lexeme['\"' > *(('\\' > (qi::char_("\\\"'") |
-                                        (qi::lit('t') > qi::attr('\t')) |
-                                        (qi::lit('r') > qi::attr('\r')) |
-                                        (qi::lit('n') > qi::attr('\n')))) |
-                               (qi::char_ - '\"')) > '\"'];
-    //debug(top);
-    //debug(val);
-    //debug(pair);
-    //debug(obj);
-    //debug(arr);
-    //debug(str);
-  }
-  qi::rule<Iter, value(), qi::space_type> top;
-  qi::rule<Iter, std::pair<string, value>(), qi::space_type> pair;
-  qi::rule<Iter, object(), qi::space_type> obj;
-  qi::rule<Iter, array(), qi::space_type> arr;
-  qi::rule<Iter, value(), qi::space_type> val;
-  qi::rule<Iter, string(), qi::space_type> str;
+class config_parser {
+ public:
+  config_parser(const std::string& file, const char* first, const char* last)
+      : file_(file), begin_(first), p_(first), last_(last) {}
+
+  value parse() {
+    skip_space();
+    // 空白しか無いファイルは、以前のパーサと同じく何も設定していないものとして扱う
+    if (p_ == last_) return value();
+    value v;
+    if (peek('{')) {
+      v = parse_object();
+    } else if (peek('[')) {
+      v = parse_array();
+    } else {
+      fail("'{' or '['");
+    }
+    skip_space();
+    if (p_ != last_) fail("end of input");
+    return v;
+  }
+
+ private:
+  bool peek(char c) const { return p_ != last_ && *p_ == c; }
+  void skip_space() {
+    while (p_ != last_ && std::isspace(static_cast<unsigned char>(*p_))) ++p_;
+  }
+  void expect(char c) {
+    skip_space();
+    if (!peek(c)) fail(std::string("'") + c + "'");
+    ++p_;
+  }
+
+  value parse_value() {
+    skip_space();
+    if (p_ == last_) fail("value");
+    switch (*p_) {
+      case '{':
+        return parse_object();
+      case '[':
+        return parse_array();
+      case '\"':
+        return parse_string();
+    }
+    int n;
+    if (parse_int(n)) return n;
+    if (last_ - p_ >= 4 && std::equal(p_, p_ + 4, "true")) {
+      p_ += 4;
+      return true;
+    }
+    if (last_ - p_ >= 5 && std::equal(p_, p_ + 5, "false")) {
+      p_ += 5;
+      return false;
+    }
+    fail("value");
+  }
+
+  bool parse_int(int& n) {
+    const char* q = p_;
+    bool neg = false;
+    if (q != last_ && (*q == '+' || *q == '-')) neg = *q++ == '-';
+    if (q == last_ || !std::isdigit(static_cast<unsigned char>(*q)))
+      return false;
+    long long x = 0;
+    while (q != last_ && std::isdigit(static_cast<unsigned char>(*q))) {
+      x = x * 10 + (*q++ - '0');
+      if (x > static_cast<long long>(std::numeric_limits<int>::max()) + 1)
+        return false;
+    }
+    if (neg) x = -x;
+    if (x > std::numeric_limits<int>::max()) return false;
+    n = static_cast<int>(x);
+    p_ = q;
+    return true;
+  }
+
+  string parse_string() {
+    expect('\"');
+    string s;
+    while (true) {
+      const char* q = p_;
+      while (q != last_ && *q != '\"' && *q != '\\') ++q;
+      s.append(p_, q);
+      p_ = q;
+      if (p_ == last_) fail("'\"'");
+      if (*p_ == '\"') {
+        ++p_;
+        return s;
+      }
+      ++p_;
+      if (p_ == last_) fail("escape sequence");
+      switch (*p_) {
+        case '\\':
+        case '\"':
+        case '\'':
+          s.push_back(*p_);
+          break;
+        case 't':
+          s.push_back('\t');
+          break;
+        case 'r':
+          s.push_back('\r');
+          break;
+        case 'n':
+          s.push_back('\n');
+          break;
+        default:
+          fail("escape sequence");
+      }
+      ++p_;
+    }
+  }
+
+  object parse_object() {
+    expect('{');
+    object obj;
+    skip_space();
+    while (!peek('}')) {
+      skip_space();
+      string key = parse_string();
+      expect(':');
+      // 同じキーが複数ある場合は最初のものを使う
+      obj.emplace(std::move(key), parse_value());
+      skip_space();
+      if (!peek(',')) break;
+      ++p_;
+      skip_space();
+    }
+    expect('}');
+    return obj;
+  }
+
+  array parse_array() {
+    expect('[');
+    array arr;
+    skip_space();
+    while (!peek(']')) {
+      arr.push_back(parse_value());
+      skip_space();
+      if (!peek(',')) break;
+      ++p_;
+      skip_space();
+    }
+    expect(']');
+    return arr;
+  }
+
+  __attribute__((noreturn)) void fail(const std::string& what) const {
+    const auto line = std::count(begin_, p_, '\n') + 1;
+    std::stringstream ss;
+    ss << "parse error in file " << file_ << ":" << line
+       << "\nwhile expecting " << what << "\nbut got "
+       << std::string(p_, p_ + std::min<std::ptrdiff_t>(last_ - p_, 128));
+    throw parse_error(ss.str());
+  }
+
+  const std::string& file_;
+  const char* begin_;
+  const char* p_;
+  const char* last_;
 };
 
 struct operator_output : boost::static_visitor<std::ostream&> {
@@ -201,6 +343,7 @@ compiler_set load_compiler_trait(const cfg::value& o) {
     t.compiler_option_raw = get_bool(y, "compiler-option-raw");
     t.runtime_option_raw = get_bool(y, "runtime-option-raw");
     t.templates = get_str_array(y, "templates");
+    t.compile_cache = get_bool(y, "compile-cache");
     if (const auto& v = find(y, "switches")) {
       if (const auto* s = boost::get<cfg::string>(&*v)) {
         t.switches = {*s};
@@ -224,17 +367,42 @@ compiler_set load_compiler_trait(const cfg::value& o) {
     else
       append_map.emplace(appendto, std::move(t));
   }
-  while (!inherit_map.empty()) {
-    const auto ite = std::find_if(
-        inherit_map.begin(), inherit_map.end(),
-        [&](const std::pair<const std::string, std::vector<std::string>>& p) {
-          return std::all_of(
-              p.second.begin(), p.second.end(), [&](const std::string& target) {
-                return inherit_map.find(target) == inherit_map.end();
-              });
-        });
-    if (ite == inherit_map.end()) break;
-    const auto pos = ret.get<1>().find(ite->first);
+  // 継承元を先に解決するように、深さ優先で辿りながら解決していく。
+  // 循環している場合や、存在しないコンパイラを継承している場合は解決しない。
+  enum class visit_state { visiting, resolved, failed };
+  std::unordered_map<std::string, visit_state> states;
+  std::function<bool(const std::string&)> resolve =
+      [&](const std::string& name) -> bool {
+    const auto st = states.find(name);
+    if (st != states.end()) {
+      if (st->second == visit_state::visiting) {
+        SPDLOG_WARN("circular inheritance at compiler {}", name);
+        return false;
+      }
+      return st->second == visit_state::resolved;
+    }
+    const auto ite = inherit_map.find(name);
+    if (ite == inherit_map.end()) {
+      states[name] = visit_state::resolved;
+      return true;
+    }
+    states[name] = visit_state::visiting;
+    const auto pos = ret.get<1>().find(name);
+    bool ok = pos != ret.get<1>().end();
+    for (const auto& target : ite->second) {
+      if (!ok) break;
+      if (ret.get<1>().find(target) == ret.get<1>().end()) {
+        SPDLOG_WARN("compiler {} inherits unknown compiler {}", name, target);
+        ok = false;
+        break;
+      }
+      ok = resolve(target);
+    }
+    if (!ok) {
+      states[name] = visit_state::failed;
+      return false;
+    }
+
     auto sub = *pos;
     for (const auto& target : ite->second) {
       const auto& x = *ret.get<1>().find(target);
@@ -250,9 +418,13 @@ compiler_set load_compiler_trait(const cfg::value& o) {
       if (sub.switches.empty()) sub.switches = x.switches;
       if (sub.local_switches.get<1>().empty())
         sub.local_switches = x.local_switches;
-      ret.get<1>().replace(pos, sub);
     }
-    inherit_map.erase(sub.name);
+    ret.get<1>().replace(pos, std::move(sub));
+    states[name] = visit_state::resolved;
+    return true;
+  };
+  for (const auto& p : inherit_map) {
+    resolve(p.first);
   }
   for (auto&& m : append_map) {
     const auto ti = ret.get<1>().find(m.first);
@@ -280,15 +452,95 @@ system_config load_system_config(const cfg::value& values) {
   const auto& o =
       boost::get<cfg::object>(boost::get<cfg::object>(values).at("system"));
   return {get_int(o, "listen-port"), get_int(o, "max-connections"),
-          get_str(o, "basedir"), get_str(o, "storedir")};
+          get_str(o, "basedir"), get_str(o, "storedir"),
+          get_str(o, "compile-cache-dir"), get_int(o, "compile-cache-size"),
+          get_int(o, "version-probe-concurrency"),
+          get_int(o, "version-probe-timeout"),
+          get_str(o, "version-cache-file"), get_str(o, "cgroup-root"),
+          get_str(o, "cattlegrid"),
+          get_int(o, "workdir-pool-size"), get_int(o, "workdir-reclaim-rate"),
+          get_int(o, "workdir-disk-usage-max"),
+          get_int(o, "run-log-segment-size"),
+          get_bool(o, "run-log-compression"),
+          get_str(o, "jail-timing-file")};
+}
+
+namespace {
+// jail-spec から jail-command と zygote-command を作る。
+// env, nice, rlimits は cattlegrid 自身が設定するので、env や nice や prlimit を
+// 間に挟まずに cattlegrid を１回 exec するだけで済む。
+// cattlegrid のパスが分からない場合は jail-command をそのまま使う。
+void load_jail_spec(const std::string& name, const cfg::object& spec,
+                    const std::string& cattlegrid, jail_config& x) {
+  using namespace detail;
+  std::string exe = get_str(spec, "cattlegrid");
+  if (exe.empty()) exe = cattlegrid;
+  if (exe.empty()) {
+    SPDLOG_ERROR("jail-spec of {} requires system.cattlegrid", name);
+    return;
+  }
+
+  std::vector<std::string> jail;
+  const auto add = [&jail](const char* opt, const std::string& value) {
+    if (!value.empty()) jail.push_back(opt + value);
+  };
+  add("--uids=", get_str(spec, "uids"));
+  add("--template=", get_str(spec, "template"));
+  add("--rootdir=", get_str(spec, "rootdir"));
+  add("--mount=", boost::algorithm::join(get_str_array(spec, "mounts"), ","));
+  add("--rwmount=",
+      boost::algorithm::join(get_str_array(spec, "rwmounts"), ","));
+  add("--devices=",
+      boost::algorithm::join(get_str_array(spec, "devices"), ","));
+  add("--chdir=", get_str(spec, "chdir"));
+  // ルートディレクトリの中の tmpfs にも、作業ディレクトリの tmpfs と同じ制限をかける
+  if (x.tmpfs_size > 0) add("--tmpfs-size=", std::to_string(x.tmpfs_size));
+  if (x.tmpfs_inodes > 0)
+    add("--tmpfs-inodes=", std::to_string(x.tmpfs_inodes));
+
+  x.jail_command = {exe};
+  for (const auto& e : get_str_array(spec, "env")) {
+    x.jail_command.push_back("--env=" + e);
+  }
+  if (find(spec, "nice")) {
+    x.jail_command.push_back("--nice=" + std::to_string(get_int(spec, "nice")));
+  }
+  // int に収まらない値があるので "as=2147483648" のような文字列で書く
+  for (const auto& r : get_str_array(spec, "rlimits")) {
+    x.jail_command.push_back("--rlimit=" + r);
+  }
+
+  const std::string socket = get_str(spec, "zygote-socket");
+  if (socket.empty()) {
+    x.jail_command.insert(x.jail_command.end(), jail.begin(), jail.end());
+  } else {
+    x.jail_command.push_back("--attach=" + socket);
+    // zygote-command が書かれていればそちらを使う
+    if (x.zygote_command.empty()) {
+      x.zygote_command = {exe, "--zygote=" + socket};
+      if (find(spec, "zygote-pool")) {
+        x.zygote_command.push_back(
+            "--zygote-pool=" + std::to_string(get_int(spec, "zygote-pool")));
+      }
+      if (find(spec, "netns-reuse")) {
+        x.zygote_command.push_back(
+            "--netns-reuse=" + std::to_string(get_int(spec, "netns-reuse")));
+      }
+      x.zygote_command.insert(x.zygote_command.end(), jail.begin(),
+                              jail.end());
+    }
+  }
+  x.jail_command.push_back("--");
 }
+}  // namespace
 
 std::unordered_map<std::string, jail_config> load_jail_config(
     const cfg::value& values) {
   using namespace detail;
   std::unordered_map<std::string, jail_config> ret;
-  for (const auto& p :
-       boost::get<cfg::object>(boost::get<cfg::object>(values).at("jail"))) {
+  const auto& root = boost::get<cfg::object>(values);
+  const auto& system = boost::get<cfg::object>(root.at("system"));
+  for (const auto& p : boost::get<cfg::object>(root.at("jail"))) {
     const auto& o = boost::get<cfg::object>(p.second);
     jail_config x;
     x.jail_command = get_str_array(o, "jail-command");
@@ -297,6 +549,20 @@ std::unordered_map<std::string, jail_config> load_jail_config(
     x.kill_wait = get_int(o, "kill-wait");
     x.output_limit_kill = get_int(o, "output-limit-kill");
     x.output_limit_warn = get_int(o, "output-limit-warn");
+    x.max_running_jobs = get_int(o, "max-running-jobs");
+    x.cgroup_memory_max = get_int(o, "cgroup-memory-max");
+    x.cgroup_cpu_max = get_int(o, "cgroup-cpu-max");
+    x.cgroup_pids_max = get_int(o, "cgroup-pids-max");
+    x.cgroup_io_weight = get_int(o, "cgroup-io-weight");
+    x.tmpfs_size = get_int(o, "tmpfs-size");
+    x.tmpfs_inodes = get_int(o, "tmpfs-inodes");
+    x.zygote_command = get_str_array(o, "zygote-command");
+    x.single_sandbox = get_bool(o, "single-sandbox");
+    // jail-spec があれば jail-command より優先する
+    if (const auto v = find(o, "jail-spec")) {
+      load_jail_spec(p.first, boost::get<cfg::object>(*v),
+                     get_str(system, "cattlegrid"), x);
+    }
     ret[p.first] = std::move(x);
   }
   return ret;
@@ -351,101 +617,23 @@ std::unordered_map<std::string, template_trait> load_templates(
   return ret;
 }
 
-struct read_fd_iterator {
-  typedef std::input_iterator_tag iterator_category;
-  typedef char value_type;
-  typedef std::ptrdiff_t difference_type;
-  typedef const char* pointer;
-  typedef const char& reference;
-  explicit read_fd_iterator(int fd = -1) : buf(), off(), gone(), fd(fd) {
-    fetch();
-  }
-  read_fd_iterator operator++(int) {
-    auto tmp = *this;
-    ++*this;
-    return tmp;
-  }
-  read_fd_iterator& operator++() {
-    ++off;
-    ++gone;
-    fetch();
-    return *this;
-  }
-  const char& operator*() const { return buf[off]; }
-  bool operator==(const read_fd_iterator& o) const {
-    return (fd == -1 && o.fd == -1) || (fd == o.fd && gone == o.gone);
-  }
-  bool operator!=(const read_fd_iterator& o) const { return !(*this == o); }
-
- private:
-  void fetch() {
-    if (fd == -1) return;
-    if (off == buf.size()) {
-      buf.resize(BUFSIZ);
-      const auto r = ::read(fd, buf.data(), buf.size());
-      if (r == 0) {
-        fd = -1;
-        off = 0;
-        return;
-      }
-      if (r < 0) throw_system_error(errno);
-      buf.resize(r);
-      off = 0;
-    }
-  }
-  std::vector<char> buf;
-  std::size_t off;
-  std::size_t gone;
-  int fd;
-};
-
-template <typename Iter>
-struct parse_config_error : std::runtime_error {
-  parse_config_error(const std::string& file,
-                     const boost::spirit::qi::expectation_failure<Iter>& e)
-      : std::runtime_error(make_what(file, e)) {}
-  static std::string make_what(
-      const std::string& file,
-      const boost::spirit::qi::expectation_failure<Iter>& e) {
-    const auto advance_for = [](Iter first, std::ptrdiff_t maxlen,
-                                Iter last) -> Iter {
-      for (std::ptrdiff_t n = 0; n < maxlen && first != last; ++first, ++n)
-        ;
-      return first;
-    };
-    std::stringstream ss;
-    ss << "parse error in file " << file << ":" << get_line(e.first)
-       << "\nwhile expecting " << e.what_ << "\nbut got "
-       << std::string(e.first, advance_for(e.first, 128, e.last));
-    return ss.str();
-  }
-};
-
 cfg::value read_single_config_file(const std::shared_ptr<DIR>& at,
                                    const std::string& cfg) {
   SPDLOG_INFO("reading {}", cfg);
-  namespace s = boost::spirit;
-  namespace qi = boost::spirit::qi;
-  typedef s::multi_pass<
-      read_fd_iterator,
-      s::iterator_policies::default_policy<
-          s::iterator_policies::ref_counted, s::iterator_policies::no_check,
-          s::iterator_policies::input_iterator,
-          s::iterator_policies::split_std_deque>>
-      functor_multi_pass_type;
   auto fd = unique_fd(::openat(dirfd_or_cwd(at), cfg.c_str(), O_RDONLY));
   if (fd.get() == -1) throw_system_error(errno);
-  s::line_pos_iterator<functor_multi_pass_type> first(
-      functor_multi_pass_type(read_fd_iterator(fd.get())));
-  s::line_pos_iterator<functor_multi_pass_type> last;
-  cfg::value o;
-  try {
-    qi::phrase_parse(first, last, cfg::config_grammar<decltype(first)>(),
-                     qi::space, o);
-  } catch (qi::expectation_failure<decltype(first)>& e) {
-    throw parse_config_error<decltype(first)>(cfg, e);
+  struct stat st;
+  if (::fstat(fd.get(), &st) < 0) throw_system_error(errno);
+  // 空のファイルは mmap できないので、パーサに渡さずにここで返す
+  if (st.st_size == 0) {
+    return cfg::value();
   }
-  return o;
+  void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if (p == MAP_FAILED) throw_system_error(errno);
+  const std::unique_ptr<void, std::function<void(void*)>> mapped(
+      p, [size = st.st_size](void* p) { ::munmap(p, size); });
+  const char* first = static_cast<const char*>(p);
+  return cfg::config_parser(cfg, first, first + st.st_size).parse();
 }
 
 std::vector<cfg::value> read_config_file(const std::shared_ptr<DIR>& at,
@@ -512,14 +700,22 @@ cfg::value merge_cfgs(const std::vector<cfg::value>& cfgs) {
 }
 
 server_config load_config(const std::vector<std::string>& cfgs) {
+  const auto start = std::chrono::steady_clock::now();
   std::vector<cfg::value> os;
   for (const auto& c : cfgs) {
     const auto x = read_config_file(nullptr, c);
     os.insert(os.end(), x.begin(), x.end());
   }
   const auto o = merge_cfgs(os);
-  return {load_system_config(o), load_jail_config(o), load_compiler_trait(o),
-          load_switches(o), load_templates(o)};
+  server_config config{load_system_config(o), load_jail_config(o),
+                       load_compiler_trait(o), load_switches(o),
+                       load_templates(o)};
+  SPDLOG_INFO("loaded {} config files ({} compilers) in {} ms", os.size(),
+              config.compilers.size(),
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count());
+  return config;
 }
 
 template <typename Iter>
@@ -53,6 +53,8 @@ struct compiler_trait {
   bool compiler_option_raw;
   bool runtime_option_raw;
   std::vector<std::string> templates;
+  // コンパイル結果をキャッシュしても良いコンパイラかどうか
+  bool compile_cache;
 };
 typedef mendex::multi_index_container<
     compiler_trait,
@@ -77,15 +79,65 @@ struct system_config {
   int max_connections;
   std::string basedir;
   std::string storedir;
+  // 空ならコンパイル結果をキャッシュしない
+  std::string compile_cache_dir;
+  // MB 単位
+  int compile_cache_size;
+  // version-command を同時に実行する数。0 なら CPU 数
+  int version_probe_concurrency;
+  // version-command のタイムアウト（秒）。0 なら 10 秒
+  int version_probe_timeout;
+  // バージョンの取得結果を保存するファイル。空なら保存しない
+  std::string version_cache_file;
+  // ジョブごとの cgroup を作るディレクトリ（委譲された cgroup v2）。空なら cgroup を使わない
+  std::string cgroup_root;
+  // 作業ディレクトリに tmpfs をマウントするのに使う cattlegrid のパス
+  std::string cattlegrid;
+  // 事前に作っておく作業ディレクトリの数
+  int workdir_pool_size;
+  // 使い終わった作業ディレクトリを１秒間に削除する数。0 なら制限無し
+  int workdir_reclaim_rate;
+  // ディスクの使用率（%）がこれを超えたら作業ディレクトリを制限無しで削除する。0 なら常に制限する
+  int workdir_disk_usage_max;
+  // storedir に書く実行ログのセグメントの大きさ（MB）
+  int run_log_segment_size;
+  // 実行ログのソースを zstd で圧縮するか
+  bool run_log_compression;
+  // cattlegrid がサンドボックスの準備にかけた時間の集計を書き込むファイル。空なら集計しない
+  std::string jail_timing_file;
 };
 
 struct jail_config {
+  // jail-spec が書かれている場合は、そこから作った cattlegrid のコマンド
   std::vector<std::string> jail_command;
   int program_duration;
   int compile_time_limit;
   int kill_wait;
   int output_limit_kill;
   int output_limit_warn;
+  // この jail で同時に実行できるジョブの数。0 なら制限無し
+  int max_running_jobs;
+  // 以下はジョブ全体に対する cgroup v2 の制限。0 なら制限無し
+  // メモリ（MiB）
+  int cgroup_memory_max;
+  // CPU 時間の割合（100 で CPU 1 個分）
+  int cgroup_cpu_max;
+  // プロセス数
+  int cgroup_pids_max;
+  // I/O の重み（1〜10000）
+  int cgroup_io_weight;
+  // 作業ディレクトリに使う tmpfs の大きさ（MiB）。0 ならディスク上に作る。
+  // cattlegrid はビルド時の CATTLESHED_BASEDIR の下にしかマウントしないので、basedir はそれに合わせること
+  int tmpfs_size;
+  // tmpfs のファイル数の上限。0 ならカーネルのデフォルト
+  int tmpfs_inodes;
+  // 準備済みのサンドボックスを待たせておく cattlegrid --zygote のコマンド。空なら起動しない。
+  // jail-command の方は cattlegrid --attach で同じソケットに接続すること。
+  // jail-spec に zygote-socket が書かれていれば、書かなくても作られる
+  std::vector<std::string> zygote_command;
+  // コンパイルと実行を同じサンドボックスで行う（cattlegrid --session）。
+  // jail-command に system.cattlegrid が含まれていなければ使わない
+  bool single_sandbox;
 };
 
 struct server_config {
@@ -1,19 +1,41 @@
 #ifndef POSIXAPI_HPP_
 #define POSIXAPI_HPP_
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
 #include <system_error>
 #include <vector>
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <linux/sched.h>
+
+#include "session_phase.h"
+
+// glibc 2.39 から pidfd_spawn と posix_spawnattr_setcgroup_np が使える
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 39))
+#include <sys/pidfd.h>
+#define CATTLESHED_HAVE_PIDFD_SPAWN 1
+#else
+#define CATTLESHED_HAVE_PIDFD_SPAWN 0
+#endif
+
 namespace wandbox {
 struct unique_fd {
   explicit unique_fd(int fd) : fd(fd) {}
@@ -27,7 +49,7 @@ struct unique_fd {
     return *this;
   }
   int get() const noexcept { return fd; }
-  explicit operator bool() const noexcept { return fd != 1; }
+  explicit operator bool() const noexcept { return fd != -1; }
   bool operator!() const noexcept { return fd == -1; }
   int release() {
     int r = fd;
@@ -165,6 +187,178 @@ inline std::shared_ptr<DIR> mkdir_p_open_at(const std::shared_ptr<DIR>& at,
   return move(dirfds.back());
 }
 
+// remove_tree_at や copy_tree_at が辿るディレクトリの深さの上限。
+// サンドボックスの中ではディレクトリをいくらでも深く作れるので、
+// これより深いものは ELOOP で失敗させる。
+constexpr std::size_t tree_depth_max = 256;
+
+// fd をディレクトリとして開き直す。失敗したら fd を閉じて例外を投げる
+inline std::shared_ptr<DIR> fdopendir_or_close(int fd) {
+  DIR* d = ::fdopendir(fd);
+  if (!d) {
+    const int err = errno;
+    ::close(fd);
+    throw_system_error(err);
+  }
+  return std::shared_ptr<DIR>(d, &::closedir);
+}
+
+// at からの相対パス name 以下を全て削除する（rm -rf 相当）
+// シンボリックリンクは辿らない。name が存在しない場合は何もしない。
+// 再帰せずに、開いているディレクトリを stack に積んで辿る。
+inline void remove_tree_at(int at, const std::string& name) {
+  struct frame {
+    std::shared_ptr<DIR> dir;
+    std::string name;
+  };
+  std::vector<frame> stack;
+  // parent/n がディレクトリなら開いて積む。それ以外は削除する
+  const auto enter = [&stack](int parent, const std::string& n) {
+    const int fd = ::openat(parent, n.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+      if (errno == ENOENT) return;
+      if (errno != ENOTDIR && errno != ELOOP) throw_system_error(errno);
+      if (::unlinkat(parent, n.c_str(), 0) < 0 && errno != ENOENT)
+        throw_system_error(errno);
+      return;
+    }
+    if (stack.size() >= tree_depth_max) {
+      ::close(fd);
+      throw_system_error(ELOOP);
+    }
+    stack.push_back({fdopendir_or_close(fd), n});
+  };
+
+  enter(at, name);
+  while (!stack.empty()) {
+    DIR* dir = stack.back().dir.get();
+    if (const auto ent = ::readdir(dir)) {
+      if (::strcmp(ent->d_name, ".") == 0 || ::strcmp(ent->d_name, "..") == 0)
+        continue;
+      enter(::dirfd(dir), ent->d_name);
+      continue;
+    }
+    // 中身を全て消したので、親から削除する
+    const std::string n = std::move(stack.back().name);
+    stack.pop_back();
+    const int parent = stack.empty() ? at : ::dirfd(stack.back().dir.get());
+    if (::unlinkat(parent, n.c_str(), AT_REMOVEDIR) < 0 && errno != ENOENT)
+      throw_system_error(errno);
+  }
+}
+
+// src_at/src のシンボリックリンクか通常ファイルを dst_at/dst にコピーして、
+// コピーしたサイズを返す。st は src を fstatat した結果。それ以外の種類はコピーしない。
+inline std::uint64_t copy_file_at(int src_at, const std::string& src,
+                                  struct stat st, int dst_at,
+                                  const std::string& dst) {
+  if (S_ISLNK(st.st_mode)) {
+    std::vector<char> buf(st.st_size + 1);
+    const auto n = ::readlinkat(src_at, src.c_str(), buf.data(), buf.size());
+    if (n < 0) throw_system_error(errno);
+    buf[n] = 0;
+    if (::symlinkat(buf.data(), dst_at, dst.c_str()) < 0)
+      throw_system_error(errno);
+    return n;
+  }
+
+  if (!S_ISREG(st.st_mode)) return 0;
+
+  // fstatat の後に FIFO やシンボリックリンクに差し替えられていることがあるので、
+  // 開いたものをもう一度確かめて、通常ファイルでなければコピーしない
+  const unique_fd in(::openat(src_at, src.c_str(),
+                              O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC));
+  if (!in) {
+    if (errno == ELOOP) return 0;
+    throw_system_error(errno);
+  }
+  if (::fstat(in.get(), &st) < 0) throw_system_error(errno);
+  if (!S_ISREG(st.st_mode)) return 0;
+  const unique_fd out(::openat(dst_at, dst.c_str(),
+                               O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                               (st.st_mode & 0777) | 0600));
+  if (!out) throw_system_error(errno);
+  std::vector<char> buf(65536);
+  std::uint64_t total = 0;
+  while (true) {
+    const auto n = ::read(in.get(), buf.data(), buf.size());
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw_system_error(errno);
+    }
+    if (n == 0) break;
+    for (ssize_t off = 0; off < n;) {
+      const auto m = ::write(out.get(), buf.data() + off, n - off);
+      if (m < 0) {
+        if (errno == EINTR) continue;
+        throw_system_error(errno);
+      }
+      off += m;
+    }
+    total += n;
+  }
+  return total;
+}
+
+// src_at/src 以下のディレクトリ、通常ファイル、シンボリックリンクを
+// dst_at/dst 以下にコピーして、コピーしたファイルの合計サイズを返す。
+// filter に src からの相対パスを渡して false が返ってきたものはコピーしない。
+// 再帰せずに、開いているディレクトリを stack に積んで辿る。
+inline std::uint64_t copy_tree_at(
+    int src_at, const std::string& src, int dst_at, const std::string& dst,
+    const std::function<bool(const std::string&)>& filter) {
+  struct frame {
+    std::shared_ptr<DIR> src;
+    unique_fd dst;
+    std::string relpath;
+  };
+  std::vector<frame> stack;
+  std::uint64_t total = 0;
+  // ディレクトリなら dst に作って積む。それ以外はコピーする
+  const auto enter = [&stack, &total](int sat, const std::string& s, int dat,
+                                      const std::string& d,
+                                      const std::string& relpath) {
+    struct stat st;
+    if (::fstatat(sat, s.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0)
+      throw_system_error(errno);
+    if (!S_ISDIR(st.st_mode)) {
+      total += copy_file_at(sat, s, st, dat, d);
+      return;
+    }
+    if (stack.size() >= tree_depth_max) throw_system_error(ELOOP);
+
+    if (::mkdirat(dat, d.c_str(), (st.st_mode & 0777) | 0700) < 0 &&
+        errno != EEXIST)
+      throw_system_error(errno);
+    unique_fd dstfd(
+        ::openat(dat, d.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!dstfd) throw_system_error(errno);
+    const int srcfd = ::openat(sat, s.c_str(),
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (srcfd == -1) throw_system_error(errno);
+    stack.push_back({fdopendir_or_close(srcfd), std::move(dstfd), relpath});
+  };
+
+  enter(src_at, src, dst_at, dst, "");
+  while (!stack.empty()) {
+    frame& top = stack.back();
+    const auto ent = ::readdir(top.src.get());
+    if (!ent) {
+      stack.pop_back();
+      continue;
+    }
+    if (::strcmp(ent->d_name, ".") == 0 || ::strcmp(ent->d_name, "..") == 0)
+      continue;
+    const std::string path =
+        top.relpath.empty() ? ent->d_name : top.relpath + "/" + ent->d_name;
+    if (filter && !filter(path)) continue;
+    enter(::dirfd(top.src.get()), ent->d_name, top.dst.get(), ent->d_name,
+          path);
+  }
+  return total;
+}
+
 inline std::string mkdtemp(const std::string& base) {
   std::vector<char> buf(base.begin(), base.end());
   buf.push_back(0);
@@ -178,9 +372,10 @@ inline void chdir(const std::shared_ptr<DIR>& workdir) {
   if (::fchdir(fd) == -1) throw_system_error(errno);
 }
 
+// 他のスレッドで起動した子プロセスに漏れないように O_CLOEXEC で作る
 inline unique_pipe pipe() {
   int p[2];
-  if (::pipe(p) < 0) throw_system_error(errno);
+  if (::pipe2(p, O_CLOEXEC) < 0) throw_system_error(errno);
   return {unique_fd(p[0]), unique_fd(p[1])};
 }
 
@@ -211,18 +406,22 @@ __attribute__((returns_twice)) inline pid_t fork() {
 }
 
 struct unique_child_pid {
-  explicit unique_child_pid(pid_t pid = 0) : pid(pid), st(0), waited(false) {}
+  explicit unique_child_pid(pid_t pid = 0)
+      : pid(pid), st(0), waited(false), ru() {}
   unique_child_pid(const unique_child_pid&) = delete;
-  unique_child_pid(unique_child_pid&& other) : pid(0), st(0), waited(false) {
+  unique_child_pid(unique_child_pid&& other)
+      : pid(0), st(0), waited(false), ru() {
     std::swap(pid, other.pid);
     std::swap(st, other.st);
     std::swap(waited, other.waited);
+    std::swap(ru, other.ru);
   }
   unique_child_pid& operator=(const unique_child_pid&) = delete;
   unique_child_pid& operator=(unique_child_pid&& other) {
     std::swap(pid, other.pid);
     std::swap(st, other.st);
     std::swap(waited, other.waited);
+    std::swap(ru, other.ru);
     if (pid != other.pid) other.do_wait();
     other.pid = 0;
     other.st = 0;
@@ -235,51 +434,282 @@ struct unique_child_pid {
   pid_t get() const noexcept { return pid; }
   bool finished() const noexcept { return waited; }
   bool empty() const noexcept { return pid == 0; }
+  // 終了したプロセス（と、そのプロセスが wait した子孫）のリソース使用量
+  const struct rusage& usage() const noexcept { return ru; }
 
  private:
   int do_wait(int flag = 0) {
     if (waited) return st;
     if (pid == 0) return 0;
-    if (::waitpid(pid, &st, flag) <= 0) return 0;
+    if (::wait4(pid, &st, flag, &ru) <= 0) return 0;
     waited = true;
     return st;
   }
   pid_t pid;
   int st;
   bool waited;
+  struct rusage ru;
 };
 
+// 子プロセスの終了を待つための pidfd を開く。
+// カーネルが pidfd_open(2) に対応していない場合は無効な fd を返す。
+inline unique_fd pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return unique_fd(::syscall(SYS_pidfd_open, pid, 0));
+#else
+  errno = ENOSYS;
+  return unique_fd(-1);
+#endif
+}
+
+inline int pidfd_send_signal(int pidfd, int signo) {
+#ifdef SYS_pidfd_send_signal
+  return ::syscall(SYS_pidfd_send_signal, pidfd, signo, nullptr, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// cgroup_fd で指定した cgroup の中で子プロセスを作る。
+// clone3(2) の CLONE_INTO_CGROUP が使える場合は、最初から cgroup の中で作られるので、
+// 子プロセスが cgroup の外で何かを実行してしまう隙間が無い。
+// 使えない場合は fork して、子プロセス側で自分を cgroup.procs に書き込む。
+// pidfd にはプロセスの終了を待つための pidfd が入る（取れなかった場合は無効な fd）。
+__attribute__((returns_twice)) inline pid_t fork_into_cgroup(int cgroup_fd,
+                                                             unique_fd& pidfd) {
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+  int child_pidfd = -1;
+  struct clone_args args;
+  ::memset(&args, 0, sizeof(args));
+  args.flags = CLONE_INTO_CGROUP | CLONE_PIDFD;
+  args.pidfd = (std::uint64_t)(std::uintptr_t)&child_pidfd;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = (std::uint64_t)cgroup_fd;
+  const long ret = ::syscall(SYS_clone3, &args, sizeof(args));
+  if (ret > 0) {
+    pidfd.reset(child_pidfd);
+    return (pid_t)ret;
+  }
+  if (ret == 0) {
+    return 0;
+  }
+  // 古いカーネルなので fork にフォールバックする
+  if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+    throw_system_error(errno);
+  }
+#endif
+  const pid_t pid = fork();
+  if (pid == 0) {
+    // 子プロセス側なので、async-signal-safe な関数しか使わない
+    const int fd = ::openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || ::write(fd, "0", 1) != 1) {
+      ::_exit(127);
+    }
+    ::close(fd);
+    return 0;
+  }
+  // まだ wait していないので pid が再利用されることは無い
+  pidfd = pidfd_open(pid);
+  return pid;
+}
+
 struct child_process {
   unique_child_pid pid;
   unique_fd fd_stdin;
   unique_fd fd_stdout;
   unique_fd fd_stderr;
+  unique_fd pidfd;
+};
+
+// posix_spawn に渡す argv を、呼び出す前に作っておくためのもの
+struct spawn_argv {
+  explicit spawn_argv(const std::vector<std::string>& argv) {
+    for (const auto& s : argv)
+      buf.emplace_back(s.c_str(), s.c_str() + s.length() + 1);
+    for (auto& s : buf) ptrs.emplace_back(s.data());
+    ptrs.push_back(nullptr);
+  }
+  spawn_argv(const spawn_argv&) = delete;
+  spawn_argv& operator=(const spawn_argv&) = delete;
+  const char* path() const { return buf.front().data(); }
+  char* const* get() const { return ptrs.data(); }
+
+ private:
+  std::vector<std::vector<char>> buf;
+  std::vector<char*> ptrs;
 };
 
+// 標準入出力の付け替えと chdir を posix_spawn のファイルアクションで行う。
+// fd_extra が有効なら fd 3 に付け替える
+struct spawn_file_actions {
+  spawn_file_actions(int dirfd, int fd_stdin, int fd_stdout, int fd_stderr,
+                     int fd_extra = -1) {
+    ::posix_spawn_file_actions_init(&fa);
+    ::posix_spawn_file_actions_addfchdir_np(&fa, dirfd);
+    // 元の fd は O_CLOEXEC なので exec で閉じられる
+    ::posix_spawn_file_actions_adddup2(&fa, fd_stdin, 0);
+    ::posix_spawn_file_actions_adddup2(&fa, fd_stdout, 1);
+    ::posix_spawn_file_actions_adddup2(&fa, fd_stderr, 2);
+    if (fd_extra >= 0) {
+      ::posix_spawn_file_actions_adddup2(&fa, fd_extra, 3);
+    }
+  }
+  ~spawn_file_actions() { ::posix_spawn_file_actions_destroy(&fa); }
+  spawn_file_actions(const spawn_file_actions&) = delete;
+  spawn_file_actions& operator=(const spawn_file_actions&) = delete;
+  posix_spawn_file_actions_t fa;
+};
+
+// argv を実行して終了を待ち、終了ステータスを返す。
+// 標準入出力はそのまま引き継ぐ。
+inline int spawn_and_wait(const std::vector<std::string>& argv) {
+  const spawn_argv args(argv);
+  pid_t pid;
+  const int r =
+      ::posix_spawn(&pid, args.path(), nullptr, nullptr, args.get(), environ);
+  if (r != 0) throw_system_error(r);
+  int st;
+  while (::waitpid(pid, &st, 0) < 0) {
+    if (errno != EINTR) throw_system_error(errno);
+  }
+  return st;
+}
+
+// 標準入出力をそのまま引き継いで実行する。wait は呼び出し側で行うこと。
+// cgroup_fd が有効なら、その cgroup の中で実行する
+inline pid_t spawn_detached(const std::vector<std::string>& argv,
+                            int cgroup_fd, unique_fd& pidfd) {
+  const spawn_argv args(argv);
+  if (cgroup_fd < 0) {
+    pid_t pid;
+    const int r =
+        ::posix_spawn(&pid, args.path(), nullptr, nullptr, args.get(), environ);
+    if (r != 0) throw_system_error(r);
+    pidfd = pidfd_open(pid);
+    return pid;
+  }
+  const auto pid = fork_into_cgroup(cgroup_fd, pidfd);
+  if (pid == 0) {
+    ::execve(args.path(), args.get(), environ);
+    ::_exit(127);
+  }
+  return pid;
+}
+
+// workdir で argv を実行する。標準入出力は fd_stdin, fd_stdout, fd_stderr に付け替える。
+// fd_extra が有効なら、fd 3 として渡す。
+// cgroup_fd が有効なら、その cgroup の中で実行する。
+// pidfd にはプロセスの終了を待つための pidfd が入る（取れなかった場合は無効な fd）。
+//
+// fork だと cattleshed のメモリが増えるほどページテーブルのコピーに時間がかかるので、
+// glibc の posix_spawn（CLONE_VM | CLONE_VFORK で子プロセスを作る）を使う。
+// glibc 2.39 以降なら pidfd_spawn で cgroup の指定と pidfd の取得も同時に行う。
+// それ以外で cgroup を指定された場合は、今まで通り fork_into_cgroup を使う。
+inline pid_t spawn_with_fds(const std::shared_ptr<DIR>& workdir,
+                            const std::vector<std::string>& argv, int fd_stdin,
+                            int fd_stdout, int fd_stderr, int cgroup_fd,
+                            unique_fd& pidfd, int fd_extra = -1) {
+  const spawn_argv args(argv);
+  const spawn_file_actions actions(::dirfd(workdir.get()), fd_stdin, fd_stdout,
+                                   fd_stderr, fd_extra);
+
+#if CATTLESHED_HAVE_PIDFD_SPAWN
+  {
+    posix_spawnattr_t attr;
+    ::posix_spawnattr_init(&attr);
+    if (cgroup_fd >= 0) {
+      ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETCGROUP);
+      ::posix_spawnattr_setcgroup_np(&attr, cgroup_fd);
+    }
+    int fd = -1;
+    const int r = ::pidfd_spawn(&fd, args.path(), &actions.fa, &attr,
+                                args.get(), environ);
+    ::posix_spawnattr_destroy(&attr);
+    if (r == 0) {
+      pidfd.reset(fd);
+      return ::pidfd_getpid(fd);
+    }
+    // カーネルが clone3 や CLONE_INTO_CGROUP に対応していなければ下にフォールバックする
+    if (r != ENOSYS && r != EINVAL && r != EOPNOTSUPP) {
+      throw_system_error(r);
+    }
+  }
+#endif
+
+  if (cgroup_fd < 0) {
+    pid_t pid;
+    const int r = ::posix_spawn(&pid, args.path(), &actions.fa, nullptr,
+                                args.get(), environ);
+    if (r != 0) throw_system_error(r);
+    // まだ wait していないので pid が再利用されることは無い
+    pidfd = pidfd_open(pid);
+    return pid;
+  }
+
+  const auto pid = fork_into_cgroup(cgroup_fd, pidfd);
+  if (pid == 0) {
+    // 子プロセス側なので、async-signal-safe な関数しか使わない
+    if (::fchdir(::dirfd(workdir.get())) < 0 || ::dup2(fd_stdin, 0) < 0 ||
+        ::dup2(fd_stdout, 1) < 0 || ::dup2(fd_stderr, 2) < 0 ||
+        (fd_extra >= 0 && ::dup2(fd_extra, 3) < 0)) {
+      ::_exit(127);
+    }
+    ::execve(args.path(), args.get(), environ);
+    ::_exit(127);
+  }
+  return pid;
+}
+
+// 標準入出力をパイプにして実行する
 inline child_process piped_spawn(const std::shared_ptr<DIR>& workdir,
-                                 const std::vector<std::string>& argv) {
+                                 const std::vector<std::string>& argv,
+                                 int cgroup_fd = -1, int fd_extra = -1) {
   auto pipe_stdin = pipe();
   auto pipe_stdout = pipe();
   auto pipe_stderr = pipe();
-  if (const auto pid = fork()) {
-    return {unique_child_pid(pid), std::move(pipe_stdin.w),
-            std::move(pipe_stdout.r), std::move(pipe_stderr.r)};
-  } else
-    try {
-      chdir(workdir);
-      dup2(pipe_stdin.r, 0);
-      dup2(pipe_stdout.w, 1);
-      dup2(pipe_stderr.w, 2);
-      pipe_stdin.r.reset();
-      pipe_stdin.w.reset();
-      pipe_stdout.r.reset();
-      pipe_stdout.w.reset();
-      pipe_stderr.r.reset();
-      pipe_stderr.w.reset();
-      execv(argv);
-    } catch (...) {
-      std::terminate();
-    }
+  unique_fd pidfd(-1);
+  const pid_t pid =
+      spawn_with_fds(workdir, argv, pipe_stdin.r.get(), pipe_stdout.w.get(),
+                     pipe_stderr.w.get(), cgroup_fd, pidfd, fd_extra);
+  return {unique_child_pid(pid), std::move(pipe_stdin.w),
+          std::move(pipe_stdout.r), std::move(pipe_stderr.r),
+          std::move(pidfd)};
+}
+
+// cattlegrid --session とのやりとり
+//
+// 制御用のソケット（SOCK_SEQPACKET）に、フェーズごとのコマンドを１つのメッセージで送る。
+// 中身は u32 の引数の数と、u32 の長さ + 引数の文字列を繰り返したもので、
+// 標準入力、標準出力、標準エラー出力の３つの fd を SCM_RIGHTS で付ける。
+// 実行が終わると session_phase_result（session_phase.h）が返ってくる。
+
+inline void send_session_phase(int sock, const std::vector<std::string>& argv,
+                               int fd_stdin, int fd_stdout, int fd_stderr) {
+  std::string data;
+  const auto put = [&data](std::uint32_t v) {
+    data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  };
+  put(argv.size());
+  for (const auto& s : argv) {
+    put(s.size());
+    data += s;
+  }
+  const int fds[] = {fd_stdin, fd_stdout, fd_stderr};
+  char control[CMSG_SPACE(sizeof(fds))];
+  ::memset(control, 0, sizeof(control));
+  struct iovec iov = {&data[0], data.size()};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  ::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  if (::sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) throw_system_error(errno);
 }
 }  // namespace wandbox
 #endif
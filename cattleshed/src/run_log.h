@@ -0,0 +1,264 @@
+#ifndef RUN_LOG_H_INCLUDED
+#define RUN_LOG_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Linux
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Boost
+#include <boost/asio.hpp>
+
+// OpenSSL
+#include <openssl/evp.h>
+
+// protobuf
+#include <google/protobuf/io/coded_stream.h>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#if CATTLESHED_HAVE_ZSTD
+// zstd
+#include <zstd.h>
+#endif
+
+#include "posixapi.hpp"
+#include "run_log.pb.h"
+
+// 実行ログ
+//
+// ジョブの情報とソースを storedir 以下のセグメントファイルに追記していく。
+// ソースは内容の SHA-256 をキーにして、同じセグメントの中では一度しか書かない。
+// セグメントの中だけで完結しているので、古いセグメントはそのまま消して構わない。
+//
+// ディレクトリの構成:
+//   <dir>/<seq>.log  varint の長さ + RunLogRecord を繰り返したもの
+//   <dir>/<seq>.idx  "J\t<job_id>\t<offset>" と "B\t<hash>\t<offset>" の行。
+//                    job_id からレコードの位置を探すのに使う
+//
+// セグメントが segment_size を超えたら次の番号のセグメントに切り替える。
+// 起動時は前回のセグメントの末尾が壊れている可能性があるので、必ず新しいセグメントから始める。
+class RunLog : public std::enable_shared_from_this<RunLog> {
+ public:
+  RunLog(std::string dir, std::uint64_t segment_size, bool compress,
+         std::shared_ptr<boost::asio::thread_pool> pool)
+      : dir_(std::move(dir)),
+        segment_size_(segment_size),
+        compress_(compress),
+        pool_(std::move(pool)) {}
+
+  void Load() {
+    wandbox::mkdir_p_open_at(nullptr, dir_, 0700);
+    const auto dir = wandbox::opendir(dir_);
+    for (auto ent = ::readdir(dir.get()); ent; ent = ::readdir(dir.get())) {
+      char* end;
+      const auto seq = std::strtoull(ent->d_name, &end, 10);
+      if (end != ent->d_name && std::string(end) == ".log") {
+        next_seq_ = std::max<std::uint64_t>(next_seq_, seq + 1);
+      }
+    }
+#if !CATTLESHED_HAVE_ZSTD
+    if (compress_) {
+      SPDLOG_WARN("run log: built without zstd, compression is disabled");
+      compress_ = false;
+    }
+#endif
+    SPDLOG_INFO("run log loaded: dir={} next_segment={}", dir_, next_seq_);
+  }
+
+  // req のソースは重複を除いてから書き込む。
+  // default_source は default_file_name という名前のファイルとして扱う。
+  void AsyncAppend(std::string job_id,
+                   wandbox::cattleshed::RunJobRequest::Start req,
+                   std::string default_file_name) {
+    boost::asio::post(*pool_, [self = shared_from_this(),
+                               job_id = std::move(job_id), req = std::move(req),
+                               name = std::move(default_file_name)]() mutable {
+      self->Append(job_id, std::move(req), name);
+    });
+  }
+
+ private:
+  // スレッドプール上で呼ばれる
+  void Append(const std::string& job_id,
+              wandbox::cattleshed::RunJobRequest::Start req,
+              const std::string& default_file_name) {
+    std::vector<std::pair<std::string, std::string>> files;
+    files.emplace_back(default_file_name,
+                       std::move(*req.mutable_default_source()));
+    for (auto& s : *req.mutable_sources()) {
+      files.emplace_back(s.file_name(), std::move(*s.mutable_source()));
+    }
+    req.clear_default_source();
+    req.clear_sources();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!log_fd_ || offset_ >= segment_size_) {
+      if (!OpenSegment()) {
+        return;
+      }
+    }
+
+    std::string buf;
+    std::string index;
+    std::vector<std::string> new_blobs;
+
+    wandbox::cattleshed::RunLogRecord job_rec;
+    auto job = job_rec.mutable_job();
+    job->set_job_id(job_id);
+    job->set_timestamp(::time(nullptr));
+    for (auto& f : files) {
+      const std::string hash = Hash(f.second);
+      auto file = job->add_files();
+      file->set_file_name(f.first);
+      file->set_hash(hash);
+      if (blobs_.count(hash) != 0 ||
+          std::find(new_blobs.begin(), new_blobs.end(), hash) !=
+              new_blobs.end()) {
+        continue;
+      }
+      wandbox::cattleshed::RunLogRecord blob_rec;
+      MakeBlob(hash, std::move(f.second), blob_rec.mutable_blob());
+      index += "B\t" + hash + "\t" + std::to_string(offset_ + buf.size()) +
+               "\n";
+      AppendRecord(blob_rec, &buf);
+      new_blobs.push_back(hash);
+    }
+    *job->mutable_request() = std::move(req);
+    index +=
+        "J\t" + job_id + "\t" + std::to_string(offset_ + buf.size()) + "\n";
+    AppendRecord(job_rec, &buf);
+
+    if (!WriteAll(log_fd_.get(), buf) || !WriteAll(idx_fd_.get(), index)) {
+      SPDLOG_ERROR("run log: failed to write segment {}: errno={}", seq_,
+                   errno);
+      // 途中まで書いてしまったかもしれないので、次は新しいセグメントに書く
+      log_fd_.reset();
+      idx_fd_.reset();
+      return;
+    }
+    offset_ += buf.size();
+    blobs_.insert(new_blobs.begin(), new_blobs.end());
+    SPDLOG_DEBUG("run log: job={} segment={} bytes={} new_blobs={}", job_id,
+                 seq_, buf.size(), new_blobs.size());
+  }
+
+  // mutex_ をロックした状態で呼ぶこと
+  bool OpenSegment() {
+    log_fd_.reset();
+    idx_fd_.reset();
+    blobs_.clear();
+    offset_ = 0;
+    seq_ = next_seq_++;
+
+    char name[32];
+    ::snprintf(name, sizeof(name), "%08llu", (unsigned long long)seq_);
+    const std::string base = dir_ + "/" + name;
+    log_fd_.reset(::open((base + ".log").c_str(),
+                         O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                         0600));
+    if (!log_fd_) {
+      SPDLOG_ERROR("run log: failed to create {}.log: errno={}", base, errno);
+      return false;
+    }
+    idx_fd_.reset(::open((base + ".idx").c_str(),
+                         O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                         0600));
+    if (!idx_fd_) {
+      SPDLOG_ERROR("run log: failed to create {}.idx: errno={}", base, errno);
+      log_fd_.reset();
+      return false;
+    }
+    SPDLOG_INFO("run log: open segment {}", base);
+    return true;
+  }
+
+  void MakeBlob(const std::string& hash, std::string data,
+                wandbox::cattleshed::RunLogBlob* blob) const {
+    blob->set_hash(hash);
+    blob->set_size(data.size());
+#if CATTLESHED_HAVE_ZSTD
+    // 小さいものは圧縮してもあまり意味が無い
+    if (compress_ && data.size() >= 128) {
+      std::string z(::ZSTD_compressBound(data.size()), '\0');
+      const std::size_t n =
+          ::ZSTD_compress(&z[0], z.size(), data.data(), data.size(), 3);
+      if (!::ZSTD_isError(n) && n < data.size()) {
+        z.resize(n);
+        blob->set_compression(wandbox::cattleshed::RunLogBlob::ZSTD);
+        blob->set_data(std::move(z));
+        return;
+      }
+    }
+#endif
+    blob->set_data(std::move(data));
+  }
+
+  static void AppendRecord(const wandbox::cattleshed::RunLogRecord& rec,
+                           std::string* buf) {
+    std::uint8_t len[10];
+    const auto end =
+        google::protobuf::io::CodedOutputStream::WriteVarint64ToArray(
+            rec.ByteSizeLong(), len);
+    buf->append((const char*)len, end - len);
+    rec.AppendToString(buf);
+  }
+
+  static bool WriteAll(int fd, const std::string& buf) {
+    const char* p = buf.data();
+    std::size_t left = buf.size();
+    while (left > 0) {
+      const ssize_t n = ::write(fd, p, left);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      p += n;
+      left -= n;
+    }
+    return true;
+  }
+
+  static std::string Hash(const std::string& data) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen = 0;
+    ::EVP_Digest(data.data(), data.size(), md, &mdlen, ::EVP_sha256(),
+                 nullptr);
+    static const char hex[] = "0123456789abcdef";
+    std::string r;
+    for (unsigned int i = 0; i < mdlen; i++) {
+      r.push_back(hex[md[i] >> 4]);
+      r.push_back(hex[md[i] & 0xf]);
+    }
+    return r;
+  }
+
+  std::string dir_;
+  std::uint64_t segment_size_;
+  bool compress_;
+  std::shared_ptr<boost::asio::thread_pool> pool_;
+
+  std::mutex mutex_;
+  std::uint64_t next_seq_ = 0;
+  std::uint64_t seq_ = 0;
+  std::uint64_t offset_ = 0;
+  wandbox::unique_fd log_fd_{-1};
+  wandbox::unique_fd idx_fd_{-1};
+  // 今のセグメントに書き込み済みのブロブ
+  std::unordered_set<std::string> blobs_;
+};
+
+#endif  // RUN_LOG_H_INCLUDED
@@ -3,6 +3,7 @@
 #include <functional>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -22,7 +23,6 @@
 #include <boost/system/system_error.hpp>
 
 // Linux
-#include <aio.h>
 #include <locale.h>
 #include <sys/eventfd.h>
 #include <time.h>
@@ -41,6 +41,8 @@ int main(int argc, char** argv) try {
   using namespace wandbox;
 
   ::setlocale(LC_ALL, "C");
+  // 以前は aio の完了通知に使っていた名残で、SIGHUP では終了しないようにしておく
+  ::signal(SIGHUP, SIG_IGN);
 
   CLI::App app("cattleshed");
 
@@ -62,6 +64,11 @@ int main(int argc, char** argv) try {
       ->check(CLI::ExistingPath)
       ->required();
 
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  app.add_option("--threads", threads,
+                 "Number of io_context threads (default: number of cores)")
+      ->check(CLI::PositiveNumber);
+
   try {
     app.parse(argc, argv);
   } catch (const CLI::ParseError& e) {
@@ -89,21 +96,35 @@ int main(int argc, char** argv) try {
     return 1;
   }
 
-  auto ioc = std::make_shared<boost::asio::io_context>();
-
-  CattleshedServer server(ioc, config);
-  server.Start("0.0.0.0:" + std::to_string(config.system.listen_port), 1);
+  // basedir に chdir した後に設定を読み直すので、絶対パスにしておく
+  for (auto& path : config_paths) {
+    path = wandbox::realpath(path);
+  }
 
-  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
-      work = boost::asio::make_work_guard(ioc->get_executor());
-  try {
-    ioc->run();
-  } catch (std::exception& e) {
-    SPDLOG_ERROR("fatal: {}", e.what());
-    std::quick_exit(1);
-  } catch (...) {
-    SPDLOG_ERROR("fatal");
-    std::quick_exit(1);
+  CattleshedServer server(config, threads, config_paths);
+  server.Start("0.0.0.0:" + std::to_string(config.system.listen_port),
+               threads);
+
+  // シャードごとに１スレッドで io_context を回す
+  std::vector<std::thread> ths;
+  for (auto ioc : server.GetIoContexts()) {
+    ths.emplace_back([ioc]() {
+      boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+          work = boost::asio::make_work_guard(ioc->get_executor());
+      try {
+        ioc->run();
+      } catch (std::exception& e) {
+        SPDLOG_ERROR("fatal: {}", e.what());
+        std::quick_exit(1);
+      } catch (...) {
+        SPDLOG_ERROR("fatal");
+        std::quick_exit(1);
+      }
+    });
+  }
+  SPDLOG_INFO("running {} io_context threads", ths.size());
+  for (auto& th : ths) {
+    th.join();
   }
   return 0;
 } catch (std::exception& e) {
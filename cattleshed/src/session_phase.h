@@ -0,0 +1,33 @@
+#ifndef SESSION_PHASE_H_INCLUDED
+#define SESSION_PHASE_H_INCLUDED
+
+#include <cstddef>
+#include <type_traits>
+
+#include <sys/resource.h>
+
+namespace wandbox {
+
+// cattleshed と cattlegrid --session の間でやりとりする、フェーズの実行結果。
+// ソケットにそのまま書くので、両方がこのヘッダを使うこと。
+// cattleshed は C++17、cattlegrid は C++14 でビルドするので、どちらでも使える書き方にする。
+struct session_phase_result {
+  // waitpid の status
+  int status;
+  struct rusage usage;
+};
+
+// 中身を変えるとやりとりが壊れるので、形が変わっていないことを確かめておく
+static_assert(std::is_trivially_copyable<session_phase_result>::value,
+              "session_phase_result must be trivially copyable");
+static_assert(offsetof(session_phase_result, status) == 0,
+              "unexpected layout of session_phase_result");
+static_assert(offsetof(session_phase_result, usage) == alignof(struct rusage),
+              "unexpected layout of session_phase_result");
+static_assert(sizeof(session_phase_result) ==
+                  alignof(struct rusage) + sizeof(struct rusage),
+              "unexpected size of session_phase_result");
+
+}  // namespace wandbox
+
+#endif  // SESSION_PHASE_H_INCLUDED
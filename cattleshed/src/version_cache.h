@@ -0,0 +1,266 @@
+#ifndef VERSION_CACHE_H_INCLUDED
+#define VERSION_CACHE_H_INCLUDED
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Linux
+#include <sys/stat.h>
+
+// Boost
+#include <boost/algorithm/string/join.hpp>
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "cattleshed.pb.h"
+#include "load_config.hpp"
+
+// GetVersion の結果のキャッシュ
+//
+// コンパイラごとに、version-command に出てくるファイルの inode/mtime/size を覚えておいて、
+// それが変わったコンパイラだけバージョンを取り直す。
+// 取得したバージョンはファイルに保存しておくので、再起動してもバージョンを取り直す必要は無い。
+// 作ったレスポンスも覚えておいて、バージョンも設定も変わっていなければそのまま返す。
+class VersionCache {
+ public:
+  typedef std::vector<std::pair<std::string, std::string>> Versions;
+  typedef std::function<void(
+      std::shared_ptr<const wandbox::cattleshed::GetVersionResponse>)>
+      Handler;
+
+  // path が空ならファイルには保存しない
+  explicit VersionCache(std::string path) : path_(std::move(path)) {}
+
+  void Load() {
+    if (path_.empty()) {
+      return;
+    }
+    std::ifstream ifs(path_);
+    if (!ifs) {
+      SPDLOG_INFO("version cache not found: {}", path_);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string line;
+    while (std::getline(ifs, line)) {
+      // <name>\t<identity>\t<version>
+      const auto p1 = line.find('\t');
+      if (p1 == std::string::npos) continue;
+      const auto p2 = line.find('\t', p1 + 1);
+      if (p2 == std::string::npos) continue;
+      entries_[line.substr(0, p1)] = {line.substr(p1 + 1, p2 - p1 - 1),
+                                      line.substr(p2 + 1)};
+    }
+    SPDLOG_INFO("version cache loaded: path={} entries={}", path_,
+                entries_.size());
+  }
+
+  // config から最近作ったばかりのレスポンスがあればそれを返す
+  std::shared_ptr<const wandbox::cattleshed::GetVersionResponse> GetFresh(
+      const std::shared_ptr<const wandbox::server_config>& config) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (response_ && response_config_ == config &&
+        std::chrono::steady_clock::now() - validated_ < kRevalidateInterval) {
+      return response_;
+    }
+    return nullptr;
+  }
+
+  // レスポンスの更新を始める。
+  // handler は更新が終わった時に ioc 上で呼ばれる。
+  // 既に他の誰かが更新中なら、その結果を待つことにして false を返す。
+  bool BeginUpdate(std::shared_ptr<boost::asio::io_context> ioc,
+                   Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiters_.push_back({std::move(ioc), std::move(handler)});
+    if (updating_) {
+      return false;
+    }
+    updating_ = true;
+    return true;
+  }
+
+  // ツールチェインが変わった（またはまだバージョンを取得していない）コンパイラの一覧を返す
+  // 返すポインタは config の中を指している
+  std::vector<const wandbox::compiler_trait*> Changed(
+      const wandbox::server_config& config,
+      std::unordered_map<std::string, std::string>* identities) {
+    std::vector<const wandbox::compiler_trait*> changed;
+    for (const wandbox::compiler_trait& c : config.compilers) {
+      if (c.version_command.empty() || not c.displayable) {
+        continue;
+      }
+      (*identities)[c.name] = Identify(c);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const wandbox::compiler_trait& c : config.compilers) {
+      const auto it = identities->find(c.name);
+      if (it == identities->end()) {
+        continue;
+      }
+      const auto it2 = entries_.find(c.name);
+      if (it2 == entries_.end() || it2->second.identity != it->second) {
+        changed.push_back(&c);
+      }
+    }
+    return changed;
+  }
+
+  // 取り直したバージョンを反映して、設定ファイルの順番で全コンパイラのバージョンを返す。
+  // 何も変わってなければ *modified に false が入る。
+  Versions Update(const wandbox::server_config& config,
+                  const std::unordered_map<std::string, std::string>& identities,
+                  const std::vector<const wandbox::compiler_trait*>& probed,
+                  const Versions& probed_versions, bool* modified) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *modified = !probed.empty();
+    for (const auto* c : probed) {
+      // 取得に失敗したものは次回また取り直す
+      entries_.erase(c->name);
+    }
+    for (const auto& v : probed_versions) {
+      entries_[v.first] = {identities.at(v.first), v.second};
+    }
+    // 設定から消えたコンパイラ
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (identities.count(it->first) == 0) {
+        it = entries_.erase(it);
+        *modified = true;
+      } else {
+        ++it;
+      }
+    }
+
+    Versions versions;
+    for (const wandbox::compiler_trait& c : config.compilers) {
+      const auto it = entries_.find(c.name);
+      if (it != entries_.end()) {
+        versions.push_back(std::make_pair(c.name, it->second.version));
+      }
+    }
+    if (*modified) {
+      Save();
+    }
+    return versions;
+  }
+
+  // config から作ったレスポンスがあればそれを返す
+  std::shared_ptr<const wandbox::cattleshed::GetVersionResponse> Current(
+      const std::shared_ptr<const wandbox::server_config>& config) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (response_config_ != config) {
+      return nullptr;
+    }
+    return response_;
+  }
+
+  // 更新を終えて、待っていた全員にレスポンスを返す
+  void EndUpdate(
+      std::shared_ptr<const wandbox::server_config> config,
+      std::shared_ptr<const wandbox::cattleshed::GetVersionResponse> resp) {
+    std::vector<Waiter> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      response_ = resp;
+      response_config_ = std::move(config);
+      validated_ = std::chrono::steady_clock::now();
+      updating_ = false;
+      waiters = std::move(waiters_);
+      waiters_.clear();
+    }
+    for (auto& w : waiters) {
+      boost::asio::post(*w.ioc, [handler = std::move(w.handler), resp]() {
+        handler(resp);
+      });
+    }
+  }
+
+  // version-command に含まれる絶対パスのファイルの情報から、ツールチェインを識別する文字列を作る。
+  // /bin/sh -c "/usr/bin/g++ --version" のような場合も /usr/bin/g++ を見るようにする。
+  static std::string Identify(const wandbox::compiler_trait& c) {
+    std::string identity = boost::algorithm::join(c.version_command, " ");
+    for (const auto& arg : c.version_command) {
+      std::string token;
+      for (std::size_t i = 0; i <= arg.size(); i++) {
+        const char ch = i < arg.size() ? arg[i] : ' ';
+        if (std::string(" \t\r\n|;&()<>'\"`=").find(ch) == std::string::npos) {
+          token.push_back(ch);
+          continue;
+        }
+        if (!token.empty() && token[0] == '/') {
+          struct stat st;
+          identity += ';' + token;
+          if (::stat(token.c_str(), &st) == 0) {
+            identity += ':' + std::to_string(st.st_dev) + ':' +
+                        std::to_string(st.st_ino) + ':' +
+                        std::to_string(st.st_mtim.tv_sec) + '.' +
+                        std::to_string(st.st_mtim.tv_nsec) + ':' +
+                        std::to_string(st.st_size);
+          }
+        }
+        token.clear();
+      }
+    }
+    for (auto& ch : identity) {
+      if (ch == '\t' || ch == '\n') ch = ' ';
+    }
+    return identity;
+  }
+
+ private:
+  struct Entry {
+    std::string identity;
+    std::string version;
+  };
+  struct Waiter {
+    std::shared_ptr<boost::asio::io_context> ioc;
+    Handler handler;
+  };
+
+  // この時間内に確認したレスポンスは、ファイルを stat せずにそのまま返す
+  static constexpr std::chrono::seconds kRevalidateInterval{10};
+
+  // mutex_ をロックした状態で呼ぶこと
+  void Save() {
+    if (path_.empty()) {
+      return;
+    }
+    const std::string tmp = path_ + ".tmp";
+    {
+      std::ofstream ofs(tmp, std::ios::trunc);
+      for (const auto& e : entries_) {
+        ofs << e.first << '\t' << e.second.identity << '\t' << e.second.version
+            << '\n';
+      }
+      if (!ofs) {
+        SPDLOG_WARN("failed to write version cache: {}", tmp);
+        return;
+      }
+    }
+    if (::rename(tmp.c_str(), path_.c_str()) < 0) {
+      SPDLOG_WARN("failed to rename version cache: {} errno={}", tmp, errno);
+    }
+  }
+
+  std::string path_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::shared_ptr<const wandbox::cattleshed::GetVersionResponse> response_;
+  // response_ を作った時の設定
+  std::shared_ptr<const wandbox::server_config> response_config_;
+  std::chrono::steady_clock::time_point validated_;
+  bool updating_ = false;
+  std::vector<Waiter> waiters_;
+};
+
+#endif  // VERSION_CACHE_H_INCLUDED
@@ -0,0 +1,352 @@
+#ifndef WORKDIR_POOL_H_INCLUDED
+#define WORKDIR_POOL_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+
+// Linux
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+
+// Boost
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "posixapi.hpp"
+
+// ジョブの作業ディレクトリの管理
+//
+// 作業ディレクトリは basedir の下に 256 個のサブディレクトリに分けて作るので、
+// basedir が１つのディレクトリに大量のエントリを持つことは無い。
+// 作業ディレクトリはスレッドプール上で事前にいくつか作っておいて、リクエストが来たらそれを渡す。
+// 使い終わった作業ディレクトリは専用のスレッドで少しずつ削除する。
+// ディスクの使用率が上限を超えている場合は、待たずにどんどん削除する。
+//
+// tmpfs の大きさが指定された場合は、作業ディレクトリに cattlegrid で tmpfs をマウントして、
+// その中に store/ や tmp/ を作る。ジョブが書き込むファイルはディスクには書かれず、
+// 大きさやファイル数の制限はカーネルが行う。事前に作っておくのは tmpfs の大きさごと。
+//
+// カレントディレクトリが basedir になっている前提で、パスは全て basedir からの相対パスで扱う。
+class WorkdirPool : public std::enable_shared_from_this<WorkdirPool> {
+ public:
+  struct Workdir {
+    std::shared_ptr<DIR> dir;
+    // "3f/wandbox_AbC123" のような basedir からの相対パス
+    std::string path;
+  };
+  // tmpfs の大きさ（MiB）と inode 数。大きさが 0 ならディスク上に作る
+  struct Tmpfs {
+    int size = 0;
+    int inodes = 0;
+    bool operator<(const Tmpfs& other) const {
+      return std::tie(size, inodes) < std::tie(other.size, other.inodes);
+    }
+  };
+
+  // size: 事前に作っておく数
+  // reclaim_rate: １秒間に削除する数。0 なら制限無し
+  // disk_usage_max: ディスクの使用率（%）がこれを超えていたら削除の速度制限をしない。0 なら常に制限する
+  // cattlegrid: tmpfs のマウントに使う cattlegrid のパス
+  WorkdirPool(int size, int reclaim_rate, int disk_usage_max,
+              std::string cattlegrid,
+              std::shared_ptr<boost::asio::thread_pool> pool)
+      : size_(size),
+        reclaim_rate_(reclaim_rate),
+        disk_usage_max_(disk_usage_max),
+        cattlegrid_(std::move(cattlegrid)),
+        pool_(std::move(pool)) {}
+
+  ~WorkdirPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    if (reclaimer_.joinable()) {
+      reclaimer_.join();
+    }
+  }
+
+  // 前回の起動時に残った作業ディレクトリを削除対象にして、事前作成と削除を始める。
+  // tmpfs_list: 事前に作っておく tmpfs の大きさの一覧。設定されているジェイルの分を渡す
+  void Start(const std::set<Tmpfs>& tmpfs_list) {
+    std::deque<std::string> leftovers;
+    CollectLeftovers(".", "", &leftovers);
+    for (int i = 0; i < kShards; i++) {
+      const std::string shard = ShardName(i);
+      struct stat st;
+      if (::stat(shard.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        CollectLeftovers(shard, shard + "/", &leftovers);
+      }
+    }
+    SPDLOG_INFO("workdir pool: {} leftover workdirs to reclaim",
+                leftovers.size());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      trash_ = std::move(leftovers);
+    }
+    reclaimer_ = std::thread([this]() { Reclaim(); });
+    for (const auto& tmpfs : tmpfs_list) {
+      Refill(Normalize(tmpfs));
+    }
+  }
+
+  // 作業ディレクトリを取り出す。
+  // 事前に作ったものが無くなっていた場合はここで作る。例外を投げるので注意
+  Workdir Acquire(Tmpfs tmpfs) {
+    tmpfs = Normalize(tmpfs);
+    Workdir w;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& ready = ready_[tmpfs];
+      if (!ready.empty()) {
+        w = std::move(ready.front());
+        ready.pop_front();
+      }
+    }
+    Refill(tmpfs);
+    if (w.dir) {
+      return w;
+    }
+    SPDLOG_WARN("workdir pool is empty, create workdir synchronously: tmpfs={}",
+                tmpfs.size);
+    return Create(tmpfs);
+  }
+
+  // 使い終わった作業ディレクトリを削除対象にする
+  void Release(std::string path) {
+    if (path.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      trash_.push_back(std::move(path));
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  static constexpr int kShards = 256;
+
+  static std::string ShardName(int n) {
+    const char* hex = "0123456789abcdef";
+    return std::string{hex[(n >> 4) & 0xf], hex[n & 0xf]};
+  }
+
+  // ディスク上に作る場合は inode 数を見ないので、同じものとして扱う
+  static Tmpfs Normalize(Tmpfs tmpfs) {
+    if (tmpfs.size <= 0) {
+      return Tmpfs();
+    }
+    return tmpfs;
+  }
+
+  static void CollectLeftovers(const std::string& dirpath,
+                               const std::string& prefix,
+                               std::deque<std::string>* out) {
+    std::shared_ptr<DIR> dir;
+    try {
+      dir = wandbox::opendir(dirpath);
+    } catch (std::system_error& e) {
+      return;
+    }
+    for (auto ent = ::readdir(dir.get()); ent; ent = ::readdir(dir.get())) {
+      if (::strncmp(ent->d_name, "wandbox_", 8) == 0) {
+        out->push_back(prefix + ent->d_name);
+      }
+    }
+  }
+
+  // 例外を投げるので注意
+  Workdir Create(const Tmpfs& tmpfs) {
+    if (tmpfs.size > 0 && cattlegrid_.empty()) {
+      SPDLOG_ERROR("tmpfs-size requires system.cattlegrid");
+      wandbox::throw_system_error(EINVAL);
+    }
+    const std::string shard = ShardName(next_shard_++ % kShards);
+    try {
+      wandbox::mkdir(shard, 0711);
+    } catch (std::system_error& e) {
+      if (e.code().value() != EEXIST) {
+        throw;
+      }
+    }
+    Workdir w;
+    w.path = wandbox::mkdtemp(shard + "/wandbox_XXXXXX");
+    // 途中で失敗したら、作りかけの作業ディレクトリをここで消す
+    try {
+      // サンドボックスのユーザが辿れるようにする
+      if (::chmod(w.path.c_str(), 0711) < 0) {
+        wandbox::throw_system_error(errno);
+      }
+      if (tmpfs.size > 0) {
+        std::vector<std::string> args = {
+            cattlegrid_, "--mount-tmpfs=" + w.path,
+            "--tmpfs-size=" + std::to_string(tmpfs.size)};
+        if (tmpfs.inodes > 0) {
+          args.push_back("--tmpfs-inodes=" + std::to_string(tmpfs.inodes));
+        }
+        const int st = wandbox::spawn_and_wait(args);
+        if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+          SPDLOG_ERROR("failed to mount tmpfs on {}", w.path);
+          wandbox::throw_system_error(EIO);
+        }
+      }
+      // tmpfs をマウントした場合はその中を開く
+      w.dir = wandbox::opendir(w.path);
+      wandbox::mkdirat(w.dir, "store", 0700);
+      wandbox::mkdirat(w.dir, "tmp", 0700);
+      // サンドボックスのルートディレクトリ（cattlegrid の --rootdir）
+      wandbox::mkdirat(w.dir, "jail", 0755);
+    } catch (...) {
+      // 開いたままだと tmpfs を外せない
+      w.dir.reset();
+      if (!Remove(w.path)) {
+        Release(w.path);
+      }
+      throw;
+    }
+    return w;
+  }
+
+  // 足りない分をスレッドプール上で作る
+  void Refill(Tmpfs tmpfs) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (refilling_.count(tmpfs) != 0 || (int)ready_[tmpfs].size() >= size_) {
+        return;
+      }
+      refilling_.insert(tmpfs);
+    }
+    boost::asio::post(*pool_, [self = shared_from_this(), tmpfs]() {
+      while (true) {
+        {
+          std::lock_guard<std::mutex> lock(self->mutex_);
+          if (self->stopped_ ||
+              (int)self->ready_[tmpfs].size() >= self->size_) {
+            self->refilling_.erase(tmpfs);
+            return;
+          }
+        }
+        Workdir w;
+        try {
+          w = self->Create(tmpfs);
+        } catch (std::system_error& e) {
+          SPDLOG_ERROR("failed to create workdir: {}", e.what());
+          std::lock_guard<std::mutex> lock(self->mutex_);
+          self->refilling_.erase(tmpfs);
+          return;
+        }
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        self->ready_[tmpfs].push_back(std::move(w));
+      }
+    });
+  }
+
+  // 作業ディレクトリに tmpfs がマウントされていれば外す
+  void Unmount(const std::string& path) const {
+    struct statfs sf;
+    struct stat st;
+    struct stat parent;
+    const auto slash = path.find_last_of('/');
+    const std::string parent_path =
+        slash == std::string::npos ? "." : path.substr(0, slash);
+    if (::statfs(path.c_str(), &sf) < 0 || sf.f_type != TMPFS_MAGIC ||
+        ::stat(path.c_str(), &st) < 0 ||
+        ::stat(parent_path.c_str(), &parent) < 0 ||
+        st.st_dev == parent.st_dev) {
+      return;
+    }
+    if (cattlegrid_.empty()) {
+      SPDLOG_WARN("cannot unmount tmpfs on {} without system.cattlegrid",
+                  path);
+      return;
+    }
+    const int r =
+        wandbox::spawn_and_wait({cattlegrid_, "--umount-tmpfs=" + path});
+    if (!WIFEXITED(r) || WEXITSTATUS(r) != 0) {
+      SPDLOG_WARN("failed to unmount tmpfs on {}", path);
+    }
+  }
+
+  // 作業ディレクトリを削除する。失敗したら false を返す
+  bool Remove(const std::string& path) const {
+    try {
+      // tmpfs の中身は外すだけで全部消える
+      Unmount(path);
+      wandbox::remove_tree_at(AT_FDCWD, path);
+      SPDLOG_DEBUG("workdir removed: {}", path);
+      return true;
+    } catch (std::system_error& e) {
+      // サンドボックスのユーザの物になっているファイルは消せない
+      SPDLOG_WARN("failed to remove workdir {}: {}", path, e.what());
+      return false;
+    }
+  }
+
+  bool DiskUsageExceeded() const {
+    if (disk_usage_max_ <= 0) {
+      return false;
+    }
+    struct statvfs st;
+    if (::statvfs(".", &st) < 0 || st.f_blocks == 0) {
+      return false;
+    }
+    const double used = 1.0 - (double)st.f_bavail / (double)st.f_blocks;
+    return used * 100 > disk_usage_max_;
+  }
+
+  // 専用のスレッドで動く
+  void Reclaim() {
+    while (true) {
+      std::string path;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stopped_ || !trash_.empty(); });
+        if (stopped_) {
+          return;
+        }
+        path = std::move(trash_.front());
+        trash_.pop_front();
+      }
+
+      Remove(path);
+
+      if (reclaim_rate_ > 0 && !DiskUsageExceeded()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::microseconds(1000000 / reclaim_rate_),
+                     [this]() { return stopped_; });
+      }
+    }
+  }
+
+  int size_;
+  int reclaim_rate_;
+  int disk_usage_max_;
+  std::string cattlegrid_;
+  std::shared_ptr<boost::asio::thread_pool> pool_;
+  std::atomic<unsigned> next_shard_{0};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_ = false;
+  std::set<Tmpfs> refilling_;
+  std::map<Tmpfs, std::deque<Workdir>> ready_;
+  std::deque<std::string> trash_;
+  std::thread reclaimer_;
+};
+
+#endif  // WORKDIR_POOL_H_INCLUDED
@@ -0,0 +1,130 @@
+#ifndef ZYGOTE_SUPERVISOR_H_INCLUDED
+#define ZYGOTE_SUPERVISOR_H_INCLUDED
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Linux
+#include <sys/wait.h>
+
+// Boost
+#include <boost/asio.hpp>
+
+// spdlog
+#include <spdlog/spdlog.h>
+
+#include "job_cgroup.h"
+#include "load_config.hpp"
+#include "posixapi.hpp"
+
+// jail ごとの cattlegrid --zygote の起動と監視
+//
+// zygote-command が設定されている jail は、namespace やマウントの準備を済ませたサンドボックスを
+// cattlegrid --zygote に作って待たせておき、ジョブは jail-command の cattlegrid --attach で
+// それを受け取って実行する。サンドボックスの準備はジョブの実行中に済ませておくので、
+// ジョブの開始時には namespace の作成やマウントを待たなくて良い。
+//
+// zygote が終了した場合は、少し待ってから起動し直す。
+// cgroup-root が設定されている場合は、その下の zygote-<jail> の中で起動する。
+// サンドボックスは実行時にジョブの cgroup に移るので、ジョブの cgroup と共通の親の下に置いておく必要がある。
+//
+// 設定を読み直しても、起動済みの zygote はそのまま使い続ける。
+class ZygoteSupervisor : public std::enable_shared_from_this<ZygoteSupervisor> {
+ public:
+  ZygoteSupervisor(std::shared_ptr<boost::asio::io_context> ioc,
+                   std::string cgroup_root)
+      : ioc_(std::move(ioc)), cgroup_root_(std::move(cgroup_root)) {}
+
+  ~ZygoteSupervisor() {
+    for (const auto& z : zygotes_) {
+      if (z->pid > 0) {
+        ::kill(z->pid, SIGKILL);
+        ::waitpid(z->pid, nullptr, 0);
+      }
+    }
+  }
+
+  void Start(const wandbox::server_config& config) {
+    for (const auto& p : config.jails) {
+      if (p.second.zygote_command.empty()) {
+        continue;
+      }
+      auto z = std::make_shared<Zygote>();
+      z->name = p.first;
+      z->command = p.second.zygote_command;
+      // 前回の起動時のものが残っていたら消しておく
+      if (!cgroup_root_.empty()) {
+        ::rmdir((cgroup_root_ + "/zygote-" + z->name).c_str());
+      }
+      z->cgroup = JobCgroup::Create(cgroup_root_, "zygote-" + z->name,
+                                    wandbox::jail_config());
+      z->timer.reset(new boost::asio::steady_timer(*ioc_));
+      zygotes_.push_back(z);
+      Launch(z);
+    }
+  }
+
+ private:
+  struct Zygote {
+    std::string name;
+    std::vector<std::string> command;
+    std::shared_ptr<JobCgroup> cgroup;
+    pid_t pid = 0;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> pidfd;
+    std::unique_ptr<boost::asio::steady_timer> timer;
+  };
+
+  void Launch(std::shared_ptr<Zygote> z) {
+    wandbox::unique_fd pidfd(-1);
+    try {
+      z->pid = wandbox::spawn_detached(
+          z->command, z->cgroup ? z->cgroup->fd() : -1, pidfd);
+    } catch (std::system_error& e) {
+      SPDLOG_ERROR("failed to launch zygote for {}: {}", z->name, e.what());
+      z->pid = 0;
+      Relaunch(z);
+      return;
+    }
+    SPDLOG_INFO("zygote for {} launched: pid={}", z->name, z->pid);
+    if (!pidfd) {
+      // pidfd が使えないカーネルでは終了を監視できないので、起動し直しはしない
+      SPDLOG_WARN("pidfd_open is not available, zygote for {} is not watched",
+                  z->name);
+      return;
+    }
+    z->pidfd.reset(
+        new boost::asio::posix::stream_descriptor(*ioc_, pidfd.release()));
+    z->pidfd->async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        [self = shared_from_this(), z](const boost::system::error_code& ec) {
+          if (ec) {
+            return;
+          }
+          int st = 0;
+          ::waitpid(z->pid, &st, 0);
+          SPDLOG_WARN("zygote for {} exited: pid={} status={}", z->name,
+                      z->pid, st);
+          z->pid = 0;
+          z->pidfd.reset();
+          self->Relaunch(z);
+        });
+  }
+
+  void Relaunch(std::shared_ptr<Zygote> z) {
+    z->timer->expires_after(std::chrono::seconds(1));
+    z->timer->async_wait(
+        [self = shared_from_this(), z](const boost::system::error_code& ec) {
+          if (!ec) {
+            self->Launch(z);
+          }
+        });
+  }
+
+  std::shared_ptr<boost::asio::io_context> ioc_;
+  std::string cgroup_root_;
+  std::vector<std::shared_ptr<Zygote>> zygotes_;
+};
+
+#endif  // ZYGOTE_SUPERVISOR_H_INCLUDED
@@ -0,0 +1,243 @@
+// load_config.cc のテスト
+//
+// 使い方: load_config_test <設定ファイル>...
+//
+// 渡された設定ファイルを以前の Spirit のパーサと今の mmap のパーサの両方で読んで、
+// 同じ値になることを確認する。
+// 加えて、空のファイルや継承の解決（存在しない継承元、循環）の動作も確認する。
+
+// 内部の関数を直接呼ぶため、実装ファイルをそのまま取り込む
+#include "load_config.cc"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <boost/spirit/include/qi.hpp>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace wandbox {
+namespace cfg {
+
+// boost::variant の比較に必要
+inline bool operator==(const wandbox_cfg_tag&, const wandbox_cfg_tag&) {
+  return true;
+}
+
+namespace old {
+
+namespace qi = boost::spirit::qi;
+
+// 以前 load_config.cc で使っていた文法そのまま
+template <typename Iter>
+struct config_grammar : qi::grammar<Iter, value(), qi::space_type> {
+  config_grammar() : qi::grammar<Iter, value(), qi::space_type>(top) {
+    top %= (obj | arr) > qi::eoi;
+    val %= obj | arr | str | qi::int_ | qi::bool_;
+    pair %= str > ':' > val;
+    obj %= '{' > (((pair % ',') > -qi::lit(',')) | qi::eps) > '}';
+    arr %= '[' > (((val % ',') > -qi::lit(',')) | qi::eps) > ']';
+    str %= qi::lexeme['\"' > *(('\\' > (qi::char_("\\\"'") |
+                                        (qi::lit('t') > qi::attr('\t')) |
+                                        (qi::lit('r') > qi::attr('\r')) |
+                                        (qi::lit('n') > qi::attr('\n')))) |
+                               (qi::char_ - '\"')) > '\"'];
+  }
+  qi::rule<Iter, value(), qi::space_type> top;
+  qi::rule<Iter, std::pair<string, value>(), qi::space_type> pair;
+  qi::rule<Iter, object(), qi::space_type> obj;
+  qi::rule<Iter, array(), qi::space_type> arr;
+  qi::rule<Iter, value(), qi::space_type> val;
+  qi::rule<Iter, string(), qi::space_type> str;
+};
+
+// 以前の read_single_config_file と同じく、パースに失敗しても結果は見ない
+value parse(const std::string& text) {
+  auto first = text.begin();
+  const auto last = text.end();
+  value o;
+  try {
+    qi::phrase_parse(first, last, config_grammar<decltype(first)>(), qi::space,
+                     o);
+  } catch (qi::expectation_failure<decltype(first)>&) {
+    throw parse_error("old parser failed");
+  }
+  return o;
+}
+
+}  // namespace old
+}  // namespace cfg
+}  // namespace wandbox
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(expr)                                                 \
+  do {                                                              \
+    if (!(expr)) {                                                  \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " \
+                << #expr << std::endl;                              \
+      ++failures;                                                   \
+    }                                                               \
+  } while (0)
+
+using wandbox::compiler_set;
+using wandbox::compiler_trait;
+namespace cfg = wandbox::cfg;
+
+std::string read_file(const std::string& path) {
+  std::ifstream ifs(path);
+  return std::string(std::istreambuf_iterator<char>(ifs),
+                     std::istreambuf_iterator<char>());
+}
+
+// 一時ファイルに書いて、そのパスを返す
+std::string write_temp(const std::string& text) {
+  char path[] = "/tmp/load_config_test.XXXXXX";
+  const int fd = ::mkstemp(path);
+  if (fd == -1) {
+    std::cerr << "mkstemp failed" << std::endl;
+    std::exit(1);
+  }
+  if (!text.empty() && ::write(fd, text.data(), text.size()) !=
+                           static_cast<ssize_t>(text.size())) {
+    std::cerr << "write failed" << std::endl;
+    std::exit(1);
+  }
+  ::close(fd);
+  return path;
+}
+
+cfg::value parse_new(const std::string& text) {
+  return cfg::config_parser("<test>", text.data(), text.data() + text.size())
+      .parse();
+}
+
+const compiler_trait* find_compiler(const compiler_set& cs,
+                                    const std::string& name) {
+  const auto it = cs.get<1>().find(name);
+  return it == cs.get<1>().end() ? nullptr : &*it;
+}
+
+// 設定ファイルを以前のパーサと今のパーサで読んで比べる
+void test_same_as_old_parser(const std::string& path) {
+  const auto text = read_file(path);
+  CHECK(!text.empty());
+  const auto expected = cfg::old::parse(text);
+  const auto actual = wandbox::read_single_config_file(nullptr, path);
+  CHECK(!boost::get<cfg::wandbox_cfg_tag>(&actual));
+  if (!(expected == actual)) {
+    std::cerr << path << ": parsed values differ" << std::endl;
+    ++failures;
+  }
+}
+
+// 全部の設定ファイルをまとめて読み込めること
+void test_load_config(const std::vector<std::string>& paths) {
+  const auto config = wandbox::load_config(paths);
+  CHECK(!config.compilers.empty());
+  CHECK(!config.jails.empty());
+}
+
+void test_empty_file(const std::vector<std::string>& paths) {
+  for (const std::string text : {"", " \n\t\n"}) {
+    const auto path = write_temp(text);
+    // 以前のパーサと同じく、何も設定していない値になる
+    const auto v = wandbox::read_single_config_file(nullptr, path);
+    CHECK(boost::get<cfg::wandbox_cfg_tag>(&v) != nullptr);
+    CHECK(cfg::old::parse(text) == v);
+
+    // 他の設定ファイルとマージしても何も変わらない
+    if (!paths.empty()) {
+      auto with_empty = paths;
+      with_empty.push_back(path);
+      CHECK(wandbox::load_config(with_empty).compilers.size() ==
+            wandbox::load_config(paths).compilers.size());
+    }
+    ::unlink(path.c_str());
+  }
+}
+
+// 不正な設定は、どちらのパーサも受け付けない
+void test_parse_error() {
+  for (const std::string text :
+       {"{", "{\"a\":}", "{\"a\":1} x", "\"a\"", "{\"a\":\"b}"}) {
+    bool new_failed = false;
+    try {
+      parse_new(text);
+    } catch (cfg::parse_error&) {
+      new_failed = true;
+    }
+    CHECK(new_failed);
+  }
+  // 末尾のカンマは許す
+  CHECK(parse_new("{\"a\":[1,2,],}") == cfg::old::parse("{\"a\":[1,2,],}"));
+}
+
+void test_inherits() {
+  const auto cs = wandbox::load_compiler_trait(parse_new(R"({
+    "compilers": [
+      {"name": "base", "language": "C++", "compile-command": ["cc"],
+       "display-name": "base"},
+      {"name": "child", "inherits": "mid", "display-name": "child"},
+      {"name": "mid", "inherits": "base", "run-command": ["./a.out"]},
+      {"name": "orphan", "inherits": "missing"},
+      {"name": "orphan-child", "inherits": "orphan"},
+      {"name": "cycle-a", "inherits": "cycle-b"},
+      {"name": "cycle-b", "inherits": "cycle-a"},
+      {"name": "cycle-child", "inherits": "cycle-a"},
+    ],
+  })"));
+  CHECK(cs.size() == 8);
+
+  // 後ろで定義されているコンパイラを継承していても、継承元から解決する
+  const auto* child = find_compiler(cs, "child");
+  CHECK(child != nullptr);
+  if (child != nullptr) {
+    CHECK(child->language == "C++");
+    CHECK(child->compile_command == std::vector<std::string>{"cc"});
+    CHECK(child->run_command == std::vector<std::string>{"./a.out"});
+    CHECK(child->display_name == "child");
+  }
+
+  // 存在しないコンパイラを継承している場合は、そのコンパイラと継承先を解決しない
+  for (const auto* name : {"orphan", "orphan-child"}) {
+    const auto* c = find_compiler(cs, name);
+    CHECK(c != nullptr);
+    if (c != nullptr) CHECK(c->language.empty());
+  }
+
+  // 循環している場合も解決しない
+  for (const auto* name : {"cycle-a", "cycle-b", "cycle-child"}) {
+    const auto* c = find_compiler(cs, name);
+    CHECK(c != nullptr);
+    if (c != nullptr) CHECK(c->language.empty());
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  spdlog::set_level(spdlog::level::warn);
+
+  const std::vector<std::string> paths(argv + 1, argv + argc);
+  for (const auto& path : paths) {
+    test_same_as_old_parser(path);
+  }
+  if (!paths.empty()) {
+    test_load_config(paths);
+  }
+  test_empty_file(paths);
+  test_parse_error();
+  test_inherits();
+
+  if (failures != 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cout << "ok" << std::endl;
+  return 0;
+}
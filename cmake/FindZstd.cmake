@@ -0,0 +1,16 @@
+find_path(Zstd_INCLUDE_DIR NAMES zstd.h)
+find_library(Zstd_LIBRARY NAMES zstd)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd DEFAULT_MSG Zstd_LIBRARY Zstd_INCLUDE_DIR)
+
+mark_as_advanced(Zstd_INCLUDE_DIR Zstd_LIBRARY)
+
+if(Zstd_FOUND)
+  if(NOT TARGET Zstd::Zstd)
+    add_library(Zstd::Zstd UNKNOWN IMPORTED)
+    set_target_properties(Zstd::Zstd PROPERTIES
+      INTERFACE_INCLUDE_DIRECTORIES "${Zstd_INCLUDE_DIR}"
+      IMPORTED_LOCATION "${Zstd_LIBRARY}")
+  endif()
+endif()
@@ -82,6 +82,18 @@ static void update_compile_result(
     result.status += resp.data();
   } else if (resp.type() == wandbox::cattleshed::RunJobResponse::SIGNAL) {
     result.signal += resp.data();
+  } else if (resp.type() == wandbox::cattleshed::RunJobResponse::USAGE) {
+    std::exception_ptr ep;
+    auto usage =
+        jsonif::from_json<wandbox::kennel::ResourceUsage>(resp.data(), ep);
+    if (ep) {
+      return;
+    }
+    if (usage.phase == "compile") {
+      result.compiler_usage = std::move(usage);
+    } else {
+      result.program_usage = std::move(usage);
+    }
   } else {
     //append(result["error"], resp.data());
   }
@@ -104,6 +116,8 @@ static std::string response_type_to_string(
       return "ExitCode";
     case wandbox::cattleshed::RunJobResponse::SIGNAL:
       return "Signal";
+    case wandbox::cattleshed::RunJobResponse::USAGE:
+      return "Usage";
     default:
       return "";
   }
@@ -125,6 +139,8 @@ static wandbox::cattleshed::RunJobResponse::Type string_to_response_type(
     return wandbox::cattleshed::RunJobResponse::EXIT_CODE;
   } else if (str == "Signal") {
     return wandbox::cattleshed::RunJobResponse::SIGNAL;
+  } else if (str == "Usage") {
+    return wandbox::cattleshed::RunJobResponse::USAGE;
   }
   return wandbox::cattleshed::RunJobResponse::CONTROL;
 }
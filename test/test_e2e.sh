@@ -20,7 +20,7 @@ set -ex
 
 mkdir -p _tmp
 
-$BUILD_DIR/cattleshed/cattleshed --log-level=trace -c $BUILD_DIR/cattleshed/cattleshed.conf -c ../cattleshed/compiler.default &
+$BUILD_DIR/cattleshed/cattleshed --log-level=trace -c $BUILD_DIR/cattleshed/cattleshed.conf -c ../cattleshed/compiler.default -c $BUILD_DIR/zygote.conf &
 CATTLESHED_PID=$!
 
 sleep 1
@@ -35,6 +35,12 @@ sleep 2
 URL="http://localhost:3500"
 CURL="curl -H X-Real-IP:127.0.0.1"
 
+# 実行時間などは毎回変わるので比較する前に取り除く
+strip_usage() {
+  sed -E 's/,"(compiler|program)_usage":\{[^}]*\}//g' "$1" > "$1.stripped"
+  mv "$1.stripped" "$1"
+}
+
 # list.json のテスト
 $CURL -f $URL/api/list.json > _tmp/actual_api_list.json
 if ! diff -u assets/expected_api_list.json _tmp/actual_api_list.json; then
@@ -44,17 +50,36 @@ fi
 
 # コンパイルのテスト
 $CURL -f -H "Content-type: application/json" -d @assets/test.json  $URL/api/compile.json > _tmp/actual_api_compile.json
+if ! jq -e '.program_usage.wall_time_us > 0' _tmp/actual_api_compile.json; then
+  echo "failed test /api/compile.json usage" 1>&2
+  exit 1
+fi
+strip_usage _tmp/actual_api_compile.json
 if ! diff -u assets/expected_api_compile.json _tmp/actual_api_compile.json; then
   echo "failed test /api/compile.json" 1>&2
   exit 1
 fi
 
-$CURL -v -f -H "Content-type: application/json" -d @assets/test.json  $URL/api/compile.ndjson > _tmp/actual_api_compile.ndjson
+$CURL -v -f -H "Content-type: application/json" -d @assets/test.json  $URL/api/compile.ndjson > _tmp/actual_api_compile_raw.ndjson
+if ! grep -q '^{"type":"Usage"' _tmp/actual_api_compile_raw.ndjson; then
+  echo "failed test /api/compile.ndjson usage" 1>&2
+  exit 1
+fi
+grep -v '^{"type":"Usage"' _tmp/actual_api_compile_raw.ndjson > _tmp/actual_api_compile.ndjson
 if ! diff -u assets/expected_api_compile.ndjson _tmp/actual_api_compile.ndjson; then
   echo "failed test /api/compile.ndjson" 1>&2
   exit 1
 fi
 
+# zygote で待たせておいたサンドボックスで実行するテスト。
+# 作業ディレクトリと /tmp は --attach から渡されたマウントなので、読み書きできることも確認する
+$CURL -f -H "Content-type: application/json" -d @assets/test_zygote.json  $URL/api/compile.json > _tmp/actual_zygote.json
+if ! jq -e '.status == "0" and .program_output == "foo\nbar\n"' _tmp/actual_zygote.json; then
+  cat _tmp/actual_zygote.json
+  echo "failed test zygote" 1>&2
+  exit 1
+fi
+
 # permlink あたりのテスト
 
 # 以下のような結果から jq する
@@ -71,6 +96,7 @@ fi
 
 # https://github.com/melpon/wandbox/issues/299
 $CURL -f -H "Content-type: application/json" -d @assets/test_issue299.json  $URL/api/compile.json > _tmp/actual_issue299.json
+strip_usage _tmp/actual_issue299.json
 if ! diff -u assets/expected_issue299.json _tmp/actual_issue299.json; then
   echo "failed test /api/compile.json" 1>&2
   exit 1
@@ -84,12 +110,13 @@ if [ "$OUTPUT_SIGNAL" != "Killed" ]; then
 fi
 # 無限 fork の後も正常に動作するか確認する
 $CURL -f -H "Content-type: application/json" -d @assets/test.json  $URL/api/compile.json > _tmp/actual_api_compile.json
+strip_usage _tmp/actual_api_compile.json
 if ! diff -u assets/expected_api_compile.json _tmp/actual_api_compile.json; then
   echo "failed test fork" 1>&2
   exit 1
 fi
-# cattlegrid プロセスは１個もいないはず
-if [ `ps -ef | grep cattlegrid | grep -v grep | wc -l` -ne 0 ]; then
+# cattlegrid プロセスは（常駐している zygote と、それが待たせているサンドボックス以外は）１個もいないはず
+if [ `ps -ef | grep cattlegrid | grep -v grep | grep -v -- --zygote= | wc -l` -ne 0 ]; then
   ps -ef | grep cattlegrid | grep -v grep
   echo "failed test fork" 1>&2
   exit 1
@@ -102,11 +129,12 @@ if [ "$OUTPUT_SIGNAL" != "File size limit exceeded" ]; then
   exit 1
 fi
 $CURL -f -H "Content-type: application/json" -d @assets/test.json  $URL/api/compile.json > _tmp/actual_api_compile.json
+strip_usage _tmp/actual_api_compile.json
 if ! diff -u assets/expected_api_compile.json _tmp/actual_api_compile.json; then
   echo "failed test /api/compile.json" 1>&2
   exit 1
 fi
-if [ `ps -ef | grep cattlegrid | grep -v grep | wc -l` -ne 0 ]; then
+if [ `ps -ef | grep cattlegrid | grep -v grep | grep -v -- --zygote= | wc -l` -ne 0 ]; then
   ps -ef | grep cattlegrid | grep -v grep
   echo "failed test fork" 1>&2
   exit 1